@@ -15,15 +15,77 @@
 */
 
 #include "ArduinoComparer.h"
+#include <FFT.h>
+#include <ParallelFor.h>
+#include <SquaredErrorKernel.h>
 #include <vrpn_Shared.h>
+#include <stdlib.h>
 #include <algorithm>
+#include <limits>
+#include <random>
 #include <iostream>
+#include <cmath>
 
-static size_t ARDUINO_MAX = 1023;
+void ReportColumns::add(const std::vector<DeviceThreadReport> &reports)
+{
+  for (size_t i = 0; i < reports.size(); i++) {
+    const DeviceThreadReport &r = reports[i];
+    if (!empty()) {
+      if (r.sampleTime < m_sampleTimes.back()) {
+        m_lastOutOfOrder[0] = m_discarded + size();
+      }
+      if (r.arrivalTime < m_arrivalTimes.back()) {
+        m_lastOutOfOrder[1] = m_discarded + size();
+      }
+    }
+    m_sampleTimes.push_back(r.sampleTime);
+    m_arrivalTimes.push_back(r.arrivalTime);
+    m_sizes.push_back(static_cast<uint16_t>(r.values.size()));
+
+    // Each channel has an entry for every report, so that they all
+    // line up; reports without the channel get a 0 that is never read.
+    while (m_channels.size() < r.values.size()) {
+      m_channels.push_back(std::deque<double>(m_sampleTimes.size() - 1, 0.0));
+    }
+    for (size_t c = 0; c < m_channels.size(); c++) {
+      m_channels[c].push_back(c < r.values.size() ? r.values[c] : 0.0);
+    }
+  }
+}
+
+void ReportColumns::discardOldest(size_t count)
+{
+  count = std::min(count, size());
+  m_discarded += count;
+  m_sampleTimes.erase(m_sampleTimes.begin(), m_sampleTimes.begin() + count);
+  m_arrivalTimes.erase(m_arrivalTimes.begin(), m_arrivalTimes.begin() + count);
+  m_sizes.erase(m_sizes.begin(), m_sizes.begin() + count);
+  for (size_t c = 0; c < m_channels.size(); c++) {
+    m_channels[c].erase(m_channels[c].begin(), m_channels[c].begin() + count);
+  }
+}
+
+void ReportColumns::discardBefore(DeviceThreadTime t, bool arrivalTime)
+{
+  size_t count = 0;
+  while ( (count < size()) && (time(count, arrivalTime) < t) ) {
+    count++;
+  }
+  discardOldest(count);
+}
+
+void ReportColumns::clear()
+{
+  m_discarded += size();
+  m_sampleTimes.clear();
+  m_arrivalTimes.clear();
+  m_sizes.clear();
+  m_channels.clear();
+}
 
 Trajectory::Trajectory(
       const std::vector<DeviceThreadReport> &reports  //< Holds the values to fill in
-      , struct timeval start                    //< Defines 0 seconds
+      , DeviceThreadTime start                  //< Defines 0 seconds
       , int index                               //< Which value to use from the reports
       , bool arrivalTime                        //< Use arrival time rather than reported time
 )
@@ -37,9 +99,9 @@ Trajectory::Trajectory(
       Entry e;
       e.m_value = reports[i].values[index];
       if (arrivalTime) {
-        e.m_time = vrpn_TimevalDurationSeconds(reports[i].arrivalTime, start);
+        e.m_time = DeviceThreadSeconds(reports[i].arrivalTime - start);
       } else {
-        e.m_time = vrpn_TimevalDurationSeconds(reports[i].sampleTime, start);
+        e.m_time = DeviceThreadSeconds(reports[i].sampleTime - start);
       }
       m_entries.push_back(e);
     }
@@ -49,6 +111,98 @@ Trajectory::Trajectory(
   std::sort(m_entries.begin(), m_entries.end());
 }
 
+Trajectory::Trajectory(
+      const ReportColumns &reports              //< Holds the values to fill in
+      , DeviceThreadTime start                  //< Defines 0 seconds
+      , int index                               //< Which value to use from the reports
+      , bool arrivalTime                        //< Use arrival time rather than reported time
+)
+{
+  extend(reports, 0, start, index, arrivalTime);
+}
+
+void Trajectory::extend(const ReportColumns &reports, size_t first,
+  DeviceThreadTime start, int index, bool arrivalTime)
+{
+  if (index < 0) { return; }
+
+  // Insert all reports that have a value with the specified index.
+  // Their time is with respect to the base time.
+  size_t before = m_entries.size();
+  if (before == 0) {
+    m_entries.reserve(reports.size());
+  }
+  for (size_t i = first; i < reports.size(); i++) {
+    Entry e;
+    if (reports.value(i, index, e.m_value)) {
+      e.m_time = DeviceThreadSeconds(reports.time(i, arrivalTime) - start);
+      m_entries.push_back(e);
+    }
+  }
+
+  // Sort the new entries.  If they don't all come after the ones we
+  // already had, merge the two.
+  std::sort(m_entries.begin() + before, m_entries.end());
+  if ( (before > 0) && (before < m_entries.size())
+      && (m_entries[before] < m_entries[before - 1]) ) {
+    std::inplace_merge(m_entries.begin(), m_entries.begin() + before, m_entries.end());
+  }
+}
+
+double Trajectory::extremumTime(size_t index) const
+{
+  // Find the run of entries with the same value.  If it reaches either
+  // end, there is nothing past it to fit to.
+  double value = m_entries[index].m_value;
+  size_t first = index, last = index;
+  while ( (first > 0) && (m_entries[first - 1].m_value == value) ) {
+    first--;
+  }
+  while ( (last + 1 < m_entries.size()) && (m_entries[last + 1].m_value == value) ) {
+    last++;
+  }
+  if ( (first < last) || (first == 0) || (last + 1 == m_entries.size()) ) {
+    return (m_entries[first].m_time + m_entries[last].m_time) / 2;
+  }
+
+  // Fit v = a x^2 + b x + v1 through the entry and its neighbors, with x
+  // the time from the entry, and find its vertex.
+  double t1 = m_entries[index].m_time;
+  double x0 = m_entries[index - 1].m_time - t1;
+  double x2 = m_entries[index + 1].m_time - t1;
+  double d0 = m_entries[index - 1].m_value - value;
+  double d2 = m_entries[index + 1].m_value - value;
+  double det = x0 * x2 * (x0 - x2);
+  double a = (d0 * x2 - d2 * x0) / det;
+  double b = (d2 * x0 * x0 - d0 * x2 * x2) / det;
+  if ( (det == 0) || (a == 0) ) {
+    return t1;
+  }
+  double x = std::max(x0, std::min(x2, -b / (2 * a)));
+  return t1 + x;
+}
+
+void Trajectory::discardBefore(double seconds)
+{
+  Entry e;
+  e.m_time = seconds;
+  m_entries.erase(m_entries.begin(),
+    std::lower_bound(m_entries.begin(), m_entries.end(), e));
+}
+
+Trajectory::Trajectory(const Trajectory &whole, size_t first, size_t last)
+  : m_entries(whole.m_entries.begin() + first, whole.m_entries.begin() + last)
+{
+}
+
+Trajectory::Trajectory(const Trajectory &whole, const std::vector<size_t> &indices)
+{
+  m_entries.reserve(indices.size());
+  for (size_t i = 0; i < indices.size(); i++) {
+    m_entries.push_back(whole.m_entries[indices[i]]);
+  }
+}
+
 double Trajectory::lookup(double seconds) const
 {
   // Handle the boundary cases.
@@ -61,16 +215,20 @@ double Trajectory::lookup(double seconds) const
   e.m_time = seconds;
   std::vector<Entry>::const_iterator ge =
       std::lower_bound(m_entries.begin(), m_entries.end(), e);
-  if (ge->m_time == e.m_time) {
+  return valueAt(ge - m_entries.begin(), seconds);
+}
+
+double Trajectory::valueAt(size_t ge_index, double seconds) const
+{
+  if (m_entries[ge_index].m_time == seconds) {
     // We found an entry with the same time -- return it.
-    return ge->m_value;
+    return m_entries[ge_index].m_value;
   } else {
     // We found the first entry greater than the time requested, and we
     // know that the value is greater than the first entry and less than
     // the last, so there must be a less-than value right before it.
     // Do linear interpolation between the previous and found value and
     // return the result.
-    size_t ge_index = ge - m_entries.begin();
     size_t previous_index = ge_index - 1;
     double dT = m_entries[ge_index].m_time - m_entries[previous_index].m_time;
     double dV = m_entries[ge_index].m_value - m_entries[previous_index].m_value;
@@ -79,19 +237,102 @@ double Trajectory::lookup(double seconds) const
   }
 }
 
-ArduinoComparer::ArduinoComparer()
+void Trajectory::lookupSorted(const std::vector<double> &seconds,
+  std::vector<double> &outValues) const
+{
+  outValues.resize(seconds.size());
+  Cursor cursor(*this);
+  for (size_t i = 0; i < seconds.size(); i++) {
+    outValues[i] = cursor.lookup(seconds[i]);
+  }
+}
+
+void Trajectory::findTurnarounds(double threshold,
+  std::vector<size_t> &outIndices) const
+{
+  outIndices.clear();
+  if (m_entries.empty()) { return; }
+  int direction = 1;  //< 1 for going up, -1 for going down
+  size_t extremum = 0;
+  for (size_t i = 1; i < m_entries.size(); i++) {
+    double offset = m_entries[i].m_value - m_entries[extremum].m_value;
+    if (offset * direction > 0) {
+      // Still going the same way; this is the farthest yet.
+      extremum = i;
+    } else if (fabs(offset) > threshold) {
+      // Came back far enough that the farthest point was a turnaround.
+      outIndices.push_back(extremum);
+      direction *= -1;
+      extremum = i;
+    }
+  }
+}
+
+double Trajectory::Cursor::lookup(double seconds)
 {
-  // Fill in the mapping vector with empties.
-  std::vector<double> emptyVec;
-  for (size_t i = 0; i <= ARDUINO_MAX; i++) {
-    m_mappingVector.push_back(emptyVec);
+  // Handle the boundary cases just as Trajectory::lookup() does.
+  const std::vector<Entry> &entries = m_trajectory.m_entries;
+  if (entries.size() == 0) { return 0; }
+  if (seconds <= entries.front().m_time) { return entries.front().m_value; }
+  if (seconds >= entries.back().m_time) { return entries.back().m_value; }
+
+  // If this is the first lookup or we've gone back in time, search for
+  // the place.  Otherwise move forward to the first entry that is >= the
+  // requested time, which is the one std::lower_bound() would find.  We
+  // know the last entry is past the time, so we won't run off the end.
+  Entry e;
+  e.m_time = seconds;
+  if ( (m_next == 0) || (entries[m_next - 1].m_time >= seconds) ) {
+    m_next = std::lower_bound(entries.begin(), entries.end(), e) - entries.begin();
+  }
+  // The next time is usually within a step or two, but when the lookups
+  // are sparse it can be far ahead, so double the step each time until
+  // we pass it and then search the last step.  Entries before 'behind'
+  // are known to be before the time.
+  size_t behind = m_next;
+  size_t step = 1;
+  while (entries[m_next].m_time < seconds) {
+    behind = m_next + 1;
+    m_next = std::min(m_next + step, entries.size() - 1);
+    step *= 2;
   }
+  m_next = std::lower_bound(entries.begin() + behind,
+    entries.begin() + m_next, e) - entries.begin();
+  return m_trajectory.valueAt(m_next, seconds);
+}
+
+// Value below which a fraction of the sorted values fall, interpolating
+// between neighbors.
+static double Percentile(const std::vector<double> &sorted, double fraction)
+{
+  double position = fraction * (sorted.size() - 1);
+  size_t below = static_cast<size_t>(floor(position));
+  if (below + 1 >= sorted.size()) { return sorted.back(); }
+  double frac = position - below;
+  return sorted[below] + frac * (sorted[below + 1] - sorted[below]);
+}
+
+ArduinoComparer::ArduinoComparer(size_t arduinoMax)
+  : m_arduinoMax(arduinoMax)
+{
+  // Start with empty bins and an all-zero mapping.
+  m_mappingSum.resize(m_arduinoMax + 1, 0.0);
+  m_mappingCount.resize(m_arduinoMax + 1, 0);
+  m_mappingMean.resize(m_arduinoMax + 1, 0.0);
 
   // Fill in the minimum and maximum Arduino values with
   // results that will be overridden whenever an entry is
   // made.
-  m_minArduinoValue = ARDUINO_MAX;
+  m_minArduinoValue = m_arduinoMax;
   m_maxArduinoValue = 0;
+
+  // Keep all of the reports unless told otherwise.
+  m_retentionWindow = 0;
+  m_retentionCount = 0;
+
+  // No trajectories yet.
+  m_trajectoryStart[0] = m_trajectoryStart[1] = 0;
+  m_haveTrajectoryStart[0] = m_haveTrajectoryStart[1] = false;
 }
 
 ArduinoComparer::~ArduinoComparer()
@@ -100,14 +341,16 @@ ArduinoComparer::~ArduinoComparer()
 
 bool ArduinoComparer::addMapping(double arduinoVal, double deviceVal)
 {
-  if ( (arduinoVal < 0) || (arduinoVal > ARDUINO_MAX) ) {
+  if ( (arduinoVal < 0) || (arduinoVal > m_arduinoMax) ) {
     return false;
   }
 
   // Add the mapping and keep track of the minimum and maximum
-  // Arduino values that have been mapped.
+  // Arduino values that have been mapped.  Each bin only needs the
+  // sum and count of its device values to compute their mean.
   size_t index = static_cast<size_t>(arduinoVal);
-  m_mappingVector[index].push_back(deviceVal);
+  m_mappingSum[index] += deviceVal;
+  m_mappingCount[index]++;
   if (index < m_minArduinoValue) { m_minArduinoValue = index; }
   if (index > m_maxArduinoValue) { m_maxArduinoValue = index; }
   return true;
@@ -124,16 +367,12 @@ bool ArduinoComparer::constructMapping(size_t &outNumInterp)
   // Compute the range over which we have values and the average value
   // of the readings in each bin to use for our lookup table mapping from
   // Arduino reading to Analog reading.
-  for (size_t i = 0; i <= ARDUINO_MAX; i++) {
-    double sum = 0;
-    size_t count = m_mappingVector[i].size();
-    for (size_t j = 0; j < count; j++) {
-      sum += m_mappingVector[i][j];
-    }
+  for (size_t i = 0; i <= m_arduinoMax; i++) {
+    size_t count = m_mappingCount[i];
     if (count > 0) {
-      m_mappingMean.push_back(sum/count);
+      m_mappingMean[i] = m_mappingSum[i] / count;
     } else {
-      m_mappingMean.push_back(0);
+      m_mappingMean[i] = 0;
     }
   }
 
@@ -143,13 +382,13 @@ bool ArduinoComparer::constructMapping(size_t &outNumInterp)
   // report it.
   outNumInterp = 0;
   for (size_t i = m_minArduinoValue+1; i < m_maxArduinoValue; i++) {
-    if (m_mappingVector[i].size() == 0) {
+    if (m_mappingCount[i] == 0) {
 
       // Find the location of the next valid value.
       // Because m_maxArduinoValue has a value, we're guaranteed to
       // find one.
       size_t nextVal = i+1;
-      while (m_mappingVector[nextVal].size() == 0) {
+      while (m_mappingCount[nextVal] == 0) {
         nextVal++;
       }
 
@@ -184,6 +423,45 @@ double ArduinoComparer::getDeviceValueFor(size_t arduinoValue) const
   return m_mappingMean[arduinoValue];  
 }
 
+bool ArduinoComparer::setLatencySearch(const LatencySearchOptions &options)
+{
+  if ( (options.maxSeconds <= options.minSeconds)
+      || (options.coarseStepSeconds <= 0) || (options.toleranceSeconds <= 0)
+      || (options.sampleSeconds <= 0) ) {
+    std::cerr << "ArduinoComparer::setLatencySearch(): Bad search range or step" << std::endl;
+    return false;
+  }
+  m_latencySearch = options;
+  return true;
+}
+
+bool ArduinoComparer::latencyEstimatorFromName(const std::string &name,
+  LatencyEstimator &outEstimator)
+{
+  if (name == "search") {
+    outEstimator = LATENCY_ESTIMATOR_ERROR_SEARCH;
+  } else if (name == "xcorr") {
+    outEstimator = LATENCY_ESTIMATOR_CROSS_CORRELATION;
+  } else if (name == "extrema") {
+    outEstimator = LATENCY_ESTIMATOR_EXTREMUM_ALIGNMENT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *ArduinoComparer::latencyEstimatorDescription(LatencyEstimator estimator)
+{
+  switch (estimator) {
+    case LATENCY_ESTIMATOR_CROSS_CORRELATION:
+      return "Cross-correlation";
+    case LATENCY_ESTIMATOR_EXTREMUM_ALIGNMENT:
+      return "Extremum-alignment";
+    default:
+      return "Error-minimizing";
+  }
+}
+
 bool ArduinoComparer::addArduinoReports(std::vector<DeviceThreadReport> &r)
 {
   // Make sure we have entries to read.
@@ -191,7 +469,8 @@ bool ArduinoComparer::addArduinoReports(std::vector<DeviceThreadReport> &r)
     return false;
   }
 
-  m_arduinoReports.insert(m_arduinoReports.end(), r.begin(), r.end());
+  m_arduinoReports.add(r);
+  applyRetention(m_arduinoReports);
   return true;
 }
 
@@ -202,10 +481,38 @@ bool ArduinoComparer::addDeviceReports(std::vector<DeviceThreadReport> &r)
     return false;
   }
 
-  m_deviceReports.insert(m_deviceReports.end(), r.begin(), r.end());
+  m_deviceReports.add(r);
+  applyRetention(m_deviceReports);
   return true;
 }
 
+void ArduinoComparer::setReportRetention(double windowSeconds, size_t maxReports)
+{
+  m_retentionWindow = static_cast<DeviceThreadTime>(windowSeconds * 1e9);
+  m_retentionCount = maxReports;
+  applyRetention(m_arduinoReports);
+  applyRetention(m_deviceReports);
+}
+
+void ArduinoComparer::applyRetention(ReportColumns &reports)
+{
+  if (reports.empty()) {
+    return;
+  }
+  if ( (m_retentionCount > 0) && (reports.size() > m_retentionCount) ) {
+    reports.discardOldest(reports.size() - m_retentionCount);
+  }
+  if (m_retentionWindow > 0) {
+    reports.discardBefore(reports.time(reports.size() - 1) - m_retentionWindow);
+  }
+}
+
+void ArduinoComparer::discardReportsBefore(DeviceThreadTime time, bool arrivalTime)
+{
+  m_arduinoReports.discardBefore(time, arrivalTime);
+  m_deviceReports.discardBefore(time, arrivalTime);
+}
+
 bool ArduinoComparer::computeLatency(
           int arduinoChannel
           , int deviceChannel
@@ -218,43 +525,759 @@ bool ArduinoComparer::computeLatency(
     return false;
   }
 
-  // Compute the start time, which is the lowest time value in either
-  // of the report lists.
-  struct timeval start;
-  if (arrivalTime) {
-    start = m_deviceReports[0].arrivalTime;
-    if (vrpn_TimevalGreater(start, m_arduinoReports[0].arrivalTime)) {
-      start = m_arduinoReports[0].arrivalTime;
+  // Bring the trajectories for both the Arduino and the device up to date.
+  return findLatency(arduinoTrajectory(arduinoChannel, arrivalTime),
+    deviceTrajectory(deviceChannel, arrivalTime), outLatencySeconds);
+}
+
+bool ArduinoComparer::findLatency(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double &outLatencySeconds
+  ) const
+{
+  if (m_latencySearch.estimator == LATENCY_ESTIMATOR_CROSS_CORRELATION) {
+    return computeCrossCorrelationLatency(aT, dT, outLatencySeconds);
+  }
+  if (m_latencySearch.estimator == LATENCY_ESTIMATOR_EXTREMUM_ALIGNMENT) {
+    return computeExtremumLatency(aT, dT, outLatencySeconds);
+  }
+
+  // Scan the whole range at evenly-spaced offsets no farther apart than
+  // the coarse step, keeping the one with the smallest sum of squared
+  // differences between the device values and the expected mapping for
+  // the nearest-time Arduino values.  The resampled scan only estimates
+  // these errors, so we compute the actual error at the offset it picks.
+  const LatencySearchOptions &search = m_latencySearch;
+  std::vector<double> offsets, errors;
+  double step;
+  bool resampled = search.resampledScan &&
+    computeResampledErrors(aT, dT, offsets, errors, step);
+  if (!resampled) {
+    double range = search.maxSeconds - search.minSeconds;
+    size_t steps = static_cast<size_t>(ceil(range / search.coarseStepSeconds));
+    step = range / steps;
+    offsets.clear();
+    for (size_t i = 0; i <= steps; i++) {
+      offsets.push_back(search.minSeconds + i * step);
     }
-  } else {
-    start = m_deviceReports[0].sampleTime;
-    if (vrpn_TimevalGreater(start, m_arduinoReports[0].sampleTime)) {
-      start = m_arduinoReports[0].sampleTime;
+    computeErrors(aT, dT, offsets, errors);
+  }
+  double minOffset = offsets[0];
+  double minError = errors[0];
+  for (size_t i = 1; i < offsets.size(); i++) {
+    if (errors[i] < minError) {
+      minError = errors[i];
+      minOffset = offsets[i];
+    }
+  }
+  if (resampled) {
+    minError = computeError(aT, dT, minOffset);
+  }
+
+  // Refine it between the neighboring offsets.
+  outLatencySeconds = refineLatency(aT, dT,
+    std::max(minOffset - step, search.minSeconds),
+    std::min(minOffset + step, search.maxSeconds),
+    minOffset, minError);
+  return true;
+}
+
+double ArduinoComparer::refineLatency(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double lo
+                , double hi
+                , double bestOffset
+                , double bestError
+                , const std::vector<double> *weights
+  ) const
+{
+  // The error is not perfectly smooth (the Arduino values are quantized),
+  // so we keep the best offset we have seen rather than trusting the
+  // final bracket.
+  const double ratio = (sqrt(5.0) - 1) / 2;
+  double x1 = hi - ratio * (hi - lo);
+  double x2 = lo + ratio * (hi - lo);
+  double e1 = computeError(aT, dT, x1, weights);
+  double e2 = computeError(aT, dT, x2, weights);
+  while (hi - lo > m_latencySearch.toleranceSeconds) {
+    if (e1 < bestError) { bestError = e1; bestOffset = x1; }
+    if (e2 < bestError) { bestError = e2; bestOffset = x2; }
+    if (e1 <= e2) {
+      hi = x2;
+      x2 = x1;
+      e2 = e1;
+      x1 = hi - ratio * (hi - lo);
+      e1 = computeError(aT, dT, x1, weights);
+    } else {
+      lo = x1;
+      x1 = x2;
+      e1 = e2;
+      x2 = lo + ratio * (hi - lo);
+      e2 = computeError(aT, dT, x2, weights);
     }
   }
+  if (e1 < bestError) { bestError = e1; bestOffset = x1; }
+  if (e2 < bestError) { bestError = e2; bestOffset = x2; }
+  return bestOffset;
+}
+
+bool ArduinoComparer::findLatencyRange(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double &outLatencySeconds
+                , double &outLoSeconds
+                , double &outHiSeconds
+  ) const
+{
+  if (!findLatency(aT, dT, outLatencySeconds)) {
+    return false;
+  }
+  const LatencySearchOptions &search = m_latencySearch;
+  outLoSeconds = std::max(outLatencySeconds - search.coarseStepSeconds, search.minSeconds);
+  outHiSeconds = std::min(outLatencySeconds + search.coarseStepSeconds, search.maxSeconds);
+  return true;
+}
 
-  // Construct trajectories for both the Arduino and the device.
-  Trajectory arduinoTrajectory(m_arduinoReports, start, arduinoChannel, arrivalTime);
-  Trajectory deviceTrajectory(m_deviceReports, start, deviceChannel, arrivalTime);
+bool ArduinoComparer::splitSweeps(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double turnaroundThreshold
+                , SweepSplit &outSplit
+  ) const
+{
+  outSplit.boundsSeconds.clear();
+  outSplit.firstEntry.clear();
+  if (!findLatencyRange(aT, dT, outSplit.latencySeconds,
+        outSplit.loSeconds, outSplit.hiSeconds)) {
+    return false;
+  }
+  double latency = outSplit.latencySeconds;
+
+  // The start and end of the measurement bound the first and last sweeps.
+  std::vector<double> &bounds = outSplit.boundsSeconds;
+  bounds.push_back(aT.m_entries.front().m_time);
+  if (turnaroundThreshold > 0) {
+    std::vector<size_t> turns;
+    aT.findTurnarounds(turnaroundThreshold, turns);
+    for (size_t i = 0; i < turns.size(); i++) {
+      bounds.push_back(aT.m_entries[turns[i]].m_time);
+    }
+  }
+  bounds.push_back(aT.m_entries.back().m_time);
+
+  // The device entries are sorted, so each sweep's are the ones up to
+  // where the next one starts.
+  std::vector<size_t> &firstEntry = outSplit.firstEntry;
+  firstEntry.resize(bounds.size());
+  firstEntry.front() = 0;
+  size_t entry = 0;
+  for (size_t b = 1; b + 1 < bounds.size(); b++) {
+    while ( (entry < dT.m_entries.size())
+        && (dT.m_entries[entry].m_time - latency < bounds[b]) ) {
+      entry++;
+    }
+    firstEntry[b] = entry;
+  }
+  firstEntry.back() = dT.m_entries.size();
+  return true;
+}
 
-  // Compute the sum of squared differences between the device values and
-  // the expected mapping for the nearest-time Arduino values for a temporal
-  // offset of 0.
-  double minOffset = 0;
-  double minError = computeError(arduinoTrajectory, deviceTrajectory,
-    minOffset);
+bool ArduinoComparer::computeSweepLatencies(
+          int arduinoChannel
+          , int deviceChannel
+          , std::vector<SweepLatency> &outSweeps
+          , double turnaroundThreshold
+          , bool arrivalTime ) const
+{
+  outSweeps.clear();
+  if ( (m_deviceReports.size() == 0) || (m_arduinoReports.size() == 0) ) {
+    return false;
+  }
+  const Trajectory &aT = arduinoTrajectory(arduinoChannel, arrivalTime);
+  const Trajectory &dT = deviceTrajectory(deviceChannel, arrivalTime);
+  SweepSplit split;
+  if (!splitSweeps(aT, dT, turnaroundThreshold, split)) {
+    return false;
+  }
+  double latency = split.latencySeconds;
+  const std::vector<double> &bounds = split.boundsSeconds;
+  const std::vector<size_t> &firstEntry = split.firstEntry;
 
-  // @todo Turn this from a brute-force search into an optimization routine.
-  for (double offset = -300e-3; offset <= 300e-3; offset += 1e-3) {
-    double err = computeError(arduinoTrajectory, deviceTrajectory, offset);
-    //std::cout << "XXX offset vs. error: " << offset << ", " << err << std::endl;
-    if (err < minError) {
-      minError = err;
-      minOffset = offset;
+  // Report the times from the first report we have now, rather than
+  // from the start of the trajectories.
+  double toFirst = DeviceThreadSeconds(trajectoryStart(arrivalTime) - startTime(arrivalTime));
+  std::vector<size_t> sweepIndex;
+  for (size_t s = 0; s + 1 < bounds.size(); s++) {
+    if (firstEntry[s + 1] - firstEntry[s] >= 2) {
+      SweepLatency sweep;
+      sweep.startSeconds = bounds[s] + toFirst;
+      sweep.endSeconds = bounds[s + 1] + toFirst;
+      sweep.deviceReports = firstEntry[s + 1] - firstEntry[s];
+      sweep.latencySeconds = latency;
+      outSweeps.push_back(sweep);
+      sweepIndex.push_back(s);
     }
   }
-  outLatencySeconds = minOffset;
+  if (outSweeps.empty()) {
+    return false;
+  }
 
+  // Search each sweep near the overall latency.
+  ParallelFor(outSweeps.size(), [&](size_t i) {
+    size_t s = sweepIndex[i];
+    Trajectory sweepT(dT, firstEntry[s], firstEntry[s + 1]);
+    outSweeps[i].latencySeconds = refineLatency(aT, sweepT, split.loSeconds,
+      split.hiSeconds, latency, computeError(aT, sweepT, latency));
+  }, m_latencySearch.threads);
+  return true;
+}
+
+bool ArduinoComparer::computeVelocityProfile(
+          int arduinoChannel
+          , int deviceChannel
+          , size_t bins
+          , std::vector<VelocityLatency> &outProfile
+          , double derivativeSeconds
+          , bool arrivalTime ) const
+{
+  outProfile.clear();
+  if ( (m_deviceReports.size() == 0) || (m_arduinoReports.size() == 0)
+      || (bins == 0) || (derivativeSeconds <= 0) ) {
+    return false;
+  }
+  const Trajectory &aT = arduinoTrajectory(arduinoChannel, arrivalTime);
+  const Trajectory &dT = deviceTrajectory(deviceChannel, arrivalTime);
+  if (dT.m_entries.size() < bins) {
+    return false;
+  }
+  double latency, lo, hi;
+  if (!findLatencyRange(aT, dT, latency, lo, hi)) {
+    return false;
+  }
+
+  // Find the Arduino speed at the time each device entry shows, with a
+  // central difference.  The times only go forward, so a cursor for each
+  // end of the difference walks the Arduino trajectory once.
+  double half = derivativeSeconds / 2;
+  Trajectory::Cursor before(aT), after(aT);
+  std::vector<double> speeds(dT.m_entries.size());
+  for (size_t i = 0; i < dT.m_entries.size(); i++) {
+    double t = dT.m_entries[i].m_time - latency;
+    speeds[i] = fabs(after.lookup(t + half) - before.lookup(t - half)) / derivativeSeconds;
+  }
+
+  // Split the entries into bins with equal numbers of them, by speed.
+  std::vector<size_t> order(speeds.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(),
+    [&](size_t a, size_t b) { return speeds[a] < speeds[b]; });
+  std::vector<std::vector<size_t> > binEntries(bins);
+  outProfile.resize(bins);
+  for (size_t b = 0; b < bins; b++) {
+    size_t first = b * order.size() / bins;
+    size_t last = (b + 1) * order.size() / bins;
+    VelocityLatency &bin = outProfile[b];
+    bin.minSpeed = speeds[order[first]];
+    bin.maxSpeed = speeds[order[last - 1]];
+    bin.deviceReports = last - first;
+    bin.latencySeconds = latency;
+    double sum = 0;
+    for (size_t i = first; i < last; i++) {
+      sum += speeds[order[i]];
+    }
+    bin.meanSpeed = sum / (last - first);
+
+    // Put the bin's entries back in time order to make its trajectory.
+    binEntries[b].assign(order.begin() + first, order.begin() + last);
+    std::sort(binEntries[b].begin(), binEntries[b].end());
+  }
+
+  // Search each bin near the overall latency, using only its entries.
+  ParallelFor(bins, [&](size_t b) {
+    Trajectory binT(dT, binEntries[b]);
+    outProfile[b].latencySeconds = refineLatency(aT, binT, lo, hi,
+      latency, computeError(aT, binT, latency));
+  }, m_latencySearch.threads);
+  return true;
+}
+
+bool ArduinoComparer::summarizeSweepLatencies(
+  const std::vector<SweepLatency> &sweeps, SweepLatencySummary &outSummary)
+{
+  outSummary.sweeps = sweeps.size();
+  outSummary.minSeconds = outSummary.medianSeconds = 0;
+  outSummary.p95Seconds = outSummary.maxSeconds = 0;
+  if (sweeps.empty()) {
+    return false;
+  }
+  std::vector<double> sorted;
+  for (size_t i = 0; i < sweeps.size(); i++) {
+    sorted.push_back(sweeps[i].latencySeconds);
+  }
+  std::sort(sorted.begin(), sorted.end());
+  outSummary.minSeconds = sorted.front();
+  outSummary.medianSeconds = Percentile(sorted, 0.5);
+  outSummary.p95Seconds = Percentile(sorted, 0.95);
+  outSummary.maxSeconds = sorted.back();
+  return true;
+}
+
+bool ArduinoComparer::computeLatencyConfidence(
+          int arduinoChannel
+          , int deviceChannel
+          , const LatencyBootstrapOptions &options
+          , LatencyConfidence &outConfidence
+          , bool arrivalTime ) const
+{
+  outConfidence.latencySeconds = -10e10;
+  outConfidence.standardErrorSeconds = 0;
+  outConfidence.lowSeconds = outConfidence.highSeconds = -10e10;
+  outConfidence.resamples = 0;
+  outConfidence.sweeps = 0;
+  if ( (options.resamples < 2) || (options.confidenceLevel <= 0)
+      || (options.confidenceLevel >= 1) ) {
+    std::cerr << "ArduinoComparer::computeLatencyConfidence(): Bad resample count or confidence level" << std::endl;
+    return false;
+  }
+  if ( (m_deviceReports.size() == 0) || (m_arduinoReports.size() == 0) ) {
+    return false;
+  }
+  const Trajectory &aT = arduinoTrajectory(arduinoChannel, arrivalTime);
+  const Trajectory &dT = deviceTrajectory(deviceChannel, arrivalTime);
+  // Split the measurement into sweeps at the turnarounds, with each
+  // device entry in the sweep whose motion it shows.
+  SweepSplit split;
+  if (!splitSweeps(aT, dT, options.turnaroundThreshold, split)) {
+    return false;
+  }
+  double latency = split.latencySeconds;
+  outConfidence.latencySeconds = latency;
+  const std::vector<size_t> &firstEntry = split.firstEntry;
+  size_t sweeps = firstEntry.size() - 1;
+  if (sweeps < 2) {
+    std::cerr << "ArduinoComparer::computeLatencyConfidence(): Fewer than two sweeps" << std::endl;
+    return false;
+  }
+
+  // Search each resample near the point estimate, stopping once we're out
+  // of time.  Resamples are handed out in order, so those that get done
+  // are (nearly) the first ones.
+  DeviceThreadTime deadline = std::numeric_limits<DeviceThreadTime>::max();
+  if (options.maxSeconds > 0) {
+    deadline = DeviceThreadNow() + static_cast<DeviceThreadTime>(options.maxSeconds * 1e9);
+  }
+  std::vector<double> latencies(options.resamples);
+  std::vector<char> done(options.resamples, 0);
+  ParallelFor(options.resamples, [&](size_t r) {
+    if (DeviceThreadNow() > deadline) { return; }
+    std::seed_seq seeds = { options.seed, static_cast<unsigned>(r) };
+    std::mt19937 random(seeds);
+    std::uniform_int_distribution<size_t> pick(0, sweeps - 1);
+    std::vector<double> sweepWeights(sweeps, 0);
+    for (size_t i = 0; i < sweeps; i++) {
+      sweepWeights[pick(random)] += 1;
+    }
+    std::vector<double> weights(dT.m_entries.size());
+    for (size_t s = 0; s < sweeps; s++) {
+      for (size_t i = firstEntry[s]; i < firstEntry[s + 1]; i++) {
+        weights[i] = sweepWeights[s];
+      }
+    }
+    latencies[r] = refineLatency(aT, dT, split.loSeconds, split.hiSeconds,
+      latency, computeError(aT, dT, latency, &weights), &weights);
+    done[r] = 1;
+  }, m_latencySearch.threads);
+
+  // Summarize the resampled latencies.
+  std::vector<double> found;
+  for (size_t r = 0; r < latencies.size(); r++) {
+    if (done[r]) { found.push_back(latencies[r]); }
+  }
+  if (found.size() < 2) {
+    std::cerr << "ArduinoComparer::computeLatencyConfidence(): Ran out of time" << std::endl;
+    return false;
+  }
+  std::sort(found.begin(), found.end());
+  double sum = 0;
+  for (size_t i = 0; i < found.size(); i++) {
+    sum += found[i];
+  }
+  double mean = sum / found.size();
+  double squares = 0;
+  for (size_t i = 0; i < found.size(); i++) {
+    squares += (found[i] - mean) * (found[i] - mean);
+  }
+  double tail = (1 - options.confidenceLevel) / 2;
+  outConfidence.standardErrorSeconds = sqrt(squares / (found.size() - 1));
+  outConfidence.lowSeconds = Percentile(found, tail);
+  outConfidence.highSeconds = Percentile(found, 1 - tail);
+  outConfidence.resamples = found.size();
+  outConfidence.sweeps = sweeps;
+  return true;
+}
+
+bool ArduinoComparer::computeChannelLatencies(
+          int arduinoChannel
+          , std::vector<ChannelLatency> &outChannels
+          , size_t &outBest
+          , bool arrivalTime ) const
+{
+  outChannels.clear();
+  outBest = 0;
+  if ( (m_deviceReports.size() == 0) || (m_arduinoReports.size() == 0) ) {
+    return false;
+  }
+  DeviceThreadTime start = trajectoryStart(arrivalTime);
+  const Trajectory &aT = arduinoTrajectory(arduinoChannel, arrivalTime);
+  if (aT.m_entries.size() < 2) {
+    return false;
+  }
+
+  // Figure out the grid, which covers the device reports, and the range
+  // of lags (in grid steps) to consider, as the cross-correlation
+  // estimator does.
+  const LatencySearchOptions &search = m_latencySearch;
+  const double dt = search.sampleSeconds;
+  DeviceThreadTime firstTime = m_deviceReports.time(0, arrivalTime);
+  DeviceThreadTime lastTime = firstTime;
+  for (size_t i = 1; i < m_deviceReports.size(); i++) {
+    firstTime = std::min(firstTime, m_deviceReports.time(i, arrivalTime));
+    lastTime = std::max(lastTime, m_deviceReports.time(i, arrivalTime));
+  }
+  double first = DeviceThreadSeconds(firstTime - start);
+  long count = static_cast<long>(floor(DeviceThreadSeconds(lastTime - firstTime) / dt)) + 1;
+  long minLag = static_cast<long>(ceil(search.minSeconds / dt));
+  long maxLag = static_cast<long>(floor(search.maxSeconds / dt));
+  if ( (count < 2) || (maxLag < minLag) ) {
+    return false;
+  }
+
+  // Resample the Arduino values over the grid extended by the lags, so
+  // that a device sample at grid step i lagging by l steps lines up with
+  // Arduino sample i + maxLag - l and every lag has a full overlap.  We
+  // use the values themselves rather than the mapping, which is only for
+  // one channel.  Removing the mean does not change the correlation but
+  // keeps the transform accurate.  Keep running sums of the values and
+  // their squares to find the spread of the Arduino values at each lag.
+  long span = maxLag - minLag;
+  size_t n = FFTSize(count + span);
+  std::vector<std::complex<double> > a(n);
+  std::vector<double> arduinoValues(count + span);
+  Trajectory::Cursor arduinoCursor(aT);
+  double aSum = 0;
+  for (long k = 0; k < count + span; k++) {
+    arduinoValues[k] = arduinoCursor.lookup(first + (k - maxLag) * dt);
+    aSum += arduinoValues[k];
+  }
+  std::vector<double> sums(count + span + 1, 0), squares(count + span + 1, 0);
+  for (long k = 0; k < count + span; k++) {
+    double v = arduinoValues[k] - aSum / (count + span);
+    a[k] = v;
+    sums[k + 1] = sums[k] + v;
+    squares[k + 1] = squares[k] + v * v;
+  }
+  FFT(a);
+
+  // Correlate each channel with the Arduino values.  The trajectories
+  // are brought up to date here, because that is not safe to do from
+  // several threads.
+  outChannels.resize(m_deviceReports.channels());
+  std::vector<const Trajectory *> channelTrajectories;
+  for (size_t c = 0; c < outChannels.size(); c++) {
+    channelTrajectories.push_back(&deviceTrajectory(static_cast<int>(c), arrivalTime));
+  }
+  ParallelFor(outChannels.size(), [&](size_t c) {
+    ChannelLatency &result = outChannels[c];
+    result.channel = static_cast<int>(c);
+    result.latencySeconds = 0;
+    result.correlation = 0;
+    const Trajectory &dT = *channelTrajectories[c];
+    if (dT.m_entries.size() < 2) { return; }
+
+    // Resample the channel and remove its mean.
+    std::vector<std::complex<double> > d(n);
+    Trajectory::Cursor deviceCursor(dT);
+    double dSum = 0;
+    for (long i = 0; i < count; i++) {
+      double v = deviceCursor.lookup(first + i * dt);
+      d[i] = v;
+      dSum += v;
+    }
+    double dSquares = 0;
+    for (long i = 0; i < count; i++) {
+      d[i] -= dSum / count;
+      dSquares += std::norm(d[i]);
+    }
+    if (dSquares <= 0) { return; }
+
+    // The inverse transform of conj(D) * A has, at index s, the sum over
+    // i of d[i] * a[i + s]; the grid is long enough that this does not
+    // wrap for the s we need.  Divide by the spreads to get the
+    // correlation coefficient at each lag.
+    FFT(d);
+    for (size_t k = 0; k < n; k++) {
+      d[k] = std::conj(d[k]) * a[k];
+    }
+    FFT(d, true);
+    std::vector<double> r(span + 1, 0);
+    for (long lag = minLag; lag <= maxLag; lag++) {
+      long s = maxLag - lag;
+      double sum = sums[s + count] - sums[s];
+      double spread = squares[s + count] - squares[s] - sum * sum / count;
+      if (spread > 0) {
+        r[lag - minLag] = d[s].real() / sqrt(dSquares * spread);
+      }
+    }
+
+    // Find the strongest correlation, of either sign, and fit a parabola
+    // through it and its neighbors to locate it to a fraction of a step.
+    size_t best = 0;
+    for (size_t i = 1; i < r.size(); i++) {
+      if (fabs(r[i]) > fabs(r[best])) { best = i; }
+    }
+    double fraction = 0;
+    if ( (best > 0) && (best + 1 < r.size()) ) {
+      double before = fabs(r[best - 1]), peak = fabs(r[best]), after = fabs(r[best + 1]);
+      double denom = before - 2 * peak + after;
+      if (denom < 0) {
+        fraction = 0.5 * (before - after) / denom;
+      }
+    }
+    result.latencySeconds = std::max(search.minSeconds, std::min(search.maxSeconds,
+      (minLag + static_cast<long>(best) + fraction) * dt));
+    result.correlation = r[best];
+  }, search.threads);
+
+  for (size_t c = 1; c < outChannels.size(); c++) {
+    if (fabs(outChannels[c].correlation) > fabs(outChannels[outBest].correlation)) {
+      outBest = c;
+    }
+  }
+  return !outChannels.empty();
+}
+
+bool ArduinoComparer::computeErrorCurve(
+          int arduinoChannel
+          , int deviceChannel
+          , const std::vector<double> &offsetsSeconds
+          , std::vector<double> &outErrors
+          , bool arrivalTime ) const
+{
+  outErrors.clear();
+  if ( (m_deviceReports.size() == 0) || (m_arduinoReports.size() == 0) ) {
+    return false;
+  }
+  computeErrors(arduinoTrajectory(arduinoChannel, arrivalTime),
+    deviceTrajectory(deviceChannel, arrivalTime), offsetsSeconds, outErrors);
+  return true;
+}
+
+bool ArduinoComparer::computeExtremumLatency(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double &outLatencySeconds
+  ) const
+{
+  // The device turns around when the Arduino does, by an amount that
+  // depends on the slope of the mapping; if the mapping goes down, its
+  // peaks are the Arduino's troughs.
+  const LatencySearchOptions &search = m_latencySearch;
+  if (m_maxArduinoValue <= m_minArduinoValue) {
+    return false;
+  }
+  double slope = (m_mappingMean[m_maxArduinoValue] - m_mappingMean[m_minArduinoValue])
+    / (m_maxArduinoValue - m_minArduinoValue);
+  if (slope == 0) {
+    return false;
+  }
+  bool flipped = slope < 0;
+  std::vector<size_t> aTurns, dTurns;
+  aT.findTurnarounds(search.turnaroundThreshold, aTurns);
+  dT.findTurnarounds(search.turnaroundThreshold * fabs(slope), dTurns);
+
+  // Find the times of the turnarounds, skipping any at the ends of the
+  // trajectories, which are only where the data stops.  Both lists
+  // alternate between peaks and troughs, starting with a peak.
+  std::vector<double> aTimes, dTimes;
+  std::vector<bool> aPeak, dPeak;
+  for (size_t i = 0; i < aTurns.size(); i++) {
+    if ( (aTurns[i] > 0) && (aTurns[i] + 1 < aT.m_entries.size()) ) {
+      aTimes.push_back(aT.extremumTime(aTurns[i]));
+      aPeak.push_back(i % 2 == 0);
+    }
+  }
+  for (size_t i = 0; i < dTurns.size(); i++) {
+    if ( (dTurns[i] > 0) && (dTurns[i] + 1 < dT.m_entries.size()) ) {
+      dTimes.push_back(dT.extremumTime(dTurns[i]));
+      dPeak.push_back((i % 2 == 0) != flipped);
+    }
+  }
+
+  // Pair each Arduino turnaround with the nearest device turnaround of the
+  // same kind within the range.  Both lists are in time order, so the
+  // first device turnaround that could be in range only moves forward.
+  std::vector<double> latencies;
+  size_t first = 0;
+  for (size_t i = 0; i < aTimes.size(); i++) {
+    while ( (first < dTimes.size()) && (dTimes[first] - aTimes[i] < search.minSeconds) ) {
+      first++;
+    }
+    bool found = false;
+    double best = 0;
+    for (size_t j = first; (j < dTimes.size()) && (dTimes[j] - aTimes[i] <= search.maxSeconds); j++) {
+      double latency = dTimes[j] - aTimes[i];
+      if ( (dPeak[j] == aPeak[i]) && (!found || (fabs(latency) < fabs(best))) ) {
+        best = latency;
+        found = true;
+      }
+    }
+    if (found) {
+      latencies.push_back(best);
+    }
+  }
+  if (latencies.empty()) {
+    return false;
+  }
+
+  // Average the middle half of them, which ignores the occasional
+  // mismatched pair but still resolves a fraction of a report when the
+  // readings are quantized.
+  std::sort(latencies.begin(), latencies.end());
+  size_t lo = latencies.size() / 4;
+  size_t hi = latencies.size() - lo;
+  double sum = 0;
+  for (size_t i = lo; i < hi; i++) {
+    sum += latencies[i];
+  }
+  outLatencySeconds = sum / (hi - lo);
+  return true;
+}
+
+DeviceThreadTime ArduinoComparer::trajectoryStart(bool arrivalTime) const
+{
+  int base = arrivalTime ? 1 : 0;
+  if (!m_haveTrajectoryStart[base]) {
+    m_trajectoryStart[base] = startTime(arrivalTime);
+    m_haveTrajectoryStart[base] = true;
+  }
+  return m_trajectoryStart[base];
+}
+
+const Trajectory &ArduinoComparer::cachedTrajectory(const ReportColumns &reports,
+  TrajectoryCache &cache, int channel, bool arrivalTime) const
+{
+  DeviceThreadTime start = trajectoryStart(arrivalTime);
+  CachedTrajectory &cached = cache[std::make_pair(channel, arrivalTime)];
+
+  // Drop the entries from reports that have been dropped since we last
+  // looked.  If the reports in the trajectory came in time order, these
+  // are the entries from before the earliest report that is left.  If
+  // not, the entries do not tell which report they came from, so we
+  // build the trajectory again from the reports that are left.
+  size_t discarded = reports.discarded();
+  if (discarded > cached.m_firstReport) {
+    if ( (cached.m_endReport <= discarded)
+        || (reports.lastOutOfOrder(arrivalTime) > cached.m_firstReport) ) {
+      cached.m_trajectory = Trajectory();
+      cached.m_endReport = discarded;
+    } else {
+      cached.m_trajectory.discardBefore(
+        DeviceThreadSeconds(reports.time(0, arrivalTime) - start));
+    }
+    cached.m_firstReport = discarded;
+  }
+
+  // Add the reports that have come in since.
+  cached.m_trajectory.extend(reports, cached.m_endReport - discarded,
+    start, channel, arrivalTime);
+  cached.m_endReport = discarded + reports.size();
+  return cached.m_trajectory;
+}
+
+DeviceThreadTime ArduinoComparer::startTime(bool arrivalTime) const
+{
+  if (arrivalTime) {
+    return std::min(m_deviceReports.time(0, true),
+                    m_arduinoReports.time(0, true));
+  } else {
+    return std::min(m_deviceReports.time(0),
+                    m_arduinoReports.time(0));
+  }
+}
+
+void ArduinoComparer::computeErrors(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , const std::vector<double> &offsetsSeconds
+                , std::vector<double> &outErrors
+  ) const
+{
+  // Each thread writes only the entries for the offsets it was handed.
+  outErrors.resize(offsetsSeconds.size());
+  ParallelFor(offsetsSeconds.size(), [&](size_t i) {
+    outErrors[i] = computeError(aT, dT, offsetsSeconds[i]);
+  }, m_latencySearch.threads);
+}
+
+bool ArduinoComparer::computeResampledErrors(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , std::vector<double> &outOffsetsSeconds
+                , std::vector<double> &outErrors
+                , double &outStepSeconds
+  ) const
+{
+  if ( (aT.m_entries.size() == 0) || (dT.m_entries.size() < 2) ) {
+    return false;
+  }
+
+  // Figure out the grid, which covers the device trajectory, and which
+  // whole numbers of grid steps to shift by.
+  const LatencySearchOptions &search = m_latencySearch;
+  const double dt = search.sampleSeconds;
+  double first = dT.m_entries.front().m_time;
+  double last = dT.m_entries.back().m_time;
+  long count = static_cast<long>(floor((last - first) / dt)) + 1;
+  long minShift = static_cast<long>(ceil(search.minSeconds / dt));
+  long maxShift = static_cast<long>(floor(search.maxSeconds / dt));
+  long stride = std::max(1L, static_cast<long>(search.coarseStepSeconds / dt + 0.5));
+  if (maxShift < minShift) {
+    return false;
+  }
+
+  // Resample the device values onto the grid, and the expected device
+  // values (the Arduino values run through the mapping) onto the grid
+  // extended far enough past each end to cover every shift.  Shifting by
+  // s steps then just means starting s entries earlier in the expected
+  // values, so each error is a plain sum over two contiguous arrays.
+  std::vector<float> mapping(m_mappingMean.begin(), m_mappingMean.end());
+  std::vector<float> device(count);
+  Trajectory::Cursor deviceCursor(dT);
+  for (long k = 0; k < count; k++) {
+    device[k] = static_cast<float>(deviceCursor.lookup(first + k * dt));
+  }
+  long before = std::max(maxShift, 0L);
+  long after = std::max(-minShift, 0L);
+  std::vector<float> expected(before + count + after);
+  Trajectory::Cursor arduinoCursor(aT);
+  for (long j = -before; j < count + after; j++) {
+    expected[j + before] = mapping[mappingIndex(arduinoCursor.lookup(first + j * dt))];
+  }
+
+  outOffsetsSeconds.clear();
+  for (long shift = minShift; shift <= maxShift; shift += stride) {
+    outOffsetsSeconds.push_back(shift * dt);
+  }
+  outErrors.resize(outOffsetsSeconds.size());
+  ParallelFor(outOffsetsSeconds.size(), [&](size_t i) {
+    long shift = minShift + static_cast<long>(i) * stride;
+    outErrors[i] = SumSquaredDifferences(&expected[before - shift], &device[0], count);
+  }, search.threads);
+  outStepSeconds = stride * dt;
   return true;
 }
 
@@ -262,6 +1285,7 @@ double ArduinoComparer::computeError(
                 const Trajectory &aT
                 , const Trajectory &dT
                 , double offsetSeconds
+                , const std::vector<double> *weights
   ) const
 {
   double sum = 0;
@@ -274,15 +1298,108 @@ double ArduinoComparer::computeError(
   //  Because we want a positive offset to correspond to the device
   // measurements being behind the Arduino, we need to offset the
   // Arduino measurements by the negative of the offset.
+  //  The device times are sorted, so the shifted times are too and we
+  // can walk through the Arduino trajectory with a cursor rather than
+  // searching it for each one.
+  Trajectory::Cursor arduino(aT);
   for (size_t i = 0; i < dT.m_entries.size(); i++) {
     double deviceValue = dT.m_entries[i].m_value;
     double timeShifted = dT.m_entries[i].m_time - offsetSeconds;
-    size_t arduinoValue = static_cast<size_t>(aT.lookup(timeShifted));
-    double expectedDeviceValue = m_mappingMean[arduinoValue];
-    sum += (expectedDeviceValue - deviceValue) * 
-           (expectedDeviceValue - deviceValue);    
+    double expectedDeviceValue = mappedValue(arduino.lookup(timeShifted));
+    double squared = (expectedDeviceValue - deviceValue) * 
+                     (expectedDeviceValue - deviceValue);
+    if (weights) {
+      squared *= (*weights)[i];
+    }
+    sum += squared;
   }
 
   return sum;
 }
 
+bool ArduinoComparer::computeCrossCorrelationLatency(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double &outLatencySeconds
+  ) const
+{
+  if ( (aT.m_entries.size() < 2) || (dT.m_entries.size() < 2) ) {
+    return false;
+  }
+
+  // Figure out the grid, which covers the device trajectory, and the
+  // range of lags (in grid steps) to consider.  The grid is padded with
+  // zeroes past the end by at least the largest lag so that the circular
+  // correlation computed by the FFT does not wrap around for those lags.
+  const LatencySearchOptions &search = m_latencySearch;
+  const double dt = search.sampleSeconds;
+  double first = dT.m_entries.front().m_time;
+  double last = dT.m_entries.back().m_time;
+  long count = static_cast<long>(floor((last - first) / dt)) + 1;
+  long minLag = static_cast<long>(ceil(search.minSeconds / dt));
+  long maxLag = static_cast<long>(floor(search.maxSeconds / dt));
+  minLag = std::max(minLag, -(count - 1));
+  maxLag = std::min(maxLag, count - 1);
+  if (maxLag < minLag) {
+    return false;
+  }
+  long maxAbsLag = std::max(labs(minLag), labs(maxLag));
+  size_t n = FFTSize(count + maxAbsLag);
+
+  // Resample the expected device values (the Arduino values run through
+  // the mapping) and the actual device values onto the grid, removing
+  // their means so that the correlation responds to the motion rather
+  // than to the offset.
+  std::vector<std::complex<double> > a(n), d(n);
+  double aSum = 0, dSum = 0;
+  Trajectory::Cursor arduinoCursor(aT);
+  Trajectory::Cursor deviceCursor(dT);
+  for (long i = 0; i < count; i++) {
+    double t = first + i * dt;
+    double expected = mappedValue(arduinoCursor.lookup(t));
+    double device = deviceCursor.lookup(t);
+    a[i] = expected;
+    d[i] = device;
+    aSum += expected;
+    dSum += device;
+  }
+  for (long i = 0; i < count; i++) {
+    a[i] -= aSum / count;
+    d[i] -= dSum / count;
+  }
+
+  // Correlate: the inverse transform of conj(A) * D has, at index k (mod n),
+  // the sum over i of a[i] * d[i + k].  A device that lags the Arduino by
+  // L seconds peaks at k = L / dt.
+  FFT(a);
+  FFT(d);
+  for (size_t k = 0; k < n; k++) {
+    a[k] = std::conj(a[k]) * d[k];
+  }
+  FFT(a, true);
+
+  // Find the peak within the range.  The sums are not divided by the
+  // number of samples that overlap at each lag: for periodic motion the
+  // correlation peaks once per period, and leaving the sums alone favors
+  // the peak nearest zero lag, as the error search does.
+  std::vector<double> c(maxLag - minLag + 1);
+  for (long lag = minLag; lag <= maxLag; lag++) {
+    size_t index = static_cast<size_t>((lag + static_cast<long>(n)) % static_cast<long>(n));
+    c[lag - minLag] = a[index].real();
+  }
+  size_t best = std::max_element(c.begin(), c.end()) - c.begin();
+
+  // Fit a parabola through the peak and its neighbors to find the peak
+  // to a fraction of a grid step.
+  double fraction = 0;
+  if ( (best > 0) && (best + 1 < c.size()) ) {
+    double denom = c[best - 1] - 2 * c[best] + c[best + 1];
+    if (denom < 0) {
+      fraction = 0.5 * (c[best - 1] - c[best + 1]) / denom;
+    }
+  }
+  outLatencySeconds = (minLag + static_cast<long>(best) + fraction) * dt;
+  outLatencySeconds = std::max(search.minSeconds,
+    std::min(search.maxSeconds, outLatencySeconds));
+  return true;
+}
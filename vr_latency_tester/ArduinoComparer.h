@@ -17,6 +17,72 @@
 #pragma once
 #include <DeviceThread.h>
 #include <vector>
+#include <deque>
+#include <map>
+#include <string>
+
+/// Compact storage for a stream of reports.  A DeviceThreadReport has room
+/// for DeviceThreadValues::MAX_VALUES values, so storing reports as they
+/// are takes about a kilobyte each; this instead keeps the times and each
+/// channel in columns, so each report takes only the space for the values
+/// it has.  Reports are kept in the order they were added, and the oldest
+/// can be dropped from the front without moving the others.
+class ReportColumns {
+  public:
+    ReportColumns() : m_discarded(0) {
+      m_lastOutOfOrder[0] = m_lastOutOfOrder[1] = 0;
+    }
+
+    /// @brief Append reports.
+    void add(const std::vector<DeviceThreadReport> &reports);
+
+    /// @brief Drop the oldest reports.
+    void discardOldest(size_t count);
+
+    /// @brief Drop reports from the front that are from before a time.
+    /// This stops at the first report that is not, so if reports came in
+    /// out of time order, some from before the time may be kept.
+    void discardBefore(DeviceThreadTime time, bool arrivalTime = false);
+
+    void clear();
+    size_t size() const { return m_sampleTimes.size(); }
+
+    /// @brief Most channels in any of the reports.
+    size_t channels() const { return m_channels.size(); }
+
+    /// @brief How many reports have been dropped from the front, so that
+    /// report i was the (discarded() + i)th one added.
+    size_t discarded() const { return m_discarded; }
+
+    /// @brief Number, counting discarded ones as for discarded(), of the
+    /// latest report whose time is earlier than that of the report added
+    /// just before it; 0 if every report has come in time order.
+    size_t lastOutOfOrder(bool arrivalTime = false) const {
+      return m_lastOutOfOrder[arrivalTime ? 1 : 0];
+    }
+    bool empty() const { return m_sampleTimes.empty(); }
+
+    /// @brief Sample or arrival time of a report.
+    DeviceThreadTime time(size_t report, bool arrivalTime = false) const {
+      return arrivalTime ? m_arrivalTimes[report] : m_sampleTimes[report];
+    }
+
+    /// @brief Read a value from a report.
+    /// @return true on success, false if the report has no such channel.
+    bool value(size_t report, size_t channel, double &outValue) const {
+      if (channel >= m_sizes[report]) { return false; }
+      outValue = m_channels[channel][report];
+      return true;
+    }
+
+  protected:
+    std::deque<DeviceThreadTime> m_sampleTimes;
+    std::deque<DeviceThreadTime> m_arrivalTimes;
+    std::deque<uint16_t> m_sizes;               //< Channels in each report
+    std::vector<std::deque<double> > m_channels;  //< One entry per report in each
+    size_t m_discarded;                         //< Reports dropped from the front
+    size_t m_lastOutOfOrder[2];                 //< By time base
+};
 
 /// Class to keep track of a set of changing values over time.  It is
 /// constructed based on a set of reports, a definition of 0 time, and
@@ -29,11 +95,49 @@ class Trajectory {
   public:
     Trajectory(
       const std::vector<DeviceThreadReport> &reports  //< Holds the values to fill in
-      , struct timeval start                    //< Defines 0 seconds
+      , DeviceThreadTime start                  //< Defines 0 seconds
+      , int index                               //< Which value to use from the reports
+      , bool arrivalTime = false                //< Use arrival time rather than reported time
+    );
+    Trajectory(
+      const ReportColumns &reports              //< Holds the values to fill in
+      , DeviceThreadTime start                  //< Defines 0 seconds
       , int index                               //< Which value to use from the reports
       , bool arrivalTime = false                //< Use arrival time rather than reported time
     );
 
+    /// @brief An empty trajectory, to be filled in with extend().
+    Trajectory() {}
+
+    /// @brief Add the values from reports, keeping the entries sorted.
+    /// Adding reports that are later than those already added just
+    /// appends them.
+    /// @param [in] first Index of the first report to add; the rest
+    ///   after it are added too.
+    void extend(const ReportColumns &reports, size_t first,
+      DeviceThreadTime start, int index, bool arrivalTime = false);
+
+    /// @brief Time of the peak or trough at an entry, such as one found by
+    /// findTurnarounds(), to a fraction of the spacing between entries.
+    /// If the neighboring entries have the same value (a quantized reading
+    /// that stayed at its extreme for a while), this is the middle of
+    /// that run; otherwise it is the vertex of the parabola through the
+    /// entry and its neighbors.
+    double extremumTime(size_t index) const;
+
+    /// @brief Drop the entries from before a time.
+    void discardBefore(double seconds);
+
+    /// @brief Copy part of a trajectory.
+    /// @param [in] first Index of the first entry to copy.
+    /// @param [in] last Index one past the last entry to copy.
+    Trajectory(const Trajectory &whole, size_t first, size_t last);
+
+    /// @brief Copy chosen entries of a trajectory.
+    /// @param [in] indices Indices of the entries to copy, in increasing
+    ///   order so that the copy stays sorted.
+    Trajectory(const Trajectory &whole, const std::vector<size_t> &indices);
+
     /// @brief Look up an interpolated value at specified seconds past start time.
     /// @param [in] seconds Time in seconds since the start time passed to the constructor.
     /// @return If seconds is before the beginning of time, returns the value
@@ -44,6 +148,46 @@ class Trajectory {
     ///   same time, it picks one of them and returns it.
     double lookup(double seconds) const;
 
+    /// @brief Look up values at a batch of times, which must be in
+    /// increasing order.  Each result is the same as lookup() would give,
+    /// but the whole batch takes one pass through the trajectory rather
+    /// than a binary search per time.
+    /// @param [in] seconds Times in seconds since the start time, sorted.
+    /// @param [out] outValues Value at each time.
+    void lookupSorted(const std::vector<double> &seconds,
+      std::vector<double> &outValues) const;
+
+    /// @brief Find where the motion turns around, the way the latency-test
+    /// applications count passes: once the value has gone back from its
+    /// farthest point by more than the threshold, that point was a
+    /// turnaround.  The motion is taken to start out increasing, so the
+    /// turnarounds alternate between maxima and minima starting with a
+    /// maximum.
+    /// @param [in] threshold How far the value must come back.
+    /// @param [out] outIndices Index of the entry at each turnaround, in
+    ///   time order.
+    void findTurnarounds(double threshold, std::vector<size_t> &outIndices) const;
+
+    /// Looks up values at times that never decrease, such as when walking
+    /// through another trajectory in order, by keeping its place in the
+    /// trajectory between calls.  Each lookup gives the same result as
+    /// Trajectory::lookup(); the first lookup and going back in time cost
+    /// a binary search.  Going forward costs the log of the number of
+    /// entries passed over, so looking up a few times spread across a long
+    /// trajectory does not walk all of it.  The trajectory must outlive
+    /// the cursor.
+    class Cursor {
+    public:
+      explicit Cursor(const Trajectory &trajectory)
+        : m_trajectory(trajectory), m_next(0) {}
+
+      double lookup(double seconds);
+
+    protected:
+      const Trajectory &m_trajectory;
+      size_t m_next;    //< Index of the first entry at or after the last time
+    };
+
     /// Class describing one entry in the trajectory vector.
     class Entry {
     public:
@@ -52,29 +196,185 @@ class Trajectory {
       bool operator < (const Entry &e) const { return m_time < e.m_time; }
     };
     std::vector<Entry> m_entries;   //< Sorted list of values from base time.
+
+  protected:
+    /// @brief Value at a time strictly between the first and last entries,
+    /// given the index of the first entry at or after that time.
+    double valueAt(size_t ge_index, double seconds) const;
 };
 
+/// How ArduinoComparer::computeLatency() estimates the latency.
+typedef enum {
+  LATENCY_ESTIMATOR_ERROR_SEARCH,       //< Minimize the squared error (default)
+  LATENCY_ESTIMATOR_CROSS_CORRELATION,  //< Peak of the FFT cross-correlation
+  LATENCY_ESTIMATOR_EXTREMUM_ALIGNMENT  //< Time between matching turnarounds
+} LatencyEstimator;
+
+/// Where and how finely ArduinoComparer::computeLatency() looks for the
+/// latency.
+///   The error search first evaluates the error at evenly-spaced offsets
+/// across the whole range, which finds the right cycle even when the
+/// motion is periodic and the error has a minimum once per period.  It
+/// then narrows in on the best of those with a golden-section search.
+/// The coarse step must be well under a quarter of the period of the
+/// fastest motion in the test, or the scan can miss the right cycle.
+///   By default the coarse scan is done on trajectories resampled onto a
+/// uniform grid, with the mapping stored as a table of floats, so that the
+/// error at each offset is a sum over two contiguous arrays that runs on
+/// the processor's vector unit (see SquaredErrorKernel.h).  The offsets
+/// are then whole numbers of grid steps and the errors are estimates;
+/// the refinement always uses the exact error.
+///   The cross-correlation estimator resamples the mapped Arduino values
+/// and the device values onto a uniform grid and finds the lag within
+/// the range that best correlates them, using FFTs so that the cost
+/// grows as N log N in the length of the capture rather than with the
+/// number of offsets tried.  The peak is interpolated with a parabola
+/// to find the latency to a fraction of the grid spacing.  It works best
+/// when the mapping is close to linear.
+///   The extremum-alignment estimator finds the turnarounds of the
+/// Arduino motion, the way the applications count passes, and those of
+/// the device values (with the threshold carried through the mapping).
+/// Each Arduino peak or trough is paired with the nearest device one of
+/// the matching kind within the range, and the latency is the mean of
+/// the middle half of the times between them.  The times are found to a
+/// fraction of a report (see Trajectory::extremumTime()).  This takes one
+/// pass through each trajectory, so it is cheap enough to run live or to
+/// check or seed the error search, but it uses only the turnarounds and so
+/// is noisier.  Peaks repeat once per period of the motion, so latencies
+/// are only told apart within a period; when the range is wider than
+/// that, the pairing nearest zero latency is used.
+///   The errors at different offsets are independent of each other, so
+/// the coarse scan and computeErrorCurve() spread them across threads.
+/// Each error is still summed in the same order on one thread, so the
+/// results are identical however many threads are used.
+class LatencySearchOptions {
+  public:
+    LatencySearchOptions()
+      : estimator(LATENCY_ESTIMATOR_ERROR_SEARCH)
+      , minSeconds(-0.5), maxSeconds(0.5), coarseStepSeconds(20e-3)
+      , toleranceSeconds(10e-6), resampledScan(true), sampleSeconds(1e-3)
+      , turnaroundThreshold(7), threads(0) {}
+
+    LatencyEstimator estimator;
+    double minSeconds;          //< Smallest latency to consider
+    double maxSeconds;          //< Largest latency to consider
+    double coarseStepSeconds;   //< Error search: largest spacing of the initial scan
+    double toleranceSeconds;    //< Error search: how precisely to locate the minimum
+    bool resampledScan;         //< Error search: do the coarse scan on the grid
+    double sampleSeconds;       //< Grid spacing for resampling
+    double turnaroundThreshold; //< Extrema: Arduino values the motion must come back by
+    unsigned threads;           //< Threads to compute errors on; 0 for one per processor
+};
+
+/// How ArduinoComparer::computeLatencyConfidence() estimates the
+/// uncertainty of the latency.
+///   The measurement is split into sweeps at the turnarounds of the
+/// Arduino motion, and each resample draws as many sweeps as there are,
+/// with replacement.  The error search is run again on each resample, with
+/// each device report's squared error counted once for each time its sweep
+/// was drawn, so sweeps stay whole and the trajectories are never pieced
+/// back together.  Each resample is searched with a golden-section search
+/// within one coarse step of the point estimate rather than with the full
+/// scan; the full scan has already picked the cycle, and this keeps each
+/// resample to a few dozen error evaluations.
+///   The resamples are spread across the threads selected by
+/// LatencySearchOptions.  Each one has its own random sequence from the
+/// seed, so the results are the same however many threads are used unless
+/// the time limit cuts the run short.
+class LatencyBootstrapOptions {
+  public:
+    LatencyBootstrapOptions()
+      : resamples(200), confidenceLevel(0.95), maxSeconds(10)
+      , turnaroundThreshold(7), seed(1) {}
+
+    size_t resamples;             //< How many resamples to search
+    double confidenceLevel;       //< Fraction of the resamples inside the interval
+    double maxSeconds;            //< Start no resamples after this long; 0 for no limit
+    double turnaroundThreshold;   //< Arduino values the motion must come back to turn around
+    unsigned seed;                //< Random seed, so that runs can be repeated
+};
+
+/// Latency and its uncertainty from ArduinoComparer::computeLatencyConfidence().
+typedef struct {
+  double  latencySeconds;       //< Point estimate, the same as computeLatency()
+  double  standardErrorSeconds; //< Standard deviation of the resampled latencies
+  double  lowSeconds;           //< Confidence interval from the percentiles
+  double  highSeconds;          //< of the resampled latencies
+  size_t  resamples;            //< How many resamples were searched
+  size_t  sweeps;               //< How many sweeps they were drawn from
+} LatencyConfidence;
+
+/// Latency of one device channel from ArduinoComparer::computeChannelLatencies().
+typedef struct {
+  int     channel;
+  double  latencySeconds;   //< Device behind Arduino
+  double  correlation;      //< With the Arduino values at that latency, -1 to 1
+} ChannelLatency;
+
+/// Latency over one sweep from ArduinoComparer::computeSweepLatencies().
+typedef struct {
+  double  startSeconds;     //< Arduino turnaround that starts the sweep
+  double  endSeconds;       //< and the one that ends it, from the first report
+  size_t  deviceReports;    //< Device reports showing the sweep
+  double  latencySeconds;   //< Device behind Arduino
+} SweepLatency;
+
+/// Spread of the per-sweep latencies.
+typedef struct {
+  size_t  sweeps;
+  double  minSeconds;
+  double  medianSeconds;
+  double  p95Seconds;       //< 95th percentile
+  double  maxSeconds;
+} SweepLatencySummary;
+
+/// Latency at a range of speeds from ArduinoComparer::computeVelocityProfile().
+typedef struct {
+  double  minSpeed;         //< Range of Arduino speeds in the bin, in
+  double  maxSpeed;         //< Arduino values per second
+  double  meanSpeed;
+  size_t  deviceReports;    //< Device reports in the bin
+  double  latencySeconds;   //< Device behind Arduino
+} VelocityLatency;
+
 /// Class to handle comparing sets of Arduino values against other
 /// devices' reported values to estimate the latency between them.
+/// The analysis methods spread their work across threads themselves, but
+/// each comparer must only be used from one thread at a time.
 
 class ArduinoComparer {
   public:
-    ArduinoComparer();
+    /// Largest value from the Arduino's 10-bit analog-to-digital converter.
+    static const size_t DEFAULT_ARDUINO_MAX = 1023;
+
+    /// @param [in] arduinoMax Largest value the ground-truth input can
+    ///   report, such as 4095 for a 12-bit converter or 65535 for a 16-bit
+    ///   encoder.  The mapping has an entry for every value up to this.
+    ArduinoComparer(size_t arduinoMax = DEFAULT_ARDUINO_MAX);
     ~ArduinoComparer();
 
     //=======================================================
     // Methods used to construct the mapping from Arduino to
     // Device value.  Add as many mappings as desired and
     // then turn into a mapping using constructMapping().
+    // Only the sum and count of the device values for each
+    // Arduino value are stored, so adding mappings takes no
+    // more memory however many are added.
 
     /// @brief Add an entry to help map arduino values to device values.
+    /// @return true on success, false if the Arduino value is out of range.
     bool addMapping(double arduinoVal, double deviceVal);
 
-    /// @brief Fill in any values without entries, telling how many
+    /// @brief Fill in any values without entries, telling how many.  This
+    /// can be called again at any time to bring the mapping up to date
+    /// with the entries added since.
     /// @param [out] outNumInterp How many values had to be interpolated.
     /// @return true on success, false on failure (no entries)
     bool constructMapping(size_t &outNumInterp);
 
+    /// @brief Tell the largest Arduino value that can be mapped.
+    size_t arduinoMax() const { return m_arduinoMax; }
+
     /// @brief Tell the minimum Arduino value mapped.
     size_t minArduinoValue() const { return m_minArduinoValue; }
 
@@ -92,12 +392,45 @@ class ArduinoComparer {
     // these can be used.  Arduino and device reports must be
     // added before the alignment functions can be called.
 
+    /// @brief Set how computeLatency() searches for the latency.
+    /// @return true on success, false (and the settings are unchanged)
+    ///   if the range is empty or a step or tolerance is not positive.
+    bool setLatencySearch(const LatencySearchOptions &options);
+    const LatencySearchOptions &latencySearch() const { return m_latencySearch; }
+
+    /// @brief Convert "search", "xcorr" or "extrema" to a latency estimator.
+    /// @return true on success, false if the name is not recognized.
+    static bool latencyEstimatorFromName(const std::string &name,
+      LatencyEstimator &outEstimator);
+
+    /// @brief Describe how a latency estimator finds the latency, for
+    /// labeling its results ("Error-minimizing" and so on).
+    static const char *latencyEstimatorDescription(LatencyEstimator estimator);
+
     /// @brief Add Arduino reports to those used for latency determination.
     bool addArduinoReports(std::vector<DeviceThreadReport> &r);
 
     /// @brief Add Device reports to those used for latency determination.
     bool addDeviceReports(std::vector<DeviceThreadReport> &r);
 
+    /// @brief Limit how many Arduino and Device reports are kept, so that
+    /// memory use stays flat however long reports keep being added.  Once
+    /// there are more, the oldest are dropped as new ones are added.  By
+    /// default there is no limit.
+    /// @param [in] windowSeconds Keep only the reports sampled within this
+    ///   many seconds of the latest one from the same device; 0 for no limit.
+    /// @param [in] maxReports Keep at most this many reports from each
+    ///   device; 0 for no limit.  When the devices report at different
+    ///   rates, this keeps different spans of time from each, so it is
+    ///   best used as a backstop for the window.
+    void setReportRetention(double windowSeconds, size_t maxReports);
+
+    /// @brief Forget the Arduino and Device reports from before a time, so
+    /// that the latency is computed from only the more recent ones.
+    /// @param [in] time Reports from before this time are dropped.
+    /// @param [in] arrivalTime Use arrival time rather than report time
+    void discardReportsBefore(DeviceThreadTime time, bool arrivalTime = false);
+
     /// @brief Compute the time shift that produces the best alignment.
     /// @param [in] arduinoChannel Channel to read values from for the Arduino
     /// @param [out] deviceChannel Channel to read values from for the Device
@@ -106,7 +439,9 @@ class ArduinoComparer {
     ///   recorded at a particular time.  Temporal interpolation is
     ///   used to align values not taken at the same instant.  Positive
     ///   shift means that the device values were later than the
-    ///   Arduino values, and is what is expected.
+    ///   Arduino values, and is what is expected.  It is found using the
+    ///   estimator set by setLatencySearch(), and is always within the
+    ///   range set there.
     /// @param [in] arrivalTime Use arrival time rather than report time
     /// @return true if a result was found, false if no reports.
     bool computeLatency(
@@ -116,11 +451,139 @@ class ArduinoComparer {
           , bool arrivalTime = false
       ) const;
 
+    /// @brief Compute the latency of every channel in the Device reports
+    /// at once, for devices such as trackers that report several, and
+    /// find the channel that follows the Arduino most closely.  Only one
+    /// channel has a mapping, so each channel's latency is where its
+    /// values are most correlated (or anti-correlated) with the Arduino
+    /// values; this works for channels that move roughly in proportion to
+    /// the Arduino value, as the axis being rotated does.
+    ///   The Arduino values are resampled and transformed once and shared;
+    /// the correlation at every lag in the search range is then computed
+    /// for each channel with FFTs, with the channels spread across the
+    /// threads selected by setLatencySearch().
+    /// @param [in] arduinoChannel Channel to read values from for the Arduino
+    /// @param [out] outChannels Latency and correlation for each channel.
+    ///   Channels that do not change have a correlation of 0.
+    /// @param [out] outBest Index in outChannels of the channel with the
+    ///   strongest correlation.
+    /// @param [in] arrivalTime Use arrival time rather than report time
+    /// @return true on success, false if there is too little data.
+    bool computeChannelLatencies(
+          int arduinoChannel
+          , std::vector<ChannelLatency> &outChannels
+          , size_t &outBest
+          , bool arrivalTime = false
+      ) const;
+
+    /// @brief Compute the latency separately over each sweep of the
+    /// motion, to show jitter and drift that a single latency hides.
+    ///   The measurement is split at the turnarounds of the Arduino motion,
+    /// found the way the applications count passes, and each device report
+    /// goes with the sweep whose motion it shows given the overall latency.
+    /// Each sweep's latency is found with a golden-section search of its
+    /// own reports' error within one coarse step of the overall latency;
+    /// a sweep that comes out at the edge of that range may be further
+    /// off.  The sweeps are spread across the threads selected by
+    /// setLatencySearch(), and each search only looks at the reports from
+    /// its sweep, so this stays fast with thousands of sweeps.
+    /// @param [in] arduinoChannel Channel to read values from for the Arduino
+    /// @param [in] deviceChannel Channel to read values from for the Device
+    /// @param [out] outSweeps Latency of each sweep that has at least two
+    ///   device reports, in time order.
+    /// @param [in] turnaroundThreshold Arduino values the motion must come
+    ///   back by to count as turning around.
+    /// @param [in] arrivalTime Use arrival time rather than report time
+    /// @return true on success, false if no reports or no sweeps.
+    bool computeSweepLatencies(
+          int arduinoChannel
+          , int deviceChannel
+          , std::vector<SweepLatency> &outSweeps
+          , double turnaroundThreshold = 7
+          , bool arrivalTime = false
+      ) const;
+
+    /// @brief Find the minimum, median, 95th percentile and maximum of
+    /// the latencies from computeSweepLatencies().
+    /// @return true on success, false if there are no sweeps.
+    static bool summarizeSweepLatencies(const std::vector<SweepLatency> &sweeps,
+      SweepLatencySummary &outSummary);
+
+    /// @brief Compute the latency at different speeds of the Arduino
+    /// motion, to show where a device's prediction or filtering makes it
+    /// run ahead of or behind its usual latency.
+    ///   The speed at each device report is the slope of the Arduino values
+    /// over derivativeSeconds around the time it shows given the overall
+    /// latency.  The reports are split into bins holding equal numbers of
+    /// them, from slowest to fastest, and each bin's latency is found with
+    /// a golden-section search of the error of only its reports, within
+    /// one coarse step of the overall latency.  Each bin's reports are
+    /// copied into a trajectory of their own, so its error only visits
+    /// them, skipping ahead through the Arduino trajectory between them
+    /// (see Trajectory::Cursor).  The bins are spread across the threads
+    /// selected by setLatencySearch().
+    /// @param [in] arduinoChannel Channel to read values from for the Arduino
+    /// @param [in] deviceChannel Channel to read values from for the Device
+    /// @param [in] bins How many speed bins to use.
+    /// @param [out] outProfile Latency in each bin, slowest first.
+    /// @param [in] derivativeSeconds Time over which to find the speed; it
+    ///   should span several Arduino reports, which are quantized.
+    /// @param [in] arrivalTime Use arrival time rather than report time
+    /// @return true on success, false if no reports or fewer reports than bins.
+    bool computeVelocityProfile(
+          int arduinoChannel
+          , int deviceChannel
+          , size_t bins
+          , std::vector<VelocityLatency> &outProfile
+          , double derivativeSeconds = 20e-3
+          , bool arrivalTime = false
+      ) const;
+
+    /// @brief Compute the latency as computeLatency() does, along with a
+    /// confidence interval and standard error from resampling its sweeps
+    /// (see LatencyBootstrapOptions).  Use this to tell whether the
+    /// difference between two measurements is more than noise.
+    /// @param [in] arduinoChannel Channel to read values from for the Arduino
+    /// @param [in] deviceChannel Channel to read values from for the Device
+    /// @param [in] options How many resamples and how wide an interval.
+    /// @param [out] outConfidence The latency and its uncertainty.
+    /// @param [in] arrivalTime Use arrival time rather than report time
+    /// @return true on success, false if no reports, bad options or fewer
+    ///   than two sweeps.
+    bool computeLatencyConfidence(
+          int arduinoChannel
+          , int deviceChannel
+          , const LatencyBootstrapOptions &options
+          , LatencyConfidence &outConfidence
+          , bool arrivalTime = false
+      ) const;
+
+    /// @brief Compute the error between the Arduino and Device values at
+    /// each of a set of offsets, to see how well-defined the minimum is.
+    /// The error is the sum of squared differences minimized by the error
+    /// search in computeLatency().
+    /// @param [in] arduinoChannel Channel to read values from for the Arduino
+    /// @param [in] deviceChannel Channel to read values from for the Device
+    /// @param [in] offsetsSeconds Offsets at which to compute the error,
+    ///   with positive meaning the device is behind the Arduino.
+    /// @param [out] outErrors Error at each offset.
+    /// @param [in] arrivalTime Use arrival time rather than report time
+    /// @return true on success, false if no reports.
+    bool computeErrorCurve(
+          int arduinoChannel
+          , int deviceChannel
+          , const std::vector<double> &offsetsSeconds
+          , std::vector<double> &outErrors
+          , bool arrivalTime = false
+      ) const;
+
   protected:
     //=======================================================
     // Data structures and routines to produce a mapping
     // between Arduino values and the reported device values.
-    std::vector<std::vector<double> > m_mappingVector;      //< device values
+    size_t m_arduinoMax;                  //< Largest Arduino value
+    std::vector<double> m_mappingSum;     //< Sum of device values for each Arduino value
+    std::vector<size_t> m_mappingCount;   //< How many device values for each
     std::vector<double> m_mappingMean;    //< Mean values mapping from Arduino to device
     size_t m_minArduinoValue;       //< Minimum mapped Arduino value.
     size_t m_maxArduinoValue;       //< Maximum mapped Arduino value.
@@ -128,14 +591,71 @@ class ArduinoComparer {
     //=======================================================
     // Data structures and routines to enable estimation of
     // latency.
-    std::vector<DeviceThreadReport> m_arduinoReports;
-    std::vector<DeviceThreadReport> m_deviceReports;
+    ReportColumns m_arduinoReports;
+    ReportColumns m_deviceReports;
+    DeviceThreadTime m_retentionWindow;   //< 0 for no limit
+    size_t m_retentionCount;              //< 0 for no limit
+    LatencySearchOptions m_latencySearch;
+
+    /// @brief Drop the reports that the retention limits say to.
+    void applyRetention(ReportColumns &reports);
+
+    //=======================================================
+    // Trajectories for the channels and time bases that have been asked
+    // for, kept up to date as reports are added and dropped so that
+    // asking again only costs the search.  Their times are from a start
+    // time that is fixed when the first one is made, so that adding
+    // reports never moves the entries already there.  Because these are
+    // updated by the const methods that use them, an ArduinoComparer
+    // must only be used from one thread at a time.
+    class CachedTrajectory {
+    public:
+      CachedTrajectory() : m_firstReport(0), m_endReport(0) {}
+      Trajectory m_trajectory;
+      size_t m_firstReport;     //< Reports discarded before it was last updated
+      size_t m_endReport;       //< Reports added to it, counting discarded ones
+    };
+    typedef std::map<std::pair<int, bool>, CachedTrajectory> TrajectoryCache;
+    mutable TrajectoryCache m_arduinoTrajectories;  //< By channel and time base
+    mutable TrajectoryCache m_deviceTrajectories;
+    mutable DeviceThreadTime m_trajectoryStart[2];  //< By time base
+    mutable bool m_haveTrajectoryStart[2];
+
+    /// @brief Bring the trajectory for a channel up to date and return it.
+    /// It stays valid until the next call for the same channel.
+    const Trajectory &cachedTrajectory(const ReportColumns &reports,
+      TrajectoryCache &cache, int channel, bool arrivalTime) const;
+    const Trajectory &arduinoTrajectory(int channel, bool arrivalTime) const {
+      return cachedTrajectory(m_arduinoReports, m_arduinoTrajectories, channel, arrivalTime);
+    }
+    const Trajectory &deviceTrajectory(int channel, bool arrivalTime) const {
+      return cachedTrajectory(m_deviceReports, m_deviceTrajectories, channel, arrivalTime);
+    }
+
+    /// @brief Time that is 0 seconds for the cached trajectories.  There
+    /// must be reports.
+    DeviceThreadTime trajectoryStart(bool arrivalTime) const;
+
+    /// @brief Index into the mapping for an Arduino value, clamped to the
+    /// mapping's range.
+    size_t mappingIndex(double arduinoValue) const {
+      if (arduinoValue <= 0) { return 0; }
+      size_t index = static_cast<size_t>(arduinoValue);
+      return index < m_arduinoMax ? index : m_arduinoMax;
+    }
+
+    /// @brief Expected device value for an Arduino value.
+    double mappedValue(double arduinoValue) const {
+      return m_mappingMean[mappingIndex(arduinoValue)];
+    }
 
     /// @brief Compute the sum of squared errors for trajectories given offset.
     /// @param [in] aT Trajectory to use for the Arduino values
     /// @param [in] dT Trajectory to use for the Device values
     /// @param [in] offsetSeconds How far to shift the device values into the
     ///   future when computing the differences.
+    /// @param [in] weights If not NULL, how many times to count each device
+    ///   entry's squared difference.
     /// @return The sum of squared differences between the device values
     ///   shifted in time by the specified offset and the expected mapping
     ///   for the nearest-time Arduino values.
@@ -143,6 +663,114 @@ class ArduinoComparer {
                 const Trajectory &aT
                 , const Trajectory &dT
                 , double offsetSeconds
+                , const std::vector<double> *weights = NULL
+           ) const;
+
+    /// @brief Find the latency between trajectories with the estimator set
+    /// by setLatencySearch().
+    /// @return true on success, false if there is too little data.
+    bool findLatency(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double &outLatencySeconds
+           ) const;
+
+    /// @brief Find the latency as findLatency() does, along with the range
+    /// to search near it for the latency of part of the measurement: one
+    /// coarse step either side, within the search range.
+    /// @return true on success, false if there is too little data.
+    bool findLatencyRange(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double &outLatencySeconds
+                , double &outLoSeconds
+                , double &outHiSeconds
+           ) const;
+
+    /// The overall latency, the range to search near it for the latency of
+    /// part of the measurement, and the sweeps of the Arduino motion with
+    /// the device entries that show each.
+    typedef struct {
+      double  latencySeconds;     //< Overall latency
+      double  loSeconds;          //< Range from findLatencyRange()
+      double  hiSeconds;
+      std::vector<double> boundsSeconds;  //< Start, each turnaround, end
+      std::vector<size_t> firstEntry;     //< First device entry of each sweep,
+                                          //< then the number of entries
+    } SweepSplit;
+
+    /// @brief Find the latency and split the measurement into sweeps at
+    /// the Arduino turnarounds.  Device entry i shows sweep s when
+    /// boundsSeconds[s] <= (its time - latency) < boundsSeconds[s + 1];
+    /// entries from before the start are put in the first sweep and
+    /// those from after the end in the last one, so every entry is in
+    /// exactly one sweep.
+    /// @param [in] turnaroundThreshold As for Trajectory::findTurnarounds();
+    ///   0 or less leaves the whole measurement as one sweep.
+    /// @return true on success, false if there is too little data.
+    bool splitSweeps(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double turnaroundThreshold
+                , SweepSplit &outSplit
+           ) const;
+
+    /// @brief Narrow in on the minimum error between two offsets with a
+    /// golden-section search.
+    /// @param [in] bestOffset Best offset seen so far, and its error.
+    /// @param [in] weights As for computeError().
+    /// @return The offset with the smallest error seen.
+    double refineLatency(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double lo
+                , double hi
+                , double bestOffset
+                , double bestError
+                , const std::vector<double> *weights = NULL
+           ) const;
+
+    /// @brief Compute the error at each offset, spreading them across
+    /// the threads selected by setLatencySearch().
+    void computeErrors(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , const std::vector<double> &offsetsSeconds
+                , std::vector<double> &outErrors
+           ) const;
+
+    /// @brief Estimate the error at offsets across the search range from
+    /// trajectories resampled onto a uniform grid.
+    /// @param [out] outStepSeconds Spacing of the offsets.
+    /// @return true on success, false if there is too little data.
+    bool computeResampledErrors(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , std::vector<double> &outOffsetsSeconds
+                , std::vector<double> &outErrors
+                , double &outStepSeconds
+           ) const;
+
+    /// @brief Time to use as 0 seconds for the trajectories: the earliest
+    /// time in either of the report lists.  There must be reports.
+    DeviceThreadTime startTime(bool arrivalTime) const;
+
+    /// @brief Find the lag that maximizes the cross-correlation between the
+    /// mapped Arduino values and the device values.
+    /// @return true on success, false if there is too little data.
+    bool computeCrossCorrelationLatency(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double &outLatencySeconds
+           ) const;
+
+    /// @brief Find the typical time between matching turnarounds of the
+    /// Arduino and device values.
+    /// @return true on success, false if no turnarounds could be matched.
+    bool computeExtremumLatency(
+                const Trajectory &aT
+                , const Trajectory &dT
+                , double &outLatencySeconds
            ) const;
 };
 
@@ -15,32 +15,139 @@
 */
 
 #include "DeviceThread.h"
+#include "DeviceThreadHub.h"
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/select.h>
+#endif
 
-const struct timeval DeviceThread::NOW = { 0, 0};
+const DeviceThreadTime DeviceThread::NOW;
 
-DeviceThread::DeviceThread()
+DeviceThreadTime DeviceThreadNow()
 {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Helper to turn a wall-clock time into nanoseconds.
+static DeviceThreadTime TimevalNanoseconds(const struct timeval &t)
+{
+  return static_cast<DeviceThreadTime>(t.tv_sec) * 1000000000 +
+    static_cast<DeviceThreadTime>(t.tv_usec) * 1000;
+}
+
+// Measure how far the wall clock is ahead of the monotonic clock.  We
+// read the wall clock between two monotonic readings several times and
+// keep the tightest bracket, taking its midpoint as the monotonic time
+// that matches the wall-clock reading.
+static DeviceThreadTime MeasureWallClockOffset()
+{
+  DeviceThreadTime bestOffset = 0;
+  DeviceThreadTime bestSpan = -1;
+  for (int i = 0; i < 10; i++) {
+    DeviceThreadTime before = DeviceThreadNow();
+    struct timeval wall;
+    vrpn_gettimeofday(&wall, NULL);
+    DeviceThreadTime after = DeviceThreadNow();
+    if ((bestSpan < 0) || (after - before < bestSpan)) {
+      bestSpan = after - before;
+      bestOffset = TimevalNanoseconds(wall) - (before + (after - before) / 2);
+    }
+  }
+  return bestOffset;
+}
+
+DeviceThreadTime DeviceThreadTimeFromTimeval(const struct timeval &t)
+{
+  // Measured once, the first time we're called; this is thread-safe.
+  static const DeviceThreadTime offset = MeasureWallClockOffset();
+  return TimevalNanoseconds(t) - offset;
+}
+
+DeviceThread::DeviceThread(size_t reportCapacity, DeviceThreadHub *hub)
+  : m_hub(hub)
+  , m_reports(reportCapacity)
+  , m_droppedReports(0)
+  , m_reportsAdded(0)
+  , m_waitingFor(0)
+  , m_waitPolicy(DEVICE_THREAD_WAIT_SPIN)
+  , m_spinIterations(DEFAULT_SPIN_ITERATIONS)
+  , m_blockMicroseconds(DEFAULT_BLOCK_MICROSECONDS)
+  , m_resetStatistics(false)
+  , m_schedulingRequested(false)
+  , m_holdingDmaLatency(false)
+{
+  ClearWaitStatistics();
+
   // Start the device thread and wait until it is running or broken.
   // Give it a pointer to this object so that it can call the
-  // appropriate methods.
-  vrpn_ThreadData td;
-  td.pvUD = this;
-  m_thread = new vrpn_Thread(ThreadToRun, td);
+  // appropriate methods.  If we're being serviced by a hub, we
+  // don't need a thread of our own.
+  m_thread = NULL;
+  if (!m_hub) {
+    vrpn_ThreadData td;
+    td.pvUD = this;
+    m_thread = new vrpn_Thread(ThreadToRun, td);
+  }
   m_broken = false; // Not broken yet.
 }
 
 DeviceThread::~DeviceThread()
 {
+  if (m_holdingDmaLatency) {
+    DeviceThreadReleaseDmaLatency();
+  }
+}
+
+void *DeviceThread::operator new(size_t size)
+{
+  void *ret = NULL;
+#ifdef _WIN32
+  ret = _aligned_malloc(size, alignof(DeviceThread));
+#else
+  if (posix_memalign(&ret, alignof(DeviceThread), size) != 0) {
+    ret = NULL;
+  }
+#endif
+  if (!ret) {
+    throw std::bad_alloc();
+  }
+  return ret;
+}
+
+void DeviceThread::operator delete(void *p)
+{
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  free(p);
+#endif
 }
 
 void DeviceThread::StartThread()
 {
+  if (m_hub) {
+    m_hub->AddDevice(this);
+    return;
+  }
   m_thread->go();
   while (!m_thread->running() && !m_broken) {};
 }
 
 void DeviceThread::StopThread()
 {
+  // If a hub is servicing us, have it stop.  This waits until it is not
+  // in the middle of servicing us.
+  if (m_hub) {
+    m_hub->RemoveDevice(this);
+    return;
+  }
+
   // Tell our thread it is time to stop running by grabbing its
   // semaphore.  Wait until it has stopped and then delete it.
   m_quit.p();
@@ -55,54 +162,320 @@ void DeviceThread::ThreadToRun(vrpn_ThreadData &threadData)
   DeviceThread *me = static_cast<DeviceThread *>(threadData.pvUD);
 
   // Continue running until our parent yanks our semaphore to get us to quit.
-  // We don't sleep here; we're trying to minimize the latency of our
-  // measurements even if it eats an entire CPU.
+  // By default we don't sleep here; we're trying to minimize the latency of
+  // our measurements even if it eats an entire CPU.  The other wait policies
+  // let the thread give up the CPU once the device has been idle for a
+  // while.
+  unsigned idlePasses = 0;
   while (!me->m_broken && (me->m_quit.condP() == 1) ) {
     me->m_quit.v(); // Restore the semaphore for the next time around.
 
-    // If we run into trouble, mark ourselves as broken.
-    if (!me->ServiceDevice()) {
-      me->m_broken = true;
+    bool gotReports = me->ServicePass();
+
+    // See if it is time to wait.  We only wait after enough passes in a
+    // row that produced no reports.
+    DeviceThreadWaitPolicy policy = me->m_waitPolicy;
+    if (policy == DEVICE_THREAD_WAIT_SPIN) {
+      continue;
+    }
+    if (gotReports) {
+      idlePasses = 0;
+      continue;
+    }
+    if (++idlePasses < me->m_spinIterations) {
+      continue;
     }
+    idlePasses = 0;
+    me->WaitForDevice(policy);
+  }
+}
+
+bool DeviceThread::ServicePass()
+{
+  if (m_schedulingRequested) {
+    ApplyScheduling();
+    m_schedulingRequested = false;
+  }
+  if (m_resetStatistics) {
+    ClearWaitStatistics();
+    m_resetStatistics = false;
+  }
+
+  // If we run into trouble, mark ourselves as broken and wake anyone
+  // waiting for reports that will never come.
+  size_t reportsBefore = m_reportsAdded;
+  if (!ServiceDevice()) {
+    m_broken = true;
+    std::lock_guard<std::mutex> lock(m_waitMutex);
+    m_waitCondition.notify_all();
+  }
+  return m_reportsAdded != reportsBefore;
+}
+
+void DeviceThread::WaitForDevice(DeviceThreadWaitPolicy policy)
+{
+  unsigned usec = m_blockMicroseconds;
+  DeviceThreadTime before = DeviceThreadNow();
+
+  // Wait for an event if asked and the device can do it; otherwise sleep.
+  bool waited = false;
+  if (policy == DEVICE_THREAD_WAIT_EVENT) {
+    struct timeval timeout;
+    timeout.tv_sec = usec / 1000000;
+    timeout.tv_usec = usec % 1000000;
+    waited = WaitForDeviceEvent(timeout);
+  }
+  if (!waited) {
+    vrpn_SleepMsecs(usec * 1e-3);
+  }
+
+  RecordWait(DeviceThreadNow() - before);
+}
+
+void DeviceThread::RecordWait(DeviceThreadTime blocked)
+{
+  m_statWaits++;
+  m_statBlocked += blocked;
+}
+
+bool DeviceThread::WaitForDeviceEvent(const struct timeval &timeout)
+{
+  std::vector<int> fds;
+  if (!GetDeviceEventDescriptors(fds)) { return false; }
+  return WaitForDescriptors(fds, timeout);
+}
+
+bool DeviceThread::WaitForDescriptors(const std::vector<int> &fds,
+  const struct timeval &timeout)
+{
+#ifdef _WIN32
+  // VRPN's serial descriptors on Windows index its own table of handles
+  // rather than being sockets, so select() cannot wait on them.
+  return false;
+#else
+  if (fds.empty()) { return false; }
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  int maxFd = -1;
+  for (size_t i = 0; i < fds.size(); i++) {
+    if ((fds[i] < 0) || (fds[i] >= FD_SETSIZE)) { return false; }
+    FD_SET(fds[i], &readSet);
+    maxFd = std::max(maxFd, fds[i]);
+  }
+  // select() may change the timeout, so hand it a copy.  Being interrupted
+  // by a signal just ends the wait early, which is harmless.
+  struct timeval t = timeout;
+  select(maxFd + 1, &readSet, NULL, NULL, &t);
+  return true;
+#endif
+}
+
+void DeviceThread::SetWaitPolicy(DeviceThreadWaitPolicy policy
+  , unsigned spinIterations, unsigned blockMicroseconds)
+{
+  m_spinIterations = spinIterations;
+  m_blockMicroseconds = blockMicroseconds;
+  m_waitPolicy = policy;
+}
+
+bool DeviceThread::WaitPolicyFromName(const std::string &name,
+  DeviceThreadWaitPolicy &outPolicy)
+{
+  if (name == "spin") {
+    outPolicy = DEVICE_THREAD_WAIT_SPIN;
+  } else if (name == "block") {
+    outPolicy = DEVICE_THREAD_WAIT_SPIN_THEN_BLOCK;
+  } else if (name == "event") {
+    outPolicy = DEVICE_THREAD_WAIT_EVENT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void DeviceThread::ClearWaitStatistics()
+{
+  m_statReports = 0;
+  m_statWaits = 0;
+  m_statBlocked = 0;
+  m_statDelay = 0;
+  m_statMaxDelay = 0;
+  m_statStart = DeviceThreadNow();
+}
+
+DeviceThreadWaitStatistics DeviceThread::GetWaitStatistics() const
+{
+  // Each value is read separately, so they may be off from each other by
+  // a report or a wait if the thread is running.
+  DeviceThreadWaitStatistics ret;
+  ret.reports = m_statReports;
+  ret.waits = m_statWaits;
+  ret.blockedSeconds = DeviceThreadSeconds(m_statBlocked);
+  ret.elapsedSeconds = DeviceThreadSeconds(DeviceThreadNow() - m_statStart);
+  ret.meanDelaySeconds = 0;
+  if (ret.reports > 0) {
+    ret.meanDelaySeconds = DeviceThreadSeconds(m_statDelay) / ret.reports;
+  }
+  ret.maxDelaySeconds = DeviceThreadSeconds(m_statMaxDelay);
+  return ret;
+}
+
+bool DeviceThread::SetSchedulingOptions(
+  const DeviceThreadSchedulingOptions &options,
+  DeviceThreadSchedulingStatus &status)
+{
+  // Hand the per-thread settings to whichever thread is servicing us and
+  // wait for it to apply them.  If it has broken, it never will.
+  m_schedulingOptions = options;
+  m_schedulingRequested = true;
+  while (m_schedulingRequested && !m_broken) {
+    vrpn_SleepMsecs(1);
+  }
+  if (m_schedulingRequested) {
+    m_schedulingRequested = false;
+    m_schedulingStatus = DeviceThreadSchedulingStatus();
+  }
+  status = m_schedulingStatus;
+
+  // The rest affect the whole process or machine, so we can do them here.
+  if (options.lockMemory) {
+    status.lockMemory = DeviceThreadLockMemory();
+  }
+  if (options.holdDmaLatency && !m_holdingDmaLatency) {
+    m_holdingDmaLatency = DeviceThreadAcquireDmaLatency();
+  } else if (!options.holdDmaLatency && m_holdingDmaLatency) {
+    DeviceThreadReleaseDmaLatency();
+    m_holdingDmaLatency = false;
+  }
+  status.holdDmaLatency = options.holdDmaLatency && m_holdingDmaLatency;
+
+  return (status.realtimePriority || (options.realtimePriority <= 0))
+    && (status.affinity || options.cpus.empty())
+    && (status.lockMemory || !options.lockMemory)
+    && (status.holdDmaLatency || !options.holdDmaLatency);
+}
+
+void DeviceThread::ApplyScheduling()
+{
+  m_schedulingStatus = DeviceThreadSchedulingStatus();
+  if (m_schedulingOptions.realtimePriority > 0) {
+    m_schedulingStatus.realtimePriority =
+      DeviceThreadSetRealtimePriority(m_schedulingOptions.realtimePriority);
+  }
+  if (!m_schedulingOptions.cpus.empty()) {
+    m_schedulingStatus.affinity =
+      DeviceThreadSetAffinity(m_schedulingOptions.cpus);
   }
 }
 
 void DeviceThread::AddReport(
-  std::vector<double> values
-  , struct timeval sampleTime)
+  const DeviceThreadValues &values
+  , DeviceThreadTime sampleTime
+  , DeviceThreadTime arrivalTime)
 {
-  // The arrival time is always now.
-  struct timeval arrivalTime;
-  vrpn_gettimeofday(&arrivalTime, NULL);
+  // The arrival time is now unless we were told otherwise.
+  if (arrivalTime == NOW) {
+    arrivalTime = DeviceThreadNow();
+  }
 
   // If the sampleTime is NOW, then replace it with the arrival time.
-  if ( (sampleTime.tv_sec == NOW.tv_sec) && (sampleTime.tv_usec == NOW.tv_usec)) {
+  if (sampleTime == NOW) {
     sampleTime = arrivalTime;
   }
 
-  // This is called in the sub-thread to add a report to the list of available
-  // reports.  We yank the report-vector semaphore while we're adding it to
-  // avoid races.
+  // This is called in the sub-thread to add a report to the queue of available
+  // reports.  We are the only producer, so this does not need a lock.  If
+  // the application has fallen so far behind that the queue is full, we
+  // drop the report rather than wait for it.
   DeviceThreadReport r;
   r.arrivalTime = arrivalTime;
   r.sampleTime = sampleTime;
   r.values = values;
-  m_reportSemaphore.p();
-  m_reports.push_back(r);
-  m_reportSemaphore.v();
+  if (!m_reports.push(r)) {
+    m_droppedReports++;
+  }
+  m_reportsAdded++;
+  WakeWaiter();
+
+  // Keep track of how long it took the report to get to us.
+  DeviceThreadTime delay = arrivalTime - sampleTime;
+  m_statReports++;
+  m_statDelay += delay;
+  if (delay > m_statMaxDelay) {
+    m_statMaxDelay = delay;
+  }
 }
 
-std::vector<DeviceThreadReport> DeviceThread::GetReports()
+void DeviceThread::WakeWaiter()
+{
+  // The fence orders our push of the report before our read of
+  // m_waitingFor; WaitForReports() has a matching fence.  Either it sees
+  // the report or we see that it is waiting.  We only take the mutex,
+  // which it holds until it is actually waiting, when it has enough.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  size_t waitingFor = m_waitingFor.load(std::memory_order_relaxed);
+  if ((waitingFor > 0) && (m_reports.size() >= waitingFor)) {
+    std::lock_guard<std::mutex> lock(m_waitMutex);
+    m_waitCondition.notify_all();
+  }
+}
+
+std::vector<DeviceThreadReport> DeviceThread::WaitForReports(size_t minCount,
+  double timeoutSeconds)
 {
-  // We use the semaphore to keep from reading while the subthread is
-  // updating.  We make a copy of the reports to send back to the
-  // client and then clear the reports.
   std::vector<DeviceThreadReport> ret;
-  m_reportSemaphore.p();
-  ret = m_reports;
-  m_reports.clear();
-  m_reportSemaphore.v();
+  WaitForReports(minCount, timeoutSeconds, ret);
+  return ret;
+}
 
+size_t DeviceThread::WaitForReports(size_t minCount, double timeoutSeconds,
+  std::vector<DeviceThreadReport> &reports)
+{
+  if ((minCount > 0) && (timeoutSeconds > 0) && (m_reports.size() < minCount)) {
+    std::unique_lock<std::mutex> lock(m_waitMutex);
+    m_waitingFor.store(minCount, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    m_waitCondition.wait_for(lock,
+      std::chrono::duration<double>(timeoutSeconds),
+      [this, minCount] { return m_broken || (m_reports.size() >= minCount); });
+    m_waitingFor.store(0, std::memory_order_relaxed);
+  }
+  return GetReports(reports);
+}
+
+std::vector<DeviceThreadReport> DeviceThread::GetReports()
+{
+  std::vector<DeviceThreadReport> ret;
+  GetReports(ret);
   return ret;
 }
 
+size_t DeviceThread::GetReports(std::vector<DeviceThreadReport> &reports)
+{
+  // Drain the reports that are in the queue right now.  The subthread may
+  // keep adding reports while we do this; we stop at the count we saw
+  // when we started so a fast device can't keep us here forever.  Any we
+  // don't get will be returned next time.
+  //   Each report is copied straight from its queue slot into the caller's
+  // vector, whose storage is kept from call to call.  Elements the vector
+  // already has are assigned to and new ones are copy-constructed, both
+  // of which copy only the values in use; resize() would first zero the
+  // whole inline value array of each new report.
+  size_t count = m_reports.size();
+  if (reports.capacity() < count) {
+    reports.reserve(count);
+  }
+  size_t i;
+  for (i = 0; i < count; i++) {
+    const DeviceThreadReport *r = m_reports.front();
+    if (!r) { break; }
+    if (i < reports.size()) {
+      reports[i] = *r;
+    } else {
+      reports.push_back(*r);
+    }
+    m_reports.consume();
+  }
+  reports.erase(reports.begin() + i, reports.end());
+  return i;
+}
@@ -16,7 +16,77 @@
 
 #pragma once
 #include <vrpn_Shared.h>
+#include <SPSCRingBuffer.h>
+#include <DeviceThreadScheduling.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <vector>
+#include <string>
+#include <string.h>
+#include <stdint.h>
+
+/// Time in nanoseconds on a monotonic clock that does not follow
+/// wall-clock adjustments.  Differences between two of these are exact
+/// durations and are cheap to compute.  The zero point is arbitrary (it
+/// is not tied to any calendar date), so only compare these with each other.
+typedef int64_t DeviceThreadTime;
+
+/// @brief The current time on the DeviceThread monotonic clock.
+DeviceThreadTime DeviceThreadNow();
+
+/// @brief Convert a wall-clock time, such as the msg_time from a VRPN
+/// callback, into the DeviceThread monotonic time base.  The offset between
+/// the two clocks is measured the first time this is called.
+DeviceThreadTime DeviceThreadTimeFromTimeval(const struct timeval &t);
+
+/// @brief Convert a DeviceThread time or duration into seconds.
+inline double DeviceThreadSeconds(DeviceThreadTime t) { return t * 1e-9; }
+
+/// Fixed-capacity set of values from one report.  The values are stored
+/// inline rather than on the heap so that building, queueing and copying
+/// a report never allocates memory.  Only the values actually in use are
+/// copied.  It provides the subset of the std::vector interface used by
+/// the latency-testing code.
+class DeviceThreadValues {
+  public:
+    /// Largest number of values in a report.  This matches vrpn_CHANNEL_MAX,
+    /// the most channels a vrpn_Analog can report.
+    static const size_t MAX_VALUES = 128;
+
+    DeviceThreadValues() : m_size(0) {}
+    DeviceThreadValues(const DeviceThreadValues &v) : m_size(v.m_size) {
+      memcpy(m_values, v.m_values, m_size * sizeof(double));
+    }
+    DeviceThreadValues &operator = (const DeviceThreadValues &v) {
+      m_size = v.m_size;
+      memcpy(m_values, v.m_values, m_size * sizeof(double));
+      return *this;
+    }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    static size_t capacity() { return MAX_VALUES; }
+    void clear() { m_size = 0; }
+
+    /// @brief Add a value to the end.
+    /// @return true on success, false (and the value is ignored) if full.
+    bool push_back(double v) {
+      if (m_size >= MAX_VALUES) { return false; }
+      m_values[m_size++] = v;
+      return true;
+    }
+
+    double &operator [] (size_t i) { return m_values[i]; }
+    double operator [] (size_t i) const { return m_values[i]; }
+    double back() const { return m_values[m_size - 1]; }
+    const double *begin() const { return m_values; }
+    const double *end() const { return m_values + m_size; }
+
+  protected:
+    size_t m_size;                  //< How many values are in use
+    double m_values[MAX_VALUES];    //< Storage for the values
+};
 
 /// This is a structure that describes one set of reports that came in
 /// at the same time from a single device.  There should always be the
@@ -26,11 +96,31 @@
 ///   Note: If the time that they were measured is not known, the
 /// arrival time can be stored in this field as well.
 typedef struct {
-  std::vector<double> values;     //< Vector of values.
-  struct timeval      sampleTime; //< Time when the values were sampled
-  struct timeval      arrivalTime;//< Time when the values reached this program.
+  DeviceThreadValues  values;     //< Values, stored inline.
+  DeviceThreadTime    sampleTime; //< Time when the values were sampled
+  DeviceThreadTime    arrivalTime;//< Time when the values reached this program.
 } DeviceThreadReport;
 
+/// How a DeviceThread waits when servicing its device produced nothing new.
+typedef enum {
+  DEVICE_THREAD_WAIT_SPIN,            //< Never wait: lowest latency, uses a whole core
+  DEVICE_THREAD_WAIT_SPIN_THEN_BLOCK, //< Spin for a while, then sleep briefly
+  DEVICE_THREAD_WAIT_EVENT            //< Spin for a while, then block until the device has data
+} DeviceThreadWaitPolicy;
+
+/// Statistics about how a DeviceThread has been waiting, used to compare
+/// the cost of the different wait policies.
+typedef struct {
+  size_t  reports;          //< Reports added since the last reset
+  size_t  waits;            //< Times the thread blocked since the last reset
+  double  blockedSeconds;   //< Time spent blocked since the last reset
+  double  elapsedSeconds;   //< Time since the last reset
+  double  meanDelaySeconds; //< Mean of arrival time minus sample time
+  double  maxDelaySeconds;  //< Largest arrival time minus sample time
+} DeviceThreadWaitStatistics;
+
+class DeviceThreadHub;
+
 /// This declares a class that can be used to wrap a thread around an
 /// object that emits values.  This is an abstract base class from which
 /// you can derive a class to handle an actual object by filling in the
@@ -40,26 +130,130 @@ typedef struct {
 /// rotation with very low latency and photodetectors to measure light
 /// intensity changes).
 ///   Each object emits a time-stamped vector of value sets, where each
-/// value set is a vector of doubles.
+/// value set is a fixed-capacity set of doubles.
 ///   Sets of these classes are compared against one another in the
 /// various latency-testing applications.
+///   A device can instead be serviced by a DeviceThreadHub, which runs
+/// many devices on a single thread.  Each still has its own report queue,
+/// so the application reads from it the same way.
+///   Reports are handed from the device thread to the application through
+/// a lock-free single-producer/single-consumer queue, so the device thread
+/// never waits on the application to publish a report.  GetReports() must
+/// only be called from one application thread.
 
 class DeviceThread {
   public:
+    /// Default number of reports that can be queued between calls to
+    /// GetReports() before new reports are dropped.
+    static const size_t DEFAULT_REPORT_CAPACITY = 4096;
+
     /// Construct the thread, which also starts the device running using the
     /// virtual functions below.
-    DeviceThread();
+    /// @param reportCapacity [in] How many reports can be queued waiting
+    /// for the application to call GetReports() before further reports
+    /// are dropped.  Rounded up to a power of two.
+    /// @param hub [in] If not NULL, the hub's thread services this device
+    /// rather than a thread of its own.  The hub must outlive the device.
+    DeviceThread(size_t reportCapacity = DEFAULT_REPORT_CAPACITY,
+      DeviceThreadHub *hub = NULL);
 
     /// Shut down the device, stopping the subthread.  Wait until the
     /// thread finishes and then return.
     virtual ~DeviceThread();
 
+    /// The report queue keeps its indices on their own cache lines, which
+    /// plain operator new does not line up before C++17, so devices are
+    /// allocated with the alignment they need.
+    static void *operator new(size_t size);
+    static void operator delete(void *p);
+
     //=======================================================
     // Methods used to send info back to the application.
     bool IsBroken() const { return m_broken; }
     std::vector<DeviceThreadReport> GetReports();
 
+    /// @brief Move all available reports into a caller-supplied vector.
+    /// The vector is cleared and refilled in place, so a caller that keeps
+    /// passing the same vector reuses its storage and never allocates once
+    /// it has grown to the largest batch.  This is the preferred form
+    /// for loops that read reports repeatedly.
+    /// @param reports [out] Replaced with the available reports.
+    /// @return Number of reports returned.
+    size_t GetReports(std::vector<DeviceThreadReport> &reports);
+
+    /// @brief Wait for reports to become available, then return them.
+    /// Blocks without using the CPU until at least minCount reports are
+    /// queued, the timeout expires, or the thread breaks; it wakes as
+    /// soon as the device thread publishes enough reports.
+    /// @param minCount [in] How many reports to wait for.  0 does not wait.
+    /// @param timeoutSeconds [in] Longest time to wait.
+    /// @return All available reports, which may be fewer than minCount
+    ///   (or none) if the timeout expired or the thread is broken.
+    std::vector<DeviceThreadReport> WaitForReports(size_t minCount,
+      double timeoutSeconds);
+
+    /// @brief As above, reusing a caller-supplied vector like GetReports().
+    size_t WaitForReports(size_t minCount, double timeoutSeconds,
+      std::vector<DeviceThreadReport> &reports);
+
+    /// @brief Tell how many reports were dropped because the queue was full.
+    size_t GetDroppedReportCount() const { return m_droppedReports.load(); }
+
+    //=======================================================
+    // Methods used to control how the thread waits for its device.
+
+    /// Default number of consecutive idle passes before blocking.
+    static const unsigned DEFAULT_SPIN_ITERATIONS = 1000;
+    /// Default time to block, in microseconds.
+    static const unsigned DEFAULT_BLOCK_MICROSECONDS = 500;
+
+    /// @brief Select how the thread waits when its device is idle.
+    /// The default is DEVICE_THREAD_WAIT_SPIN, which gives the lowest
+    /// latency at the cost of a full core.  This can be changed at any
+    /// time; the thread picks it up on its next pass.
+    /// @param policy [in] How to wait.
+    /// @param spinIterations [in] For the blocking policies, how many
+    ///   passes in a row must produce no report before the thread blocks.
+    /// @param blockMicroseconds [in] For the blocking policies, how long
+    ///   to sleep, or the longest to wait for a device event.  Devices
+    ///   that cannot wait for events sleep instead.
+    void SetWaitPolicy(DeviceThreadWaitPolicy policy
+      , unsigned spinIterations = DEFAULT_SPIN_ITERATIONS
+      , unsigned blockMicroseconds = DEFAULT_BLOCK_MICROSECONDS);
+    DeviceThreadWaitPolicy GetWaitPolicy() const { return m_waitPolicy.load(); }
+
+    /// @brief Convert "spin", "block" or "event" to a wait policy.
+    /// @return true on success, false if the name is not recognized.
+    static bool WaitPolicyFromName(const std::string &name,
+      DeviceThreadWaitPolicy &outPolicy);
+
+    /// @brief Report how the thread has been waiting since the last reset.
+    DeviceThreadWaitStatistics GetWaitStatistics() const;
+
+    /// @brief Start a new measurement interval for GetWaitStatistics().
+    /// The thread clears the statistics on its next pass.
+    void ResetWaitStatistics() { m_resetStatistics = true; }
+
+    //=======================================================
+    // Methods used to keep the thread from being preempted.
+
+    /// @brief Ask for real-time priority, CPU affinity, memory locking
+    /// and low CPU DMA latency.  Priority and affinity are applied by the
+    /// thread that services the device (a hub's thread is shared with its
+    /// other devices) on its next pass; this waits until it has done so.
+    /// Settings that cannot be applied, usually for lack of privileges,
+    /// are left off.
+    /// @param options [in] Settings to request.
+    /// @param status [out] Which of the requested settings took effect.
+    /// @return true if all of them did, false if any did not.
+    bool SetSchedulingOptions(const DeviceThreadSchedulingOptions &options,
+      DeviceThreadSchedulingStatus &status);
+
   protected:
+    // The hub calls ServicePass(), the event-waiting methods and
+    // RecordWait().
+    friend class DeviceThreadHub;
+
     //=======================================================
     // All subclasses override this method.
     /// Service the device; this is called repeatedly while the
@@ -67,9 +261,32 @@ class DeviceThread {
     /// below whenever a new report comes in from the device.
     virtual bool ServiceDevice() = 0;
 
+    /// Wait until the device may have new data or the timeout expires.
+    /// Used by the DEVICE_THREAD_WAIT_EVENT policy.  The default waits on
+    /// the descriptors from GetDeviceEventDescriptors(); subclasses that
+    /// wait some other way override this.
+    /// @return true if the wait was done, false if not supported (the
+    ///   thread then sleeps instead).
+    virtual bool WaitForDeviceEvent(const struct timeval &timeout);
+
+    /// Add the file descriptors that become readable when the device has
+    /// new data, such as its serial port, to fds.  The default has none.
+    /// @return true if waiting on the descriptors is enough to hear about
+    ///   new data, false if the device cannot be waited on this way.
+    virtual bool GetDeviceEventDescriptors(std::vector<int> & /*fds*/) {
+      return false;
+    }
+
+    /// Wait until one of the descriptors is readable or the timeout expires.
+    /// @return true if the wait was done, false if there were no
+    ///   descriptors or this platform cannot wait on them.
+    static bool WaitForDescriptors(const std::vector<int> &fds,
+      const struct timeval &timeout);
+
     //=======================================================
     // Thread and associated semaphore handling.
-    vrpn_Thread *m_thread;  //< The thread that runs the device
+    vrpn_Thread *m_thread;  //< The thread that runs the device (NULL if hub)
+    DeviceThreadHub *m_hub; //< The hub that runs the device (NULL if thread)
     vrpn_Semaphore  m_quit; //< Main object grabs this to cause thread to quit.
     static void ThreadToRun(vrpn_ThreadData &threadData);
     bool m_broken;          //< The subthread sets this true if trouble.
@@ -79,12 +296,54 @@ class DeviceThread {
     void StartThread();   //< Call at the end of the constructor
     void StopThread();    //< Call at the beginning of the destructor
 
+    /// Service the device once, on behalf of our own thread or a hub.
+    /// @return true if the device produced any reports.
+    bool ServicePass();
+
     //=======================================================
-    // Data structures and semaphores to handle reporting data back
-    // to the client.
-    // @todo Consider using unique_ptr to avoid copies to client.
-    std::vector<DeviceThreadReport> m_reports;
-    vrpn_Semaphore  m_reportSemaphore;
+    // Data structures to handle reporting data back to the client.
+    // The subthread is the only producer and the application the only
+    // consumer, so no lock is needed.  The queue's slots are allocated
+    // once and reused by the subthread for every report.
+    SPSCRingBuffer<DeviceThreadReport> m_reports;
+    std::atomic<size_t> m_droppedReports; //< Reports lost to a full queue
+    size_t m_reportsAdded;  //< Total reports added; used only by the subthread
+
+    // Used to wake an application thread blocked in WaitForReports().
+    // m_waitingFor is nonzero only while the application is waiting, so the
+    // subthread only takes the mutex when it has someone to wake.
+    std::mutex  m_waitMutex;
+    std::condition_variable m_waitCondition;
+    std::atomic<size_t> m_waitingFor; //< Report count being waited for
+    void WakeWaiter();      //< Called by the subthread
+
+    //=======================================================
+    // Wait policy and statistics.  The application writes the policy
+    // and the subthread reads it; the subthread writes the statistics
+    // and the application reads them.
+    std::atomic<DeviceThreadWaitPolicy> m_waitPolicy;
+    std::atomic<unsigned> m_spinIterations;
+    std::atomic<unsigned> m_blockMicroseconds;
+    std::atomic<bool> m_resetStatistics;
+    std::atomic<DeviceThreadTime> m_statStart;
+    std::atomic<size_t> m_statReports;
+    std::atomic<size_t> m_statWaits;
+    std::atomic<DeviceThreadTime> m_statBlocked;
+    std::atomic<DeviceThreadTime> m_statDelay;
+    std::atomic<DeviceThreadTime> m_statMaxDelay;
+    void ClearWaitStatistics();   //< Called by the subthread
+    void WaitForDevice(DeviceThreadWaitPolicy policy); //< Called by the subthread
+    void RecordWait(DeviceThreadTime blocked);  //< Called by the subthread or hub
+
+    //=======================================================
+    // Scheduling requests.  The application fills in the options and then
+    // sets m_schedulingRequested; the subthread applies them, fills in the
+    // status and clears it.
+    DeviceThreadSchedulingOptions m_schedulingOptions;
+    DeviceThreadSchedulingStatus m_schedulingStatus;
+    std::atomic<bool> m_schedulingRequested;
+    bool m_holdingDmaLatency;     //< We have a DMA latency request to release
+    void ApplyScheduling();       //< Called by the subthread
 
     //=======================================================
     // Helper functions provided by the base class for derived
@@ -92,16 +351,26 @@ class DeviceThread {
     // subclasses.
 
     /// @brief Add a new report of values.
-    /// Add a new report of values to the internally-maintained vector.
+    /// Add a new report of values to the internally-maintained queue.
+    /// If the queue is full, the report is dropped and counted.
     /// @param sampleTime The message time associated with a
     /// VRPN callback handler for the data used to construct the
-    /// value or any other estimate of when the actual measurement
-    /// was taken before any transmission delays occured.  If unknown,
-    /// don't specify a value.
-    static const struct timeval NOW;
+    /// value (converted using DeviceThreadTimeFromTimeval()) or any
+    /// other estimate of when the actual measurement was taken before
+    /// any transmission delays occured.  If unknown, don't specify a value.
+    /// @param arrivalTime When the report reached the program.  Only
+    /// devices that play back earlier reports specify this.
+    static const DeviceThreadTime NOW = 0;
     virtual void AddReport(
-      std::vector<double> values        //< Values to report
-      , struct timeval sampleTime = NOW //< When the measurement was taken, if known
+      const DeviceThreadValues &values    //< Values to report
+      , DeviceThreadTime sampleTime = NOW //< When the measurement was taken, if known
+      , DeviceThreadTime arrivalTime = NOW //< When it arrived, if not now
     );
+
+    /// @brief Tell whether AddReport() can queue another report without
+    /// dropping one.  Only call from the subthread.
+    bool ReportQueueHasRoom() const {
+      return m_reports.size() < m_reports.capacity();
+    }
 };
 
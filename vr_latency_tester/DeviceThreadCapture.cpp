@@ -0,0 +1,693 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "DeviceThreadCapture.h"
+#include <iostream>
+#include <algorithm>
+
+static const char FILE_MAGIC[] = "DTCAPT01";
+static const char END_MAGIC[] = "DTCAPEND";
+static const size_t MAGIC_SIZE = 8;
+static const size_t RECORD_HEADER_SIZE = 5;   // uint8 type, uint32 length
+static const size_t TRAILER_SIZE = 8 + MAGIC_SIZE;
+static const size_t DATA_HEADER_SIZE = 2 + 2 + 4 + 8 + 8;
+static const size_t INDEX_ENTRY_SIZE = 1 + 8 + 2 + 8 + 8;
+
+//=======================================================
+// Encoding helpers.
+
+static void PutUnsigned(std::vector<unsigned char> &out, uint64_t v, size_t bytes)
+{
+  for (size_t i = 0; i < bytes; i++) {
+    out.push_back(static_cast<unsigned char>(v >> (8 * i)));
+  }
+}
+
+static uint64_t GetUnsigned(const unsigned char *in, size_t bytes)
+{
+  uint64_t v = 0;
+  for (size_t i = 0; i < bytes; i++) {
+    v |= static_cast<uint64_t>(in[i]) << (8 * i);
+  }
+  return v;
+}
+
+static void PutVarint(std::vector<unsigned char> &out, uint64_t v)
+{
+  while (v >= 0x80) {
+    out.push_back(static_cast<unsigned char>(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<unsigned char>(v));
+}
+
+// Returns false if the varint runs past the end.
+static bool GetVarint(const unsigned char *&in, const unsigned char *end, uint64_t &v)
+{
+  v = 0;
+  for (unsigned shift = 0; (in < end) && (shift < 64); shift += 7) {
+    unsigned char b = *in++;
+    v |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) { return true; }
+  }
+  return false;
+}
+
+// Maps small negative and positive numbers to small unsigned ones.
+static uint64_t ZigZag(int64_t v)
+{
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+static int64_t UnZigZag(uint64_t v)
+{
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+// Consecutive doubles that are close to each other differ only in their
+// high-order bits; swapping the bytes puts those bits at the bottom where
+// the varint stores them in few bytes.
+static uint64_t ByteSwap(uint64_t v)
+{
+  uint64_t ret = 0;
+  for (size_t i = 0; i < 8; i++) {
+    ret = (ret << 8) | ((v >> (8 * i)) & 0xff);
+  }
+  return ret;
+}
+
+static uint64_t DoubleBits(double d)
+{
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return bits;
+}
+
+static double BitsDouble(uint64_t bits)
+{
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+static bool Seek(FILE *f, uint64_t offset)
+{
+#ifdef _WIN32
+  return _fseeki64(f, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+  return fseeko(f, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+//=======================================================
+// Writer.
+
+DeviceThreadCaptureWriter::DeviceThreadCaptureWriter()
+  : m_offset(0)
+  , m_file(NULL)
+  , m_thread(NULL)
+  , m_closing(false)
+  , m_writeFailed(false)
+{
+}
+
+DeviceThreadCaptureWriter::~DeviceThreadCaptureWriter()
+{
+  Close();
+}
+
+bool DeviceThreadCaptureWriter::Open(const std::string &fileName)
+{
+  if (m_file) {
+    std::cerr << "DeviceThreadCaptureWriter::Open(): Already open" << std::endl;
+    return false;
+  }
+  m_file = fopen(fileName.c_str(), "wb");
+  if (!m_file) {
+    std::cerr << "DeviceThreadCaptureWriter::Open(): Could not create "
+      << fileName << std::endl;
+    return false;
+  }
+  m_streams.clear();
+  m_index.clear();
+  m_offset = 0;
+  m_closing = false;
+  m_writeFailed = false;
+
+  vrpn_ThreadData td;
+  td.pvUD = this;
+  m_thread = new vrpn_Thread(ThreadToRun, td);
+  m_thread->go();
+
+  std::vector<unsigned char> magic(FILE_MAGIC, FILE_MAGIC + MAGIC_SIZE);
+  QueueBytes(magic);
+  return true;
+}
+
+bool DeviceThreadCaptureWriter::Close()
+{
+  if (!m_file) { return false; }
+
+  // Write the partial blocks, then the index and the trailer that
+  // points at it.
+  for (size_t i = 0; i < m_streams.size(); i++) {
+    FinishBlock(static_cast<int>(i));
+  }
+  uint64_t indexOffset = m_offset;
+  m_payload.clear();
+  PutUnsigned(m_payload, m_index.size(), 4);
+  for (size_t i = 0; i < m_index.size(); i++) {
+    const DeviceThreadCaptureIndexEntry &e = m_index[i];
+    PutUnsigned(m_payload, e.type, 1);
+    PutUnsigned(m_payload, e.offset, 8);
+    PutUnsigned(m_payload, e.stream, 2);
+    PutUnsigned(m_payload, static_cast<uint64_t>(e.first), 8);
+    PutUnsigned(m_payload, static_cast<uint64_t>(e.last), 8);
+  }
+  std::vector<unsigned char> index;
+  PutUnsigned(index, 'I', 1);
+  PutUnsigned(index, m_payload.size(), 4);
+  index.insert(index.end(), m_payload.begin(), m_payload.end());
+  PutUnsigned(index, indexOffset, 8);
+  index.insert(index.end(), END_MAGIC, END_MAGIC + MAGIC_SIZE);
+  QueueBytes(index);
+
+  // Tell the writer thread to finish up and wait for it.
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    m_closing = true;
+  }
+  m_queueCondition.notify_one();
+  while (m_thread->running()) {
+    vrpn_SleepMsecs(1);
+  }
+  delete m_thread;
+  m_thread = NULL;
+
+  if (fclose(m_file) != 0) {
+    m_writeFailed = true;
+  }
+  m_file = NULL;
+  if (m_writeFailed) {
+    std::cerr << "DeviceThreadCaptureWriter::Close(): Write failed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int DeviceThreadCaptureWriter::AddStream(const std::string &name)
+{
+  if (!m_file || (m_streams.size() > 0xffff)) {
+    return -1;
+  }
+  uint16_t id = static_cast<uint16_t>(m_streams.size());
+  Stream s;
+  s.channels = 0;
+  m_streams.push_back(s);
+
+  m_payload.clear();
+  PutUnsigned(m_payload, id, 2);
+  m_payload.insert(m_payload.end(), name.begin(), name.end());
+  QueueRecord('S', m_payload, id, 0, 0);
+  return id;
+}
+
+void DeviceThreadCaptureWriter::Record(int stream, const DeviceThreadReport &report)
+{
+  if (!m_file || (stream < 0) || (stream >= static_cast<int>(m_streams.size()))) {
+    return;
+  }
+  Stream &s = m_streams[stream];
+
+  // Each block has a fixed number of channels.
+  if ((s.sampleTimes.size() > 0) && (report.values.size() != s.channels)) {
+    FinishBlock(stream);
+  }
+  s.channels = report.values.size();
+  s.sampleTimes.push_back(report.sampleTime);
+  s.arrivalTimes.push_back(report.arrivalTime);
+  s.values.insert(s.values.end(), report.values.begin(), report.values.end());
+  if (s.sampleTimes.size() >= BLOCK_REPORTS) {
+    FinishBlock(stream);
+  }
+}
+
+void DeviceThreadCaptureWriter::Record(int stream,
+  const std::vector<DeviceThreadReport> &reports)
+{
+  for (size_t i = 0; i < reports.size(); i++) {
+    Record(stream, reports[i]);
+  }
+}
+
+void DeviceThreadCaptureWriter::RecordMarker(const std::string &text,
+  DeviceThreadTime time)
+{
+  if (!m_file) { return; }
+  m_payload.clear();
+  PutUnsigned(m_payload, static_cast<uint64_t>(time), 8);
+  m_payload.insert(m_payload.end(), text.begin(), text.end());
+  QueueRecord('M', m_payload, 0, time, time);
+}
+
+void DeviceThreadCaptureWriter::FinishBlock(int stream)
+{
+  Stream &s = m_streams[stream];
+  size_t count = s.sampleTimes.size();
+  if (count == 0) { return; }
+  DeviceThreadTime first = *std::min_element(s.sampleTimes.begin(), s.sampleTimes.end());
+  DeviceThreadTime last = *std::max_element(s.sampleTimes.begin(), s.sampleTimes.end());
+
+  m_payload.clear();
+  PutUnsigned(m_payload, stream, 2);
+  PutUnsigned(m_payload, s.channels, 2);
+  PutUnsigned(m_payload, count, 4);
+  PutUnsigned(m_payload, static_cast<uint64_t>(first), 8);
+  PutUnsigned(m_payload, static_cast<uint64_t>(last), 8);
+  DeviceThreadTime prev = first;
+  for (size_t i = 0; i < count; i++) {
+    PutVarint(m_payload, ZigZag(s.sampleTimes[i] - prev));
+    prev = s.sampleTimes[i];
+  }
+  for (size_t i = 0; i < count; i++) {
+    PutVarint(m_payload, ZigZag(s.arrivalTimes[i] - s.sampleTimes[i]));
+  }
+  for (size_t c = 0; c < s.channels; c++) {
+    uint64_t prevBits = 0;
+    for (size_t i = 0; i < count; i++) {
+      uint64_t bits = DoubleBits(s.values[i * s.channels + c]);
+      PutVarint(m_payload, ByteSwap(bits ^ prevBits));
+      prevBits = bits;
+    }
+  }
+  QueueRecord('D', m_payload, static_cast<uint16_t>(stream), first, last);
+
+  s.sampleTimes.clear();
+  s.arrivalTimes.clear();
+  s.values.clear();
+}
+
+void DeviceThreadCaptureWriter::QueueRecord(unsigned char type,
+  const std::vector<unsigned char> &payload, uint16_t stream,
+  DeviceThreadTime first, DeviceThreadTime last)
+{
+  DeviceThreadCaptureIndexEntry e;
+  e.type = type;
+  e.offset = m_offset;
+  e.stream = stream;
+  e.first = first;
+  e.last = last;
+  m_index.push_back(e);
+
+  m_record.clear();
+  PutUnsigned(m_record, type, 1);
+  PutUnsigned(m_record, payload.size(), 4);
+  m_record.insert(m_record.end(), payload.begin(), payload.end());
+  QueueBytes(m_record);
+}
+
+void DeviceThreadCaptureWriter::QueueBytes(const std::vector<unsigned char> &bytes)
+{
+  std::vector<unsigned char> buffer;
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    if (!m_spare.empty()) {
+      buffer.swap(m_spare.back());
+      m_spare.pop_back();
+    }
+  }
+  buffer.assign(bytes.begin(), bytes.end());
+  m_offset += buffer.size();
+  {
+    std::lock_guard<std::mutex> lock(m_queueMutex);
+    m_queue.push_back(std::vector<unsigned char>());
+    m_queue.back().swap(buffer);
+  }
+  m_queueCondition.notify_one();
+}
+
+void DeviceThreadCaptureWriter::ThreadToRun(vrpn_ThreadData &threadData)
+{
+  DeviceThreadCaptureWriter *me =
+    static_cast<DeviceThreadCaptureWriter *>(threadData.pvUD);
+
+  // Write buffers as they arrive until we're told to close and have
+  // written everything.
+  std::vector<unsigned char> buffer;
+  std::unique_lock<std::mutex> lock(me->m_queueMutex);
+  while (true) {
+    me->m_queueCondition.wait(lock,
+      [me] { return me->m_closing || !me->m_queue.empty(); });
+    if (me->m_queue.empty()) { break; }
+    buffer.swap(me->m_queue.front());
+    me->m_queue.pop_front();
+    lock.unlock();
+
+    if (!me->m_writeFailed && (buffer.size() > 0) &&
+        (fwrite(&buffer[0], 1, buffer.size(), me->m_file) != buffer.size())) {
+      me->m_writeFailed = true;
+    }
+
+    lock.lock();
+    me->m_spare.push_back(std::vector<unsigned char>());
+    me->m_spare.back().swap(buffer);
+  }
+}
+
+//=======================================================
+// Reader.
+
+DeviceThreadCaptureReader::DeviceThreadCaptureReader()
+  : m_file(NULL)
+{
+}
+
+DeviceThreadCaptureReader::~DeviceThreadCaptureReader()
+{
+  Close();
+}
+
+void DeviceThreadCaptureReader::Close()
+{
+  if (m_file) {
+    fclose(m_file);
+    m_file = NULL;
+  }
+  m_index.clear();
+  m_streamNames.clear();
+  m_markers.clear();
+}
+
+bool DeviceThreadCaptureReader::IsCaptureFile(const std::string &fileName)
+{
+  FILE *f = fopen(fileName.c_str(), "rb");
+  if (f == NULL) {
+    return false;
+  }
+  char magic[MAGIC_SIZE];
+  bool ret = (fread(magic, 1, MAGIC_SIZE, f) == MAGIC_SIZE) &&
+    (memcmp(magic, FILE_MAGIC, MAGIC_SIZE) == 0);
+  fclose(f);
+  return ret;
+}
+
+bool DeviceThreadCaptureReader::Open(const std::string &fileName)
+{
+  Close();
+  m_file = fopen(fileName.c_str(), "rb");
+  if (!m_file) {
+    std::cerr << "DeviceThreadCaptureReader::Open(): Could not open "
+      << fileName << std::endl;
+    return false;
+  }
+  char magic[MAGIC_SIZE];
+  if ((fread(magic, 1, MAGIC_SIZE, m_file) != MAGIC_SIZE) ||
+      (memcmp(magic, FILE_MAGIC, MAGIC_SIZE) != 0)) {
+    std::cerr << "DeviceThreadCaptureReader::Open(): " << fileName
+      << " is not a capture file" << std::endl;
+    Close();
+    return false;
+  }
+
+  // Use the index if the file was closed properly; otherwise find the
+  // complete records ourselves.
+  if (!ReadIndex()) {
+    std::cerr << "DeviceThreadCaptureReader::Open(): " << fileName
+      << " has no index (not closed?), scanning it" << std::endl;
+    if (!ScanRecords()) {
+      Close();
+      return false;
+    }
+  }
+  if (!ReadNamesAndMarkers()) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+bool DeviceThreadCaptureReader::ReadIndex()
+{
+  unsigned char trailer[TRAILER_SIZE];
+#ifdef _WIN32
+  if (_fseeki64(m_file, -static_cast<__int64>(TRAILER_SIZE), SEEK_END) != 0) { return false; }
+#else
+  if (fseeko(m_file, -static_cast<off_t>(TRAILER_SIZE), SEEK_END) != 0) { return false; }
+#endif
+  if ((fread(trailer, 1, TRAILER_SIZE, m_file) != TRAILER_SIZE) ||
+      (memcmp(trailer + 8, END_MAGIC, MAGIC_SIZE) != 0)) {
+    return false;
+  }
+
+  unsigned char type;
+  std::vector<unsigned char> payload;
+  if (!ReadRecord(GetUnsigned(trailer, 8), type, payload) || (type != 'I') ||
+      (payload.size() < 4)) {
+    return false;
+  }
+  size_t count = static_cast<size_t>(GetUnsigned(&payload[0], 4));
+  if (payload.size() != 4 + count * INDEX_ENTRY_SIZE) {
+    return false;
+  }
+  m_index.clear();
+  const unsigned char *p = &payload[4];
+  for (size_t i = 0; i < count; i++, p += INDEX_ENTRY_SIZE) {
+    DeviceThreadCaptureIndexEntry e;
+    e.type = p[0];
+    e.offset = GetUnsigned(p + 1, 8);
+    e.stream = static_cast<uint16_t>(GetUnsigned(p + 9, 2));
+    e.first = static_cast<DeviceThreadTime>(GetUnsigned(p + 11, 8));
+    e.last = static_cast<DeviceThreadTime>(GetUnsigned(p + 19, 8));
+    m_index.push_back(e);
+  }
+  return true;
+}
+
+bool DeviceThreadCaptureReader::ScanRecords()
+{
+  // Walk the record headers, reading only what the index needs.  A
+  // record cut short by the end of the file is ignored.
+  m_index.clear();
+  uint64_t offset = MAGIC_SIZE;
+  unsigned char header[RECORD_HEADER_SIZE + DATA_HEADER_SIZE];
+  while (Seek(m_file, offset) &&
+         (fread(header, 1, RECORD_HEADER_SIZE, m_file) == RECORD_HEADER_SIZE)) {
+    DeviceThreadCaptureIndexEntry e;
+    e.type = header[0];
+    e.offset = offset;
+    e.stream = 0;
+    e.first = e.last = 0;
+    uint64_t length = GetUnsigned(header + 1, 4);
+    uint64_t next = offset + RECORD_HEADER_SIZE + length;
+    if ((e.type == 'I') || !Seek(m_file, next - 1) || (fgetc(m_file) == EOF)) {
+      break;
+    }
+    if (e.type == 'D') {
+      if ((length < DATA_HEADER_SIZE) || !Seek(m_file, offset + RECORD_HEADER_SIZE) ||
+          (fread(header + RECORD_HEADER_SIZE, 1, DATA_HEADER_SIZE, m_file) != DATA_HEADER_SIZE)) {
+        break;
+      }
+      const unsigned char *d = header + RECORD_HEADER_SIZE;
+      e.stream = static_cast<uint16_t>(GetUnsigned(d, 2));
+      e.first = static_cast<DeviceThreadTime>(GetUnsigned(d + 8, 8));
+      e.last = static_cast<DeviceThreadTime>(GetUnsigned(d + 16, 8));
+    }
+    m_index.push_back(e);
+    offset = next;
+  }
+  return true;
+}
+
+bool DeviceThreadCaptureReader::ReadRecord(uint64_t offset,
+  unsigned char &type, std::vector<unsigned char> &payload)
+{
+  unsigned char header[RECORD_HEADER_SIZE];
+  if (!Seek(m_file, offset) ||
+      (fread(header, 1, RECORD_HEADER_SIZE, m_file) != RECORD_HEADER_SIZE)) {
+    return false;
+  }
+  type = header[0];
+
+  // Make sure the whole payload is in the file before allocating room
+  // for it, so a corrupt length can't ask for gigabytes.
+  uint64_t length = GetUnsigned(header + 1, 4);
+  uint64_t start = offset + RECORD_HEADER_SIZE;
+  if ((length > 0) && (!Seek(m_file, start + length - 1) ||
+      (fgetc(m_file) == EOF) || !Seek(m_file, start))) {
+    return false;
+  }
+  payload.resize(static_cast<size_t>(length));
+  return payload.empty() ||
+    (fread(&payload[0], 1, payload.size(), m_file) == payload.size());
+}
+
+bool DeviceThreadCaptureReader::ReadNamesAndMarkers()
+{
+  unsigned char type;
+  std::vector<unsigned char> payload;
+  for (size_t i = 0; i < m_index.size(); i++) {
+    const DeviceThreadCaptureIndexEntry &e = m_index[i];
+    if ((e.type != 'S') && (e.type != 'M')) { continue; }
+    if (!ReadRecord(e.offset, type, payload) || (type != e.type) ||
+        (payload.size() < (type == 'S' ? 2u : 8u))) {
+      std::cerr << "DeviceThreadCaptureReader: Bad record at offset "
+        << e.offset << std::endl;
+      return false;
+    }
+    if (type == 'S') {
+      size_t id = static_cast<size_t>(GetUnsigned(&payload[0], 2));
+      if (m_streamNames.size() <= id) {
+        m_streamNames.resize(id + 1);
+      }
+      m_streamNames[id].assign(payload.begin() + 2, payload.end());
+    } else {
+      DeviceThreadCaptureMarker m;
+      m.time = static_cast<DeviceThreadTime>(GetUnsigned(&payload[0], 8));
+      m.text.assign(payload.begin() + 8, payload.end());
+      m_markers.push_back(m);
+    }
+  }
+  return true;
+}
+
+int DeviceThreadCaptureReader::FindStream(const std::string &name) const
+{
+  for (size_t i = 0; i < m_streamNames.size(); i++) {
+    if (m_streamNames[i] == name) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+bool DeviceThreadCaptureReader::TimeRange(DeviceThreadTime &first,
+  DeviceThreadTime &last) const
+{
+  bool found = false;
+  for (size_t i = 0; i < m_index.size(); i++) {
+    const DeviceThreadCaptureIndexEntry &e = m_index[i];
+    if (e.type != 'D') { continue; }
+    if (!found || (e.first < first)) { first = e.first; }
+    if (!found || (e.last > last)) { last = e.last; }
+    found = true;
+  }
+  return found;
+}
+
+bool DeviceThreadCaptureReader::ReadBlock(const DeviceThreadCaptureIndexEntry &e,
+  std::vector<DeviceThreadReport> &block)
+{
+  unsigned char type;
+  if (!ReadRecord(e.offset, type, m_payload) || (type != 'D') ||
+      (m_payload.size() < DATA_HEADER_SIZE)) {
+    std::cerr << "DeviceThreadCaptureReader: Bad block at offset "
+      << e.offset << std::endl;
+    return false;
+  }
+
+  // Decode the block column by column.
+  size_t channels = static_cast<size_t>(GetUnsigned(&m_payload[2], 2));
+  size_t count = static_cast<size_t>(GetUnsigned(&m_payload[4], 4));
+  DeviceThreadTime prev = static_cast<DeviceThreadTime>(GetUnsigned(&m_payload[8], 8));
+  if (channels > DeviceThreadValues::MAX_VALUES) {
+    std::cerr << "DeviceThreadCaptureReader: Too many channels ("
+      << channels << ") at offset " << e.offset << std::endl;
+    return false;
+  }
+  const unsigned char *p = &m_payload[0] + DATA_HEADER_SIZE;
+  const unsigned char *pEnd = &m_payload[0] + m_payload.size();
+
+  // Each report takes at least one byte for each of its two times, so a
+  // count the payload can't hold means the block is corrupt; check before
+  // we make room for that many reports.
+  if (count > static_cast<size_t>(pEnd - p) / 2) {
+    std::cerr << "DeviceThreadCaptureReader: Bad report count ("
+      << count << ") at offset " << e.offset << std::endl;
+    return false;
+  }
+  block.resize(count);
+  bool ok = true;
+  uint64_t v;
+  for (size_t r = 0; ok && (r < count); r++) {
+    ok = GetVarint(p, pEnd, v);
+    prev += UnZigZag(v);
+    block[r].sampleTime = prev;
+    block[r].values.clear();
+  }
+  for (size_t r = 0; ok && (r < count); r++) {
+    ok = GetVarint(p, pEnd, v);
+    block[r].arrivalTime = block[r].sampleTime + UnZigZag(v);
+  }
+  for (size_t c = 0; ok && (c < channels); c++) {
+    uint64_t bits = 0;
+    for (size_t r = 0; ok && (r < count); r++) {
+      ok = GetVarint(p, pEnd, v);
+      bits ^= ByteSwap(v);
+      block[r].values.push_back(BitsDouble(bits));
+    }
+  }
+  if (!ok) {
+    std::cerr << "DeviceThreadCaptureReader: Truncated block at offset "
+      << e.offset << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool DeviceThreadCaptureReader::ReadStream(int stream,
+  std::vector<DeviceThreadReport> &reports,
+  DeviceThreadTime start, DeviceThreadTime end)
+{
+  reports.clear();
+  if (!m_file || (stream < 0) || (stream >= static_cast<int>(m_streamNames.size()))) {
+    std::cerr << "DeviceThreadCaptureReader::ReadStream(): Bad stream "
+      << stream << std::endl;
+    return false;
+  }
+
+  std::vector<DeviceThreadReport> block;
+  for (size_t i = 0; i < m_index.size(); i++) {
+    const DeviceThreadCaptureIndexEntry &e = m_index[i];
+    if ((e.type != 'D') || (e.stream != stream) ||
+        (e.last < start) || (e.first > end)) {
+      continue;
+    }
+    if (!ReadBlock(e, block)) {
+      return false;
+    }
+    for (size_t r = 0; r < block.size(); r++) {
+      if ((block[r].sampleTime >= start) && (block[r].sampleTime <= end)) {
+        reports.push_back(block[r]);
+      }
+    }
+  }
+  return true;
+}
+
+bool DeviceThreadCaptureReader::ReadNextBlock(int stream, size_t &position,
+  std::vector<DeviceThreadReport> &reports)
+{
+  reports.clear();
+  if (!m_file) { return false; }
+  for (; position < m_index.size(); position++) {
+    const DeviceThreadCaptureIndexEntry &e = m_index[position];
+    if ((e.type == 'D') && (e.stream == stream)) {
+      position++;
+      return ReadBlock(e, reports);
+    }
+  }
+  return false;
+}
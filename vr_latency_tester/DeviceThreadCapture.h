@@ -0,0 +1,218 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <DeviceThread.h>
+#include <stdio.h>
+#include <limits>
+#include <deque>
+
+/// Compact binary capture of DeviceThread report streams, so that a
+/// session can be analyzed again later.
+///   The file holds one or more named streams (one per device), along with
+/// time-stamped text markers the application can use to note the phases
+/// of a test and its settings.  Reports are stored in blocks of up to
+/// BLOCK_REPORTS reports from one stream, each with a fixed number of
+/// channels, and laid out by column: the sample times as deltas from the
+/// previous one, the arrival times as offsets from the sample times, and
+/// then each channel in turn with each value stored as the bits that
+/// changed from the previous value in that channel.  All of these are
+/// written as variable-length integers, so slowly-changing values such as
+/// Arduino readings take two or three bytes and unchanged ones take one.
+///   A time index at the end of the file lets a reader go straight to the
+/// blocks covering a time range.  If the program did not close the file
+/// (it crashed), the reader rebuilds the index by scanning the file and
+/// recovers every complete block.
+///
+/// File layout; all integers are little-endian:
+///   "DTCAPT01"
+///   records, each a uint8 type, a uint32 payload length and the payload:
+///     'S' stream:  uint16 stream, name
+///     'M' marker:  int64 time, text
+///     'D' data:    uint16 stream, uint16 channels, uint32 count,
+///                  int64 earliest sample time, int64 latest sample time,
+///                  count zigzag varints of sample time minus previous
+///                  (starting from the earliest), count zigzag varints of
+///                  arrival time minus sample time, then for each channel
+///                  count varints of the byte-swapped XOR of each value's
+///                  bits with the previous value's (starting from 0)
+///     'I' index:   uint32 entries, each uint8 type, uint64 file offset,
+///                  uint16 stream, int64 earliest and latest times
+///   uint64 offset of the 'I' record, "DTCAPEND"
+
+/// A time-stamped text note stored in a capture file.
+typedef struct {
+  DeviceThreadTime  time; //< When the marker was recorded
+  std::string       text; //< What it says
+} DeviceThreadCaptureMarker;
+
+/// One entry in a capture file's time index, describing one record.
+typedef struct {
+  unsigned char     type;   //< Record type
+  uint64_t          offset; //< File offset of the record
+  uint16_t          stream; //< Stream, for 'S' and 'D' records
+  DeviceThreadTime  first;  //< Earliest time in the record
+  DeviceThreadTime  last;   //< Latest time in the record
+} DeviceThreadCaptureIndexEntry;
+
+/// Writes a capture file.  Only the application thread that reads the
+/// reports from the devices writes to it; it encodes the reports and hands
+/// finished blocks to a writer thread of its own, so neither it nor the
+/// device threads ever wait for the disk.
+class DeviceThreadCaptureWriter {
+  public:
+    /// Most reports stored in one block.
+    static const size_t BLOCK_REPORTS = 1024;
+
+    DeviceThreadCaptureWriter();
+
+    /// Closes the file if it is open.
+    ~DeviceThreadCaptureWriter();
+
+    /// @brief Create the file and start the writer thread.
+    /// @return true on success, false if the file could not be created.
+    bool Open(const std::string &fileName);
+
+    /// @brief Write everything recorded so far, add the time index and
+    /// close the file.
+    /// @return true if everything was written, false on a write error.
+    bool Close();
+
+    bool IsOpen() const { return m_file != NULL; }
+
+    /// @brief Declare a stream of reports, usually one per device.
+    /// @return Stream number to pass to Record(), or -1 on failure.
+    int AddStream(const std::string &name);
+
+    /// @brief Append reports to a stream.  Call with each batch returned
+    /// by DeviceThread::GetReports() or WaitForReports().
+    void Record(int stream, const std::vector<DeviceThreadReport> &reports);
+
+    /// @brief Append a single report to a stream.
+    void Record(int stream, const DeviceThreadReport &report);
+
+    /// @brief Add a text marker, for example to note a test phase or the
+    /// channels being compared.
+    void RecordMarker(const std::string &text,
+      DeviceThreadTime time = DeviceThreadNow());
+
+  protected:
+    // Not copyable.
+    DeviceThreadCaptureWriter(const DeviceThreadCaptureWriter &);
+    DeviceThreadCaptureWriter &operator = (const DeviceThreadCaptureWriter &);
+
+    // Reports waiting to be encoded into a block, by column.
+    typedef struct {
+      size_t channels;
+      std::vector<DeviceThreadTime> sampleTimes;
+      std::vector<DeviceThreadTime> arrivalTimes;
+      std::vector<double> values;   //< channels values per report
+    } Stream;
+    std::vector<Stream> m_streams;
+
+    // Where each record went, written as the time index when closing.
+    std::vector<DeviceThreadCaptureIndexEntry> m_index;
+    uint64_t m_offset;              //< File offset of the next record
+
+    void FinishBlock(int stream);
+    void QueueRecord(unsigned char type, const std::vector<unsigned char> &payload,
+      uint16_t stream, DeviceThreadTime first, DeviceThreadTime last);
+    void QueueBytes(const std::vector<unsigned char> &bytes);
+    std::vector<unsigned char> m_payload; //< Reused while encoding
+    std::vector<unsigned char> m_record;  //< Reused while encoding
+
+    //=======================================================
+    // Writer thread and the buffers being handed to it.  Written
+    // buffers are kept for reuse so that steady-state recording
+    // does not allocate.
+    FILE *m_file;
+    vrpn_Thread *m_thread;
+    static void ThreadToRun(vrpn_ThreadData &threadData);
+    std::mutex m_queueMutex;
+    std::condition_variable m_queueCondition;
+    std::deque<std::vector<unsigned char> > m_queue;
+    std::vector<std::vector<unsigned char> > m_spare;
+    bool m_closing;                 //< Protected by m_queueMutex
+    std::atomic<bool> m_writeFailed;
+};
+
+/// Reads a capture file written by DeviceThreadCaptureWriter.
+class DeviceThreadCaptureReader {
+  public:
+    DeviceThreadCaptureReader();
+    ~DeviceThreadCaptureReader();
+
+    /// @brief Open the file and read its stream names, markers and time
+    /// index.
+    /// @return true on success, false if it is not a readable capture file.
+    bool Open(const std::string &fileName);
+    void Close();
+
+    /// @brief Tell whether a file starts out like a capture file, without
+    /// reading the rest of it or complaining if it does not.
+    static bool IsCaptureFile(const std::string &fileName);
+
+    /// @brief Names of the streams, indexed by stream number.
+    const std::vector<std::string> &StreamNames() const { return m_streamNames; }
+
+    /// @brief Find a stream by name.
+    /// @return Stream number, or -1 if there is no such stream.
+    int FindStream(const std::string &name) const;
+
+    /// @brief All markers in the file, in the order they were recorded.
+    const std::vector<DeviceThreadCaptureMarker> &Markers() const { return m_markers; }
+
+    /// @brief Earliest and latest sample times of all reports in the file.
+    /// @return false if there are no reports.
+    bool TimeRange(DeviceThreadTime &first, DeviceThreadTime &last) const;
+
+    /// @brief Read the reports from one stream, in the order they were
+    /// recorded, optionally limited to those sampled in a time range.  Only
+    /// the blocks that overlap the range are read.
+    /// @return true on success, false on a bad stream number or read error.
+    bool ReadStream(int stream, std::vector<DeviceThreadReport> &reports,
+      DeviceThreadTime start = std::numeric_limits<DeviceThreadTime>::min(),
+      DeviceThreadTime end = std::numeric_limits<DeviceThreadTime>::max());
+
+    /// @brief Read the next block of reports from one stream, for going
+    /// through a long stream without holding all of it in memory.
+    /// @param position [in,out] Where to continue from; start with 0.
+    /// @param reports [out] The reports from the block, in recorded order.
+    /// @return true if a block was read, false at the end of the stream
+    ///   or on a read error.
+    bool ReadNextBlock(int stream, size_t &position,
+      std::vector<DeviceThreadReport> &reports);
+
+  protected:
+    // Not copyable.
+    DeviceThreadCaptureReader(const DeviceThreadCaptureReader &);
+    DeviceThreadCaptureReader &operator = (const DeviceThreadCaptureReader &);
+
+    std::vector<DeviceThreadCaptureIndexEntry> m_index;
+
+    FILE *m_file;
+    std::vector<std::string> m_streamNames;
+    std::vector<DeviceThreadCaptureMarker> m_markers;
+
+    bool ReadIndex();
+    bool ScanRecords();
+    bool ReadRecord(uint64_t offset, unsigned char &type,
+      std::vector<unsigned char> &payload);
+    bool ReadNamesAndMarkers();
+    bool ReadBlock(const DeviceThreadCaptureIndexEntry &entry,
+      std::vector<DeviceThreadReport> &block);
+    std::vector<unsigned char> m_payload; //< Reused while decoding
+};
@@ -0,0 +1,183 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "DeviceThreadHub.h"
+#include <algorithm>
+#include <sstream>
+
+DeviceThreadHub::DeviceThreadHub()
+  : m_waitPolicy(DEVICE_THREAD_WAIT_SPIN)
+  , m_spinIterations(DeviceThread::DEFAULT_SPIN_ITERATIONS)
+  , m_blockMicroseconds(DeviceThread::DEFAULT_BLOCK_MICROSECONDS)
+  , m_nextDeviceName(0)
+{
+  m_connection = vrpn_create_server_connection("loopback:");
+
+  vrpn_ThreadData td;
+  td.pvUD = this;
+  m_thread = new vrpn_Thread(ThreadToRun, td);
+  m_thread->go();
+  while (!m_thread->running()) {};
+}
+
+DeviceThreadHub::~DeviceThreadHub()
+{
+  // Tell our thread it is time to stop running by grabbing its
+  // semaphore.  Wait until it has stopped and then delete it.
+  m_quit.p();
+  while (m_thread->running()) {
+    vrpn_SleepMsecs(1);
+  }
+  delete m_thread;
+  if (m_connection) {
+    m_connection->removeReference();
+  }
+}
+
+void DeviceThreadHub::SetWaitPolicy(DeviceThreadWaitPolicy policy
+  , unsigned spinIterations, unsigned blockMicroseconds)
+{
+  m_spinIterations = spinIterations;
+  m_blockMicroseconds = blockMicroseconds;
+  m_waitPolicy = policy;
+}
+
+size_t DeviceThreadHub::DeviceCount()
+{
+  m_devicesSemaphore.p();
+  size_t ret = m_devices.size();
+  m_devicesSemaphore.v();
+  return ret;
+}
+
+std::string DeviceThreadHub::NewDeviceName()
+{
+  std::ostringstream name;
+  name << "DeviceThread" << m_nextDeviceName++;
+  return name.str();
+}
+
+void DeviceThreadHub::AddDevice(DeviceThread *device)
+{
+  m_devicesSemaphore.p();
+  m_devices.push_back(device);
+  m_devicesSemaphore.v();
+}
+
+void DeviceThreadHub::RemoveDevice(DeviceThread *device)
+{
+  m_devicesSemaphore.p();
+  m_devices.erase(std::remove(m_devices.begin(), m_devices.end(), device),
+    m_devices.end());
+  m_devicesSemaphore.v();
+}
+
+void DeviceThreadHub::ThreadToRun(vrpn_ThreadData &threadData)
+{
+  DeviceThreadHub *me = static_cast<DeviceThreadHub *>(threadData.pvUD);
+
+  // Continue running until our parent yanks our semaphore to get us to quit.
+  // Each pass services every device that is not broken; we only wait when
+  // a run of passes has produced no reports from any of them.
+  unsigned idlePasses = 0;
+  while (me->m_quit.condP() == 1) {
+    me->m_quit.v(); // Restore the semaphore for the next time around.
+
+    bool gotReports = false;
+    me->m_devicesSemaphore.p();
+    for (size_t i = 0; i < me->m_devices.size(); i++) {
+      if (!me->m_devices[i]->IsBroken()) {
+        gotReports |= me->m_devices[i]->ServicePass();
+      }
+    }
+    if (me->m_connection) { me->m_connection->mainloop(); }
+    bool haveDevices = !me->m_devices.empty();
+    me->m_devicesSemaphore.v();
+
+    // With nothing to service, there is no reason to use the CPU.
+    if (!haveDevices) {
+      vrpn_SleepMsecs(1);
+      continue;
+    }
+
+    DeviceThreadWaitPolicy policy = me->m_waitPolicy;
+    if (policy == DEVICE_THREAD_WAIT_SPIN) {
+      continue;
+    }
+    if (gotReports) {
+      idlePasses = 0;
+      continue;
+    }
+    if (++idlePasses < me->m_spinIterations) {
+      continue;
+    }
+    idlePasses = 0;
+    me->WaitForDevices(policy);
+  }
+}
+
+void DeviceThreadHub::WaitForDevices(DeviceThreadWaitPolicy policy)
+{
+  unsigned usec = m_blockMicroseconds;
+  DeviceThreadTime before = DeviceThreadNow();
+
+  // Wait on the descriptors of all of the devices at once.  If some device
+  // cannot be waited on that way, blocking on the others would delay it,
+  // so we only wait for an event when it is our only device.  We let go of
+  // the semaphore before waiting on the descriptors so that devices can be
+  // removed meanwhile; a descriptor closed underneath select() only ends
+  // the wait early.  A device waiting its own way needs to stay around, so
+  // we hold the semaphore for that.
+  bool waited = false;
+  if (policy == DEVICE_THREAD_WAIT_EVENT) {
+    struct timeval timeout;
+    timeout.tv_sec = usec / 1000000;
+    timeout.tv_usec = usec % 1000000;
+    m_devicesSemaphore.p();
+    m_eventDescriptors.clear();
+    bool allHaveDescriptors = true;
+    DeviceThread *onlyDevice = NULL;
+    size_t active = 0;
+    for (size_t i = 0; i < m_devices.size(); i++) {
+      if (m_devices[i]->IsBroken()) { continue; }
+      active++;
+      onlyDevice = m_devices[i];
+      if (!m_devices[i]->GetDeviceEventDescriptors(m_eventDescriptors)) {
+        allHaveDescriptors = false;
+      }
+    }
+    if ((active > 0) && allHaveDescriptors) {
+      m_devicesSemaphore.v();
+      waited = DeviceThread::WaitForDescriptors(m_eventDescriptors, timeout);
+    } else {
+      if (active == 1) {
+        waited = onlyDevice->WaitForDeviceEvent(timeout);
+      }
+      m_devicesSemaphore.v();
+    }
+  }
+  if (!waited) {
+    vrpn_SleepMsecs(usec * 1e-3);
+  }
+
+  // Each device was held up by the wait, so each counts it.
+  DeviceThreadTime blocked = DeviceThreadNow() - before;
+  m_devicesSemaphore.p();
+  for (size_t i = 0; i < m_devices.size(); i++) {
+    m_devices[i]->RecordWait(blocked);
+  }
+  m_devicesSemaphore.v();
+}
@@ -0,0 +1,120 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <DeviceThread.h>
+#include <vrpn_Connection.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/// Runs many DeviceThread devices from a single thread, rather than one
+/// thread (and one spinning core) per device.  Pass a hub to the device
+/// constructors; the device registers itself when it starts and removes
+/// itself when it is destroyed.  Each device keeps its own report queue,
+/// so the application calls GetReports() and WaitForReports() on the
+/// devices exactly as it would otherwise.
+///   Devices that run a server made by a factory share one loopback
+/// connection owned by the hub, which services it once per pass.  Devices
+/// built from a config file keep a connection of their own, because the
+/// file picks the device names and two files could pick the same one.
+/// VRPN remotes that connect to the same external server already share
+/// one vrpn_Connection (VRPN looks connections up by name).
+///   The hub has the same wait policies as a DeviceThread.  With the
+/// event policy it gathers the descriptors of all its devices (see
+/// DeviceThread::GetDeviceEventDescriptors()) and waits on all of them in
+/// one select().  VRPN does not expose the sockets under a connection to
+/// an external server, so when any device cannot give descriptors the hub
+/// sleeps instead, unless that is its only device, which then waits in
+/// its own WaitForDeviceEvent().  The time spent waiting is added to the
+/// wait statistics of every device on the hub.
+///   All devices must be destroyed before the hub.
+
+class DeviceThreadHub {
+  public:
+    /// Construct the hub and start its thread.
+    DeviceThreadHub();
+
+    /// Stop the thread.  All devices must have been destroyed already.
+    ~DeviceThreadHub();
+
+    /// @brief Select how the hub waits when none of its devices has data.
+    /// See DeviceThread::SetWaitPolicy().
+    void SetWaitPolicy(DeviceThreadWaitPolicy policy
+      , unsigned spinIterations = DeviceThread::DEFAULT_SPIN_ITERATIONS
+      , unsigned blockMicroseconds = DeviceThread::DEFAULT_BLOCK_MICROSECONDS);
+
+    /// @brief Tell how many devices the hub is servicing.
+    size_t DeviceCount();
+
+    /// @brief Loopback server connection shared by the devices on this hub.
+    /// A device that uses it should addReference() it, and it must not
+    /// call mainloop() on it; the hub does that once per pass.  The hub's
+    /// thread uses the connection while it services the devices, so
+    /// objects must only be created on it or destroyed between
+    /// LockConnection() and UnlockConnection().
+    vrpn_Connection *SharedConnection() { return m_connection; }
+
+    /// @brief Keep the hub's thread from using the shared connection or
+    /// servicing any device until UnlockConnection() is called.  Devices
+    /// also hold this while they make or destroy remotes of an external
+    /// server, whose connection another device on the hub may be using.
+    /// Do not start or stop a device on this hub while holding the lock.
+    void LockConnection() { m_devicesSemaphore.p(); }
+    void UnlockConnection() { m_devicesSemaphore.v(); }
+
+    /// @brief Make a device name that is not yet in use on the shared
+    /// connection.
+    std::string NewDeviceName();
+
+  protected:
+    // The devices call these from StartThread() and StopThread().
+    friend class DeviceThread;
+
+    /// Start servicing a device.
+    void AddDevice(DeviceThread *device);
+
+    /// Stop servicing a device.  When this returns, the hub is not
+    /// servicing it and will not again.  Does nothing if the device was
+    /// never added.
+    void RemoveDevice(DeviceThread *device);
+
+    //=======================================================
+    // Thread and associated semaphore handling.
+    vrpn_Thread *m_thread;  //< The thread that runs the devices
+    vrpn_Semaphore  m_quit; //< Main object grabs this to cause thread to quit.
+    static void ThreadToRun(vrpn_ThreadData &threadData);
+
+    //=======================================================
+    // The devices being serviced.  The thread holds the semaphore while
+    // it makes a pass over them and services the shared connection, so a
+    // device cannot be removed while it is being serviced.
+    std::vector<DeviceThread *> m_devices;
+    vrpn_Semaphore  m_devicesSemaphore;
+
+    //=======================================================
+    // Wait policy, as for DeviceThread.
+    std::atomic<DeviceThreadWaitPolicy> m_waitPolicy;
+    std::atomic<unsigned> m_spinIterations;
+    std::atomic<unsigned> m_blockMicroseconds;
+    void WaitForDevices(DeviceThreadWaitPolicy policy);
+    std::vector<int> m_eventDescriptors;  //< Reused by WaitForDevices()
+
+    //=======================================================
+    // Connection shared by the devices.
+    vrpn_Connection *m_connection;
+    std::atomic<unsigned> m_nextDeviceName;
+};
@@ -0,0 +1,130 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "DeviceThreadReplay.h"
+#include <iostream>
+
+DeviceThreadReplay::DeviceThreadReplay(const std::string &fileName,
+  const std::string &streamName, DeviceThreadReplayMode mode,
+  double speed, DeviceThreadTime startTime, DeviceThreadHub *hub)
+  : DeviceThread(DEFAULT_REPORT_CAPACITY, hub)
+  , m_stream(-1)
+  , m_position(0)
+  , m_next(0)
+  , m_mode(mode)
+  , m_speed(speed)
+  , m_captureStart(0)
+  , m_playbackStart(startTime)
+{
+  if (!m_reader.Open(fileName)) {
+    m_broken = true;
+    return;
+  }
+  m_stream = m_reader.FindStream(streamName);
+  if (m_stream < 0) {
+    std::cerr << "DeviceThreadReplay: No stream named " << streamName
+      << " in " << fileName << std::endl;
+    m_broken = true;
+    return;
+  }
+  if (m_speed <= 0) {
+    std::cerr << "DeviceThreadReplay: Bad speed " << m_speed
+      << ", using 1" << std::endl;
+    m_speed = 1;
+  }
+
+  // Pace from the start of the whole capture rather than of this stream,
+  // so that all of the streams from a capture keep their relative timing.
+  DeviceThreadTime last;
+  if (!m_reader.TimeRange(m_captureStart, last)) {
+    std::cerr << "DeviceThreadReplay: No reports in " << fileName << std::endl;
+    m_broken = true;
+    return;
+  }
+  if (m_playbackStart == NOW) {
+    m_playbackStart = DeviceThreadNow();
+  }
+
+  // Start our thread running
+  StartThread();
+}
+
+DeviceThreadReplay::~DeviceThreadReplay()
+{
+  // Tell our thread it is time to stop running.
+  StopThread();
+}
+
+bool DeviceThreadReplay::ReplayModeFromName(const std::string &name,
+  DeviceThreadReplayMode &outMode)
+{
+  if (name == "paced") {
+    outMode = DEVICE_THREAD_REPLAY_PACED;
+  } else if (name == "fast") {
+    outMode = DEVICE_THREAD_REPLAY_FAST;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+DeviceThreadTime DeviceThreadReplay::NextDueTime() const
+{
+  DeviceThreadTime sinceStart = m_block[m_next].arrivalTime - m_captureStart;
+  return m_playbackStart + static_cast<DeviceThreadTime>(sinceStart / m_speed);
+}
+
+bool DeviceThreadReplay::ServiceDevice()
+{
+  DeviceThreadTime now = DeviceThreadNow();
+  while (true) {
+    // Get the next block when we've played all of this one.  When there
+    // are no more, we're done; returning false stops the thread.
+    if (m_next >= m_block.size()) {
+      m_next = 0;
+      if (!m_reader.ReadNextBlock(m_stream, m_position, m_block)) {
+        return false;
+      }
+      continue;
+    }
+
+    // Queue the next report if it is due, or if we're going as fast as
+    // we can and there is room for it.
+    if (m_mode == DEVICE_THREAD_REPLAY_FAST) {
+      if (!ReportQueueHasRoom()) { return true; }
+    } else if (NextDueTime() > now) {
+      return true;
+    }
+    const DeviceThreadReport &r = m_block[m_next++];
+    AddReport(r.values, r.sampleTime, r.arrivalTime);
+  }
+}
+
+bool DeviceThreadReplay::WaitForDeviceEvent(const struct timeval &timeout)
+{
+  DeviceThreadTime wait = static_cast<DeviceThreadTime>(timeout.tv_sec) * 1000000000
+    + static_cast<DeviceThreadTime>(timeout.tv_usec) * 1000;
+  if ((m_mode == DEVICE_THREAD_REPLAY_PACED) && (m_next < m_block.size())) {
+    DeviceThreadTime untilDue = NextDueTime() - DeviceThreadNow();
+    if (untilDue < wait) {
+      wait = untilDue;
+    }
+  }
+  if (wait > 0) {
+    vrpn_SleepMsecs(wait * 1e-6);
+  }
+  return true;
+}
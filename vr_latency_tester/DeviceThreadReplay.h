@@ -0,0 +1,91 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <DeviceThread.h>
+#include <DeviceThreadCapture.h>
+
+/// How a DeviceThreadReplay paces the reports it plays back.
+typedef enum {
+  DEVICE_THREAD_REPLAY_PACED, //< At the recorded timing, optionally sped up
+  DEVICE_THREAD_REPLAY_FAST   //< As fast as the application drains them
+} DeviceThreadReplayMode;
+
+/// DeviceThread that plays back one stream from a capture file written by
+/// DeviceThreadCaptureWriter, so the latency-testing applications can be
+/// run without the hardware and their analysis can be repeated on the
+/// same input.
+///   Reports keep their recorded sample and arrival times, so everything
+/// computed from the times (latency estimates in particular) comes out
+/// the same as it did live.  In paced mode, each report is handed to the
+/// application when its recorded arrival time comes due, measured from
+/// the start of the capture and scaled by the speed.  Devices replaying
+/// streams from the same capture should be given the same start time so
+/// that they stay in step with each other.
+///   In fast mode, reports are queued as fast as the application removes
+/// them, without ever dropping one.  The order of reports within the
+/// stream is kept, but not their interleaving with other devices, so only
+/// use fast mode when a single stream is being replayed, or for analysis
+/// that only depends on the time stamps.
+///   The device breaks (IsBroken() becomes true) once every report has
+/// been queued; the application can still read any that are queued.
+
+class DeviceThreadReplay : public DeviceThread {
+  public:
+    /// @brief Play back a stream from a capture file.
+    /// @param fileName [in] Capture file to read.
+    /// @param streamName [in] Name of the stream to play.
+    /// @param mode [in] Paced or as fast as possible.
+    /// @param speed [in] For paced mode, how many times faster than
+    ///   recorded to play back (1 is the recorded timing).
+    /// @param startTime [in] For paced mode, when playback starts; NOW
+    ///   starts it right away.
+    /// @param hub [in] Optional hub to run the device from.
+    DeviceThreadReplay(const std::string &fileName,
+      const std::string &streamName,
+      DeviceThreadReplayMode mode = DEVICE_THREAD_REPLAY_PACED,
+      double speed = 1.0, DeviceThreadTime startTime = NOW,
+      DeviceThreadHub *hub = NULL);
+
+    ~DeviceThreadReplay();
+
+    /// @brief Convert "paced" or "fast" to a replay mode.
+    /// @return true on success, false if the name is not recognized.
+    static bool ReplayModeFromName(const std::string &name,
+      DeviceThreadReplayMode &outMode);
+
+  protected:
+    virtual bool ServiceDevice();
+
+    /// In paced mode, sleep until the next report is due or the timeout
+    /// expires, whichever comes first.
+    virtual bool WaitForDeviceEvent(const struct timeval &timeout);
+
+    DeviceThreadCaptureReader m_reader;
+    int m_stream;                   //< Stream being played
+    size_t m_position;              //< Where to read the next block from
+    std::vector<DeviceThreadReport> m_block;  //< Reports being played
+    size_t m_next;                  //< Next report in m_block to queue
+
+    DeviceThreadReplayMode m_mode;
+    double m_speed;
+    DeviceThreadTime m_captureStart;  //< Earliest time in the capture
+    DeviceThreadTime m_playbackStart; //< When playback started
+
+    /// @brief When the next report is due, on the DeviceThreadNow() clock.
+    /// Only call when there is a next report.
+    DeviceThreadTime NextDueTime() const;
+};
@@ -0,0 +1,210 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "DeviceThreadScheduling.h"
+#include <mutex>
+#include <sstream>
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdint.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+// One more than the largest CPU number an affinity mask can hold.
+#if defined(_WIN32)
+static const unsigned long MAX_CPUS = 8 * sizeof(DWORD_PTR);
+#elif defined(__linux__)
+static const unsigned long MAX_CPUS = CPU_SETSIZE;
+#else
+static const unsigned long MAX_CPUS = 1024;
+#endif
+
+bool DeviceThreadSetRealtimePriority(int priority)
+{
+#ifdef _WIN32
+  return SetThreadPriority(GetCurrentThread(),
+    THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#else
+  int minPriority = sched_get_priority_min(SCHED_FIFO);
+  int maxPriority = sched_get_priority_max(SCHED_FIFO);
+  if (priority < minPriority) { priority = minPriority; }
+  if (priority > maxPriority) { priority = maxPriority; }
+  struct sched_param param;
+  param.sched_priority = priority;
+  return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#endif
+}
+
+bool DeviceThreadSetAffinity(const std::vector<unsigned> &cpus)
+{
+  if (cpus.empty()) { return false; }
+#if defined(_WIN32)
+  DWORD_PTR mask = 0;
+  for (size_t i = 0; i < cpus.size(); i++) {
+    if (cpus[i] >= MAX_CPUS) { return false; }
+    mask |= static_cast<DWORD_PTR>(1) << cpus[i];
+  }
+  return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t i = 0; i < cpus.size(); i++) {
+    if (cpus[i] >= MAX_CPUS) { return false; }
+    CPU_SET(cpus[i], &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  // The Mac only offers affinity hints between threads, not CPU masks.
+  return false;
+#endif
+}
+
+bool DeviceThreadLockMemory()
+{
+#ifdef _WIN32
+  // Windows can only lock specific ranges, not the whole process.
+  return false;
+#else
+  // Locking future allocations with a finite limit would make them fail
+  // once the limit is reached, so only do that when there is no limit.
+  int flags = MCL_CURRENT;
+  struct rlimit limit;
+  if ( (geteuid() == 0) || ( (getrlimit(RLIMIT_MEMLOCK, &limit) == 0)
+        && (limit.rlim_cur == RLIM_INFINITY) ) ) {
+    flags |= MCL_FUTURE;
+  }
+  return mlockall(flags) == 0;
+#endif
+}
+
+// The open descriptor and the number of requests holding it.
+static std::mutex g_dmaLatencyMutex;
+static int g_dmaLatencyFd = -1;
+static size_t g_dmaLatencyCount = 0;
+
+bool DeviceThreadAcquireDmaLatency()
+{
+#ifdef __linux__
+  std::lock_guard<std::mutex> lock(g_dmaLatencyMutex);
+  if (g_dmaLatencyCount == 0) {
+    // The kernel holds the requested latency for as long as the
+    // descriptor stays open.
+    int fd = open("/dev/cpu_dma_latency", O_RDWR);
+    if (fd < 0) { return false; }
+    int32_t latency = 0;
+    if (write(fd, &latency, sizeof(latency)) != sizeof(latency)) {
+      close(fd);
+      return false;
+    }
+    g_dmaLatencyFd = fd;
+  }
+  g_dmaLatencyCount++;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void DeviceThreadReleaseDmaLatency()
+{
+#ifdef __linux__
+  std::lock_guard<std::mutex> lock(g_dmaLatencyMutex);
+  if (g_dmaLatencyCount == 0) { return; }
+  if (--g_dmaLatencyCount == 0) {
+    close(g_dmaLatencyFd);
+    g_dmaLatencyFd = -1;
+  }
+#endif
+}
+
+// Read a CPU number from the list, moving past it.  strtoul() would
+// also take a sign or leading spaces, so we check for a digit first.
+// Numbers that overflow come back as ULONG_MAX, which is also
+// rejected, so a range can never run past what the loop can count to.
+static bool ParseCpu(const char *&s, unsigned long &outCpu)
+{
+  if (!isdigit(static_cast<unsigned char>(*s))) { return false; }
+  char *end;
+  outCpu = strtoul(s, &end, 10);
+  s = end;
+  return outCpu < MAX_CPUS;
+}
+
+bool DeviceThreadParseCpuList(const std::string &list,
+  std::vector<unsigned> &cpus)
+{
+  cpus.clear();
+  const char *s = list.c_str();
+  while (*s) {
+    unsigned long first;
+    if (!ParseCpu(s, first)) { return false; }
+    unsigned long last = first;
+    if (*s == '-') {
+      s++;
+      if (!ParseCpu(s, last) || (last < first)) { return false; }
+    }
+    for (unsigned long cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(static_cast<unsigned>(cpu));
+    }
+    if (*s == ',') {
+      s++;
+    } else if (*s != '\0') {
+      return false;
+    }
+  }
+  return !cpus.empty();
+}
+
+std::string DeviceThreadDescribeScheduling(
+  const DeviceThreadSchedulingOptions &options,
+  const DeviceThreadSchedulingStatus &status)
+{
+  std::ostringstream s;
+  const char *separator = "";
+  if (options.realtimePriority > 0) {
+    s << separator << "real-time priority " << options.realtimePriority
+      << (status.realtimePriority ? "" : " NOT applied");
+    separator = ", ";
+  }
+  if (!options.cpus.empty()) {
+    s << separator << "CPUs ";
+    for (size_t i = 0; i < options.cpus.size(); i++) {
+      s << (i ? "," : "") << options.cpus[i];
+    }
+    s << (status.affinity ? "" : " NOT applied");
+    separator = ", ";
+  }
+  if (options.lockMemory) {
+    s << separator << "memory " << (status.lockMemory ? "locked" : "NOT locked");
+    separator = ", ";
+  }
+  if (options.holdDmaLatency) {
+    s << separator << "CPU DMA latency " << (status.holdDmaLatency ? "held at 0" : "NOT held");
+    separator = ", ";
+  }
+  if (s.str().empty()) {
+    return "default scheduling";
+  }
+  return s.str();
+}
@@ -0,0 +1,99 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <vector>
+#include <string>
+
+/// Operating-system settings that keep a device thread from being
+/// preempted or delayed while it time-stamps reports.  Most of them need
+/// privileges (root, CAP_SYS_NICE, CAP_IPC_LOCK or a raised rlimit on
+/// Linux); each one that cannot be applied is simply left off, and the
+/// matching DeviceThreadSchedulingStatus entry tells which took effect.
+class DeviceThreadSchedulingOptions {
+  public:
+    DeviceThreadSchedulingOptions()
+      : realtimePriority(0), lockMemory(false), holdDmaLatency(false) {}
+
+    /// SCHED_FIFO priority (1-99) for the thread that services the device,
+    /// or 0 to leave its scheduling alone.  On Windows, any nonzero value
+    /// selects time-critical priority.  Combining this with the spin wait
+    /// policy can starve everything else on the thread's core.
+    int realtimePriority;
+
+    /// CPUs the thread that services the device may run on; empty for any.
+    /// Not supported on the Mac.
+    std::vector<unsigned> cpus;
+
+    /// Lock the whole process's memory into RAM so that the device thread
+    /// never takes a page fault.  This affects the entire process.
+    bool lockMemory;
+
+    /// Hold /dev/cpu_dma_latency open at zero for as long as the device
+    /// exists, which keeps the CPUs out of deep sleep states.  This affects
+    /// the entire machine.  Linux only.
+    bool holdDmaLatency;
+};
+
+/// Which of the requested DeviceThreadSchedulingOptions took effect.
+/// Settings that were not requested are reported as false.
+class DeviceThreadSchedulingStatus {
+  public:
+    DeviceThreadSchedulingStatus()
+      : realtimePriority(false), affinity(false), lockMemory(false)
+      , holdDmaLatency(false) {}
+
+    bool realtimePriority;
+    bool affinity;
+    bool lockMemory;
+    bool holdDmaLatency;
+};
+
+/// @brief Give the calling thread real-time (SCHED_FIFO) priority.
+/// @param priority [in] Priority, clamped to the range the system allows.
+/// @return true on success, false if not permitted or not supported.
+bool DeviceThreadSetRealtimePriority(int priority);
+
+/// @brief Restrict the calling thread to the listed CPUs.
+/// @return true on success, false if not permitted or not supported.
+bool DeviceThreadSetAffinity(const std::vector<unsigned> &cpus);
+
+/// @brief Lock the process's memory into RAM.  Future allocations are
+/// also locked when the process may lock unlimited memory; otherwise only
+/// the current pages are, so that later allocations cannot fail by
+/// running into the lock limit.
+/// @return true on success, false if not permitted or not supported.
+bool DeviceThreadLockMemory();
+
+/// @brief Request zero CPU DMA latency.  Requests are counted, and the
+/// setting is held until the last one is released.
+/// @return true on success, false if not permitted or not supported.
+bool DeviceThreadAcquireDmaLatency();
+
+/// @brief Release a request made by a successful DeviceThreadAcquireDmaLatency().
+void DeviceThreadReleaseDmaLatency();
+
+/// @brief Parse a comma-separated CPU list such as "2,3" or "0-3,6".
+/// @return true on success, false if the list is malformed or names a
+///   CPU too large for an affinity mask on this platform.
+bool DeviceThreadParseCpuList(const std::string &list,
+  std::vector<unsigned> &cpus);
+
+/// @brief Describe which of the requested settings took effect, for
+/// printing.  Returns "default scheduling" if none were requested.
+std::string DeviceThreadDescribeScheduling(
+  const DeviceThreadSchedulingOptions &options,
+  const DeviceThreadSchedulingStatus &status);
@@ -15,20 +15,56 @@
 */
 
 #include "DeviceThreadVRPNAnalog.h"
+#include "DeviceThreadHub.h"
 #include <string>
 #include <iostream>
 
-DeviceThreadVRPNAnalog::DeviceThreadVRPNAnalog(DeviceThreadAnalogCreator deviceMaker)
+// Our reports must be able to hold every channel an analog can send.
+static_assert(DeviceThreadValues::MAX_VALUES >= vrpn_CHANNEL_MAX,
+  "DeviceThreadValues cannot hold vrpn_CHANNEL_MAX values");
+
+// vrpn_Serial_Analog keeps the descriptor of its serial port protected.
+// A class derived from it may name that member, and the pointer to member
+// it gets can be applied to any vrpn_Serial_Analog, so we read it that way.
+// VRPN's descriptors on Windows are not ones select() can wait on.
+class DeviceThreadAnalogSerialPort : public vrpn_Serial_Analog {
+  public:
+    static int Descriptor(vrpn_Analog *device) {
+#ifdef _WIN32
+      return -1;
+#else
+      vrpn_Serial_Analog *serial = dynamic_cast<vrpn_Serial_Analog *>(device);
+      if (!serial) { return -1; }
+      return serial->*(&DeviceThreadAnalogSerialPort::serial_fd);
+#endif
+    }
+};
+
+DeviceThreadVRPNAnalog::DeviceThreadVRPNAnalog(DeviceThreadAnalogCreator deviceMaker,
+  DeviceThreadHub *hub)
+  : DeviceThread(DEFAULT_REPORT_CAPACITY, hub)
 {
   // Initialize things we don't set in this constructor
   m_genericServer = NULL;
+  m_serialFd = -1;
+  m_sharedConnection = false;
 
-  // Construct a loopback connection for us to use.
-  m_connection = vrpn_create_server_connection("loopback:");
+  // Construct a loopback connection for us to use, or share our hub's.
+  // On the hub's connection each device needs a name of its own, and the
+  // hub's thread must be kept off the connection while we add to it.
+  std::string deviceName = "DeviceThread";
+  if (m_hub) {
+    m_hub->LockConnection();
+    m_connection = m_hub->SharedConnection();
+    if (m_connection) { m_connection->addReference(); }
+    m_sharedConnection = true;
+    deviceName = m_hub->NewDeviceName();
+  } else {
+    m_connection = vrpn_create_server_connection("loopback:");
+  }
 
   // Construct the server object and client object, having them
   // use the connection and the same name.
-  std::string deviceName = "DeviceThread";
   m_server = deviceMaker(deviceName.c_str(), m_connection);
   m_remote = new vrpn_Analog_Remote(deviceName.c_str(), m_connection);
   if (!m_connection || !m_server || !m_remote) {
@@ -38,24 +74,33 @@ DeviceThreadVRPNAnalog::DeviceThreadVRPNAnalog(DeviceThreadAnalogCreator deviceM
       m_connection->removeReference();
       m_connection = NULL;
     }
+    if (m_sharedConnection) { m_hub->UnlockConnection(); }
     m_broken = true;
     return;
   }
 
+  // If the server reads a serial port, we can wait on it for new data.
+  m_serialFd = DeviceThreadAnalogSerialPort::Descriptor(m_server);
+
   // Connect the callback handler for the Analog remote to our static
   // function that handles pushing the reports onto the vector of
   // reports, giving it a pointer to this class instance.
   m_remote->register_change_handler(this, HandleAnalogCallback);
 
+  if (m_sharedConnection) { m_hub->UnlockConnection(); }
+
   // Start our thread running
   StartThread();
 }
 
 DeviceThreadVRPNAnalog::DeviceThreadVRPNAnalog(std::string configFileName,
-  std::string deviceName)
+  std::string deviceName, DeviceThreadHub *hub)
+  : DeviceThread(DEFAULT_REPORT_CAPACITY, hub)
 {
   // Initialize things we don't set in this constructor
   m_server = NULL;
+  m_serialFd = -1;
+  m_sharedConnection = false;
 
   // Construct a loopback connection for us to use.
   m_connection = vrpn_create_server_connection("loopback:");
@@ -91,16 +136,24 @@ DeviceThreadVRPNAnalog::DeviceThreadVRPNAnalog(std::string configFileName,
   StartThread();
 }
 
-DeviceThreadVRPNAnalog::DeviceThreadVRPNAnalog(std::string deviceName)
+DeviceThreadVRPNAnalog::DeviceThreadVRPNAnalog(std::string deviceName,
+  DeviceThreadHub *hub)
+  : DeviceThread(DEFAULT_REPORT_CAPACITY, hub)
 {
   // Initialize things we don't set in this constructor
   m_server = NULL;
   m_genericServer = NULL;
   m_connection = NULL;
+  m_serialFd = -1;
+  m_sharedConnection = false;
 
+  // Remotes of the same server share a connection, which our hub's
+  // thread may be servicing for another device on it.
+  if (m_hub) { m_hub->LockConnection(); }
   m_remote = new vrpn_Analog_Remote(deviceName.c_str());
   if (!m_remote) {
     delete m_remote; m_remote = NULL;
+    if (m_hub) { m_hub->UnlockConnection(); }
     m_broken = true;
     return;
   }
@@ -110,6 +163,8 @@ DeviceThreadVRPNAnalog::DeviceThreadVRPNAnalog(std::string deviceName)
   // reports, giving it a pointer to this class instance.
   m_remote->register_change_handler(this, HandleAnalogCallback);
 
+  if (m_hub) { m_hub->UnlockConnection(); }
+
   // Start our thread running
   StartThread();
 }
@@ -119,7 +174,9 @@ DeviceThreadVRPNAnalog::~DeviceThreadVRPNAnalog()
   // Tell our thread it is time to stop running.
   StopThread();
 
-  // Clean up after ourselves.
+  // Clean up after ourselves, keeping our hub's thread off the
+  // connections while we take our objects off them.
+  if (m_hub) { m_hub->LockConnection(); }
   if (m_remote) {
     m_remote->unregister_change_handler(this, HandleAnalogCallback);
   }
@@ -129,6 +186,7 @@ DeviceThreadVRPNAnalog::~DeviceThreadVRPNAnalog()
   if (m_connection != NULL) {
     m_connection->removeReference();
   }
+  if (m_hub) { m_hub->UnlockConnection(); }
 }
 
 bool DeviceThreadVRPNAnalog::ServiceDevice()
@@ -144,25 +202,47 @@ bool DeviceThreadVRPNAnalog::ServiceDevice()
     }
     m_genericServer->mainloop();
   }
-  if (m_connection) { m_connection->mainloop(); }
+  if (m_connection && !m_sharedConnection) { m_connection->mainloop(); }
   if (m_remote) { m_remote->mainloop(); }
   return true;
 }
 
+bool DeviceThreadVRPNAnalog::WaitForDeviceEvent(const struct timeval &timeout)
+{
+  // When we run the server, wait on its serial port if we know it.
+  if (m_connection) { return DeviceThread::WaitForDeviceEvent(timeout); }
+
+  // An external server's connection has sockets to wait on.  Its
+  // mainloop() waits on them for up to the timeout and handles any
+  // messages that arrive, which delivers them to our callback.
+  if (!m_remote) { return false; }
+  vrpn_Connection *c = m_remote->connectionPtr();
+  if (!c) { return false; }
+  c->mainloop(&timeout);
+  return true;
+}
+
+bool DeviceThreadVRPNAnalog::GetDeviceEventDescriptors(std::vector<int> &fds)
+{
+  if (m_serialFd < 0) { return false; }
+  fds.push_back(m_serialFd);
+  return true;
+}
+
 // Static function
 void DeviceThreadVRPNAnalog::HandleAnalogCallback(
         void *userdata, const vrpn_ANALOGCB info)
 {
   DeviceThreadVRPNAnalog *me = static_cast<DeviceThreadVRPNAnalog *>(userdata);
 
-  // Construct a vector of values from the analog data, one per
-  // each entry.
-  std::vector<double> values;
+  // Construct a set of values from the analog data, one per
+  // each entry.  This is stored inline, so does not allocate.
+  DeviceThreadValues values;
   for (int i = 0; i < info.num_channel; i++) {
     values.push_back(info.channel[i]);
   }
 
   // Send the new report, using the info time as the sample time.
-  me->AddReport(values, info.msg_time);
+  me->AddReport(values, DeviceThreadTimeFromTimeval(info.msg_time));
 }
 
@@ -19,6 +19,7 @@
 #include <vrpn_Analog.h>
 #include <vrpn_Generic_server_object.h>
 #include <string>
+#include <vector>
 
 /// Function that returns a pointer to a new object that is derived from
 /// vrpn_Analog that has the specified name and uses the specified
@@ -47,7 +48,11 @@ class DeviceThreadVRPNAnalog : public DeviceThread {
     /// the appropriate object derived from vrpn_Analog with
     /// the specified name and connection (to be determined by the
     /// DeviceThread class).
-    DeviceThreadVRPNAnalog(DeviceThreadAnalogCreator deviceMaker);
+    /// @param hub [in] Optional hub to run the device from, rather
+    /// than giving it its own thread.  The device then uses the hub's
+    /// shared loopback connection.
+    DeviceThreadVRPNAnalog(DeviceThreadAnalogCreator deviceMaker,
+      DeviceThreadHub *hub = NULL);
 
     /// @brief Construct a DeviceThreadVRPNAnalog using a config file.
     /// This creates a DeviceThread for a generic vrpn_Analog
@@ -57,14 +62,19 @@ class DeviceThreadVRPNAnalog : public DeviceThread {
     /// vrpn_Generic_Server_Object.  This config file should have
     /// exactly one vrpn_Analog-derived object described.
     /// @param deviceName [in] Name of the device defined in the file.
+    /// @param hub [in] Optional hub to run the device from, rather
+    /// than giving it its own thread.
     DeviceThreadVRPNAnalog(std::string configFileName,
-      std::string deviceName);
+      std::string deviceName, DeviceThreadHub *hub = NULL);
 
     /// @brief Construct a DeviceThreadVRPNAnalog using an external server.
     /// This creates a DeviceThread for a generic vrpn_Analog
     /// device, using a remote connection to an external server.
     /// @param deviceName [in] Name of device (example: "Analog0@localhost"
-    DeviceThreadVRPNAnalog(std::string deviceName);
+    /// @param hub [in] Optional hub to run the device from, rather
+    /// than giving it its own thread.
+    DeviceThreadVRPNAnalog(std::string deviceName,
+      DeviceThreadHub *hub = NULL);
 
     ~DeviceThreadVRPNAnalog();
 
@@ -73,8 +83,21 @@ class DeviceThreadVRPNAnalog : public DeviceThread {
     /// parent class.
     virtual bool ServiceDevice();
 
+    /// When connected to an external server, wait on the connection's
+    /// sockets.  When running our own server, wait on the device's serial
+    /// port (see GetDeviceEventDescriptors()).
+    virtual bool WaitForDeviceEvent(const struct timeval &timeout);
+
+    /// When we made the server with a factory and it is a vrpn_Serial_Analog,
+    /// its serial port becomes readable when the device sends data.
+    /// Servers built from a config file are hidden inside the
+    /// vrpn_Generic_Server_Object, so they have no descriptor to give.
+    virtual bool GetDeviceEventDescriptors(std::vector<int> &fds);
+
   protected:
     vrpn_Connection *m_connection;  //< Connection to talk over
+    bool m_sharedConnection;        //< m_connection is our hub's; it services it
+    int m_serialFd;                 //< Server's serial port, or -1 if unknown
     vrpn_Analog     *m_server;      //< Server object
     vrpn_Generic_Server_Object  *m_genericServer;   //< Generic server object
     vrpn_Analog_Remote  *m_remote;   //< Remote object
@@ -15,23 +15,54 @@
 */
 
 #include "DeviceThreadVRPNTracker.h"
+#include "DeviceThreadHub.h"
 #include <string>
 #include <iostream>
 #include <quat.h>
 
+// vrpn_Tracker_Serial keeps the descriptor of its serial port protected.
+// A class derived from it may name that member, and the pointer to member
+// it gets can be applied to any vrpn_Tracker_Serial, so we read it that way.
+// VRPN's descriptors on Windows are not ones select() can wait on.
+class DeviceThreadTrackerSerialPort : public vrpn_Tracker_Serial {
+  public:
+    static int Descriptor(vrpn_Tracker *device) {
+#ifdef _WIN32
+      return -1;
+#else
+      vrpn_Tracker_Serial *serial = dynamic_cast<vrpn_Tracker_Serial *>(device);
+      if (!serial) { return -1; }
+      return serial->*(&DeviceThreadTrackerSerialPort::serial_fd);
+#endif
+    }
+};
+
 DeviceThreadVRPNTracker::DeviceThreadVRPNTracker(DeviceThreadTrackerCreator deviceMaker
-  , int sensor)
-  : m_sensor(sensor)
+  , int sensor, DeviceThreadHub *hub)
+  : DeviceThread(DEFAULT_REPORT_CAPACITY, hub)
+  , m_sensor(sensor)
 {
   // Initialize things we don't set in this constructor
   m_genericServer = NULL;
+  m_serialFd = -1;
+  m_sharedConnection = false;
 
-  // Construct a loopback connection for us to use.
-  m_connection = vrpn_create_server_connection("loopback:");
+  // Construct a loopback connection for us to use, or share our hub's.
+  // On the hub's connection each device needs a name of its own, and the
+  // hub's thread must be kept off the connection while we add to it.
+  std::string deviceName = "DeviceThread";
+  if (m_hub) {
+    m_hub->LockConnection();
+    m_connection = m_hub->SharedConnection();
+    if (m_connection) { m_connection->addReference(); }
+    m_sharedConnection = true;
+    deviceName = m_hub->NewDeviceName();
+  } else {
+    m_connection = vrpn_create_server_connection("loopback:");
+  }
 
   // Construct the server object and client object, having them
   // use the connection and the same name.
-  std::string deviceName = "DeviceThread";
   m_server = deviceMaker(deviceName.c_str(), m_connection);
   m_remote = new vrpn_Tracker_Remote(deviceName.c_str(), m_connection);
   if (!m_connection || !m_server || !m_remote) {
@@ -41,25 +72,34 @@ DeviceThreadVRPNTracker::DeviceThreadVRPNTracker(DeviceThreadTrackerCreator devi
       m_connection->removeReference();
       m_connection = NULL;
     }
+    if (m_sharedConnection) { m_hub->UnlockConnection(); }
     m_broken = true;
     return;
   }
 
+  // If the server reads a serial port, we can wait on it for new data.
+  m_serialFd = DeviceThreadTrackerSerialPort::Descriptor(m_server);
+
   // Connect the callback handler for the Tracker remote to our static
   // function that handles pushing the reports onto the vector of
   // reports, giving it a pointer to this class instance.
   m_remote->register_change_handler(this, HandleTrackerCallback, m_sensor);
 
+  if (m_sharedConnection) { m_hub->UnlockConnection(); }
+
   // Start our thread running
   StartThread();
 }
 
 DeviceThreadVRPNTracker::DeviceThreadVRPNTracker(std::string configFileName,
-  std::string deviceName, int sensor)
-  : m_sensor(sensor)
+  std::string deviceName, int sensor, DeviceThreadHub *hub)
+  : DeviceThread(DEFAULT_REPORT_CAPACITY, hub)
+  , m_sensor(sensor)
 {
   // Initialize things we don't set in this constructor
   m_server = NULL;
+  m_serialFd = -1;
+  m_sharedConnection = false;
 
   // Construct a loopback connection for us to use.
   m_connection = vrpn_create_server_connection("loopback:");
@@ -96,17 +136,24 @@ DeviceThreadVRPNTracker::DeviceThreadVRPNTracker(std::string configFileName,
 }
 
 DeviceThreadVRPNTracker::DeviceThreadVRPNTracker(std::string deviceName
-  , int sensor)
-  : m_sensor(sensor)
+  , int sensor, DeviceThreadHub *hub)
+  : DeviceThread(DEFAULT_REPORT_CAPACITY, hub)
+  , m_sensor(sensor)
 {
   // Initialize things we don't set in this constructor
   m_server = NULL;
   m_genericServer = NULL;
   m_connection = NULL;
+  m_serialFd = -1;
+  m_sharedConnection = false;
 
+  // Remotes of the same server share a connection, which our hub's
+  // thread may be servicing for another device on it.
+  if (m_hub) { m_hub->LockConnection(); }
   m_remote = new vrpn_Tracker_Remote(deviceName.c_str());
   if (!m_remote) {
     delete m_remote; m_remote = NULL;
+    if (m_hub) { m_hub->UnlockConnection(); }
     m_broken = true;
     return;
   }
@@ -116,6 +163,8 @@ DeviceThreadVRPNTracker::DeviceThreadVRPNTracker(std::string deviceName
   // reports, giving it a pointer to this class instance.
   m_remote->register_change_handler(this, HandleTrackerCallback, m_sensor);
 
+  if (m_hub) { m_hub->UnlockConnection(); }
+
   // Start our thread running
   StartThread();
 }
@@ -125,7 +174,9 @@ DeviceThreadVRPNTracker::~DeviceThreadVRPNTracker()
   // Tell our thread it is time to stop running.
   StopThread();
 
-  // Clean up after ourselves.
+  // Clean up after ourselves, keeping our hub's thread off the
+  // connections while we take our objects off them.
+  if (m_hub) { m_hub->LockConnection(); }
   if (m_remote) {
     m_remote->unregister_change_handler(this, HandleTrackerCallback, m_sensor);
   }
@@ -135,6 +186,7 @@ DeviceThreadVRPNTracker::~DeviceThreadVRPNTracker()
   if (m_connection != NULL) {
     m_connection->removeReference();
   }
+  if (m_hub) { m_hub->UnlockConnection(); }
 }
 
 bool DeviceThreadVRPNTracker::ServiceDevice()
@@ -150,25 +202,47 @@ bool DeviceThreadVRPNTracker::ServiceDevice()
     }
     m_genericServer->mainloop();
   }
-  if (m_connection) { m_connection->mainloop(); }
+  if (m_connection && !m_sharedConnection) { m_connection->mainloop(); }
   if (m_remote) { m_remote->mainloop(); }
   return true;
 }
 
+bool DeviceThreadVRPNTracker::WaitForDeviceEvent(const struct timeval &timeout)
+{
+  // When we run the server, wait on its serial port if we know it.
+  if (m_connection) { return DeviceThread::WaitForDeviceEvent(timeout); }
+
+  // An external server's connection has sockets to wait on.  Its
+  // mainloop() waits on them for up to the timeout and handles any
+  // messages that arrive, which delivers them to our callback.
+  if (!m_remote) { return false; }
+  vrpn_Connection *c = m_remote->connectionPtr();
+  if (!c) { return false; }
+  c->mainloop(&timeout);
+  return true;
+}
+
+bool DeviceThreadVRPNTracker::GetDeviceEventDescriptors(std::vector<int> &fds)
+{
+  if (m_serialFd < 0) { return false; }
+  fds.push_back(m_serialFd);
+  return true;
+}
+
 // Static function
 void DeviceThreadVRPNTracker::HandleTrackerCallback(
         void *userdata, const vrpn_TRACKERCB info)
 {
   DeviceThreadVRPNTracker *me = static_cast<DeviceThreadVRPNTracker *>(userdata);
 
-  // Construct a vector of values from the tracker data,
+  // Construct a set of values from the tracker data,
   // with the first three from position and the last three
   // from Euler angles derived from the Quaternion.
 
   q_vec_type yawPitchRoll;
   q_to_euler(yawPitchRoll, info.quat);
 
-  std::vector<double> values;
+  DeviceThreadValues values;
   values.push_back(info.pos[Q_X]);
   values.push_back(info.pos[Q_Y]);
   values.push_back(info.pos[Q_Z]);
@@ -177,6 +251,6 @@ void DeviceThreadVRPNTracker::HandleTrackerCallback(
   values.push_back(yawPitchRoll[Q_YAW]);
 
   // Send the new report, using the info time as the sample time.
-  me->AddReport(values, info.msg_time);
+  me->AddReport(values, DeviceThreadTimeFromTimeval(info.msg_time));
 }
 
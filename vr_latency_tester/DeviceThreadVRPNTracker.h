@@ -19,6 +19,7 @@
 #include <vrpn_Tracker.h>
 #include <vrpn_Generic_server_object.h>
 #include <string>
+#include <vector>
 
 /// Function that returns a pointer to a new object that is derived from
 /// vrpn_Tracker that has the specified name and uses the specified
@@ -51,8 +52,11 @@ class DeviceThreadVRPNTracker : public DeviceThread {
     /// the specified name and connection (to be determined by the
     /// DeviceThread class).
     /// @param sensor [in] Optional sensor ID to read from.
+    /// @param hub [in] Optional hub to run the device from, rather
+    /// than giving it its own thread.  The device then uses the hub's
+    /// shared loopback connection.
     DeviceThreadVRPNTracker(DeviceThreadTrackerCreator deviceMaker,
-      int sensor = 0);
+      int sensor = 0, DeviceThreadHub *hub = NULL);
 
     /// @brief Construct a DeviceThreadVRPNTracker using a config file.
     /// This creates a DeviceThread for a generic vrpn_Tracker
@@ -63,15 +67,20 @@ class DeviceThreadVRPNTracker : public DeviceThread {
     /// exactly one vrpn_Tracker-derived object described.
     /// @param deviceName [in] Name of the device defined in the file.
     /// @param sensor [in] Optional sensor ID to read from.
+    /// @param hub [in] Optional hub to run the device from, rather
+    /// than giving it its own thread.
     DeviceThreadVRPNTracker(std::string configFileName,
-      std::string deviceName, int sensor = 0);
+      std::string deviceName, int sensor = 0, DeviceThreadHub *hub = NULL);
 
     /// @brief Construct a DeviceThreadVRPNTracker using an external server.
     /// This creates a DeviceThread for a generic vrpn_Tracker
     /// device, using a remote connection to an external server.
     /// @param deviceName [in] Name of device (example: "Tracker0@localhost"
     /// @param sensor [in] Optional sensor ID to read from.
-    DeviceThreadVRPNTracker(std::string deviceName, int sensor = 0);
+    /// @param hub [in] Optional hub to run the device from, rather
+    /// than giving it its own thread.
+    DeviceThreadVRPNTracker(std::string deviceName, int sensor = 0,
+      DeviceThreadHub *hub = NULL);
 
     ~DeviceThreadVRPNTracker();
 
@@ -80,9 +89,22 @@ class DeviceThreadVRPNTracker : public DeviceThread {
     /// parent class.
     virtual bool ServiceDevice();
 
+    /// When connected to an external server, wait on the connection's
+    /// sockets.  When running our own server, wait on the device's serial
+    /// port (see GetDeviceEventDescriptors()).
+    virtual bool WaitForDeviceEvent(const struct timeval &timeout);
+
+    /// When we made the server with a factory and it is a vrpn_Tracker_Serial,
+    /// its serial port becomes readable when the device sends data.
+    /// Servers built from a config file are hidden inside the
+    /// vrpn_Generic_Server_Object, so they have no descriptor to give.
+    virtual bool GetDeviceEventDescriptors(std::vector<int> &fds);
+
   protected:
     int m_sensor;                   //< Sensor to read from
     vrpn_Connection *m_connection;  //< Connection to talk over
+    bool m_sharedConnection;        //< m_connection is our hub's; it services it
+    int m_serialFd;                 //< Server's serial port, or -1 if unknown
     vrpn_Tracker    *m_server;      //< Server object
     vrpn_Generic_Server_Object  *m_genericServer;   //< Generic server object
     vrpn_Tracker_Remote  *m_remote;   //< Remote object
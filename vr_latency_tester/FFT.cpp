@@ -0,0 +1,79 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "FFT.h"
+#include <cmath>
+
+size_t FFTSize(size_t n)
+{
+  size_t ret = 1;
+  while (ret < n) {
+    ret <<= 1;
+  }
+  return ret;
+}
+
+bool FFT(std::vector<std::complex<double> > &data, bool inverse)
+{
+  size_t n = data.size();
+  if ((n == 0) || ((n & (n - 1)) != 0)) {
+    return false;
+  }
+
+  // Put the values into bit-reversed order so that each pass can
+  // combine adjacent halves in place.
+  for (size_t i = 1, j = 0; i < n; i++) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j) {
+      std::swap(data[i], data[j]);
+    }
+  }
+
+  // Combine pairs of transforms of length len/2 into transforms of
+  // length len.  The twiddle factors are computed directly rather than
+  // by repeated multiplication so that rounding errors do not build up
+  // over long transforms.
+  const double pi = 3.14159265358979323846;
+  double sign = inverse ? 1 : -1;
+  std::vector<std::complex<double> > twiddle;
+  for (size_t len = 2; len <= n; len <<= 1) {
+    size_t half = len / 2;
+    twiddle.resize(half);
+    for (size_t k = 0; k < half; k++) {
+      double angle = sign * 2 * pi * k / len;
+      twiddle[k] = std::complex<double>(cos(angle), sin(angle));
+    }
+    for (size_t i = 0; i < n; i += len) {
+      for (size_t k = 0; k < half; k++) {
+        std::complex<double> even = data[i + k];
+        std::complex<double> odd = data[i + k + half] * twiddle[k];
+        data[i + k] = even + odd;
+        data[i + k + half] = even - odd;
+      }
+    }
+  }
+
+  if (inverse) {
+    for (size_t i = 0; i < n; i++) {
+      data[i] /= static_cast<double>(n);
+    }
+  }
+  return true;
+}
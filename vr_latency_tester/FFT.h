@@ -0,0 +1,33 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <complex>
+#include <vector>
+
+/// @brief Smallest power of two that is at least n (and at least 1).
+size_t FFTSize(size_t n);
+
+/// @brief In-place radix-2 fast Fourier transform.
+///   The forward transform computes X[k] = sum over n of x[n] e^(-2 pi i k n / N).
+/// The inverse uses the opposite sign and divides by N, so that it undoes
+/// the forward transform.
+/// @param data [in,out] Values to transform; the size must be a power of two.
+/// @param inverse [in] Compute the inverse transform.
+/// @return true on success, false (and data is unchanged) if the size is
+///   not a power of two.
+bool FFT(std::vector<std::complex<double> > &data, bool inverse = false);
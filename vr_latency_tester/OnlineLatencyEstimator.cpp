@@ -0,0 +1,123 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "OnlineLatencyEstimator.h"
+#include <algorithm>
+#include <limits>
+
+OnlineLatencyEstimator::OnlineLatencyEstimator(const ArduinoComparer &mapping
+  , int arduinoChannel
+  , int deviceChannel
+  , bool arrivalTime
+  , double windowSeconds
+  , double updateSeconds
+  , double warmStartSeconds)
+  : m_comparer(mapping)
+  , m_search(mapping.latencySearch())
+  , m_arduinoChannel(arduinoChannel)
+  , m_deviceChannel(deviceChannel)
+  , m_arrivalTime(arrivalTime)
+  , m_window(static_cast<DeviceThreadTime>(windowSeconds * 1e9))
+  , m_updateInterval(static_cast<DeviceThreadTime>(updateSeconds * 1e9))
+  , m_warmStartSeconds(warmStartSeconds)
+  , m_haveReports(false)
+  , m_latest(0)
+  , m_lastUpdate(0)
+  , m_haveEstimate(false)
+  , m_latencySeconds(0)
+  , m_updates(0)
+{
+  // Start with no reports, in case the comparer had some.
+  m_comparer.discardReportsBefore(std::numeric_limits<DeviceThreadTime>::max());
+}
+
+void OnlineLatencyEstimator::noteReports(const std::vector<DeviceThreadReport> &r)
+{
+  for (size_t i = 0; i < r.size(); i++) {
+    DeviceThreadTime t = m_arrivalTime ? r[i].arrivalTime : r[i].sampleTime;
+    if (!m_haveReports) {
+      m_haveReports = true;
+      m_latest = t;
+      m_lastUpdate = t;
+    }
+    m_latest = std::max(m_latest, t);
+  }
+}
+
+void OnlineLatencyEstimator::addArduinoReports(std::vector<DeviceThreadReport> &r)
+{
+  noteReports(r);
+  m_comparer.addArduinoReports(r);
+}
+
+void OnlineLatencyEstimator::addDeviceReports(std::vector<DeviceThreadReport> &r)
+{
+  noteReports(r);
+  m_comparer.addDeviceReports(r);
+}
+
+bool OnlineLatencyEstimator::update(double &outLatencySeconds)
+{
+  if (!m_haveReports || (m_latest - m_lastUpdate < m_updateInterval)) {
+    return false;
+  }
+  m_lastUpdate = m_latest;
+  m_comparer.discardReportsBefore(m_latest - m_window, m_arrivalTime);
+
+  // Look near the previous estimate first.  If the best offset there is
+  // within a step of the edge of the small range (and that edge is not
+  // the edge of the whole range), look everywhere.
+  double latency;
+  bool found = false;
+  if (m_haveEstimate) {
+    LatencySearchOptions near = m_search;
+    near.minSeconds = std::max(m_search.minSeconds, m_latencySeconds - m_warmStartSeconds);
+    near.maxSeconds = std::min(m_search.maxSeconds, m_latencySeconds + m_warmStartSeconds);
+    near.coarseStepSeconds = std::min(m_search.coarseStepSeconds, m_warmStartSeconds / 4);
+    if (m_comparer.setLatencySearch(near) &&
+        m_comparer.computeLatency(m_arduinoChannel, m_deviceChannel, latency,
+          m_arrivalTime)) {
+      bool atLowEdge = (near.minSeconds > m_search.minSeconds)
+        && (latency - near.minSeconds < near.coarseStepSeconds);
+      bool atHighEdge = (near.maxSeconds < m_search.maxSeconds)
+        && (near.maxSeconds - latency < near.coarseStepSeconds);
+      found = !atLowEdge && !atHighEdge;
+    }
+  }
+  if (!found) {
+    m_comparer.setLatencySearch(m_search);
+    found = m_comparer.computeLatency(m_arduinoChannel, m_deviceChannel,
+      latency, m_arrivalTime);
+  }
+  if (!found) {
+    return false;
+  }
+
+  m_latencySeconds = latency;
+  m_haveEstimate = true;
+  m_updates++;
+  outLatencySeconds = latency;
+  return true;
+}
+
+bool OnlineLatencyEstimator::latency(double &outLatencySeconds) const
+{
+  if (!m_haveEstimate) {
+    return false;
+  }
+  outLatencySeconds = m_latencySeconds;
+  return true;
+}
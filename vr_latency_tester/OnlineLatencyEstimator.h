@@ -0,0 +1,91 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <ArduinoComparer.h>
+
+/// Keeps a running estimate of the latency while reports are coming in,
+/// for live readouts and long unattended runs, rather than one estimate
+/// at the end.  It keeps the reports from a sliding window of recent time
+/// and computes the latency over that window each time the reports have
+/// advanced by the update interval.
+///   Each update searches first within a small range around the previous
+/// estimate, which is much cheaper than searching the whole range.  If
+/// the minimum it finds is at the edge of that small range, the latency
+/// may have moved farther, so it searches the whole range again.
+///   The mapping and search settings are copied from an ArduinoComparer
+/// whose mapping has been constructed.  Time is measured by the reports'
+/// time stamps, so it works the same on replayed captures as live.
+
+class OnlineLatencyEstimator {
+  public:
+    /// @brief Set up the estimator.
+    /// @param mapping [in] Comparer whose mapping has been constructed and
+    ///   whose latency search settings should be used.  Its reports are not
+    ///   used.
+    /// @param arduinoChannel [in] Channel to read from the Arduino reports.
+    /// @param deviceChannel [in] Channel to read from the Device reports.
+    /// @param arrivalTime [in] Use arrival time rather than report time.
+    /// @param windowSeconds [in] How much recent time to estimate from.
+    /// @param updateSeconds [in] How often to update the estimate.
+    /// @param warmStartSeconds [in] How far from the previous estimate to
+    ///   look first.
+    OnlineLatencyEstimator(const ArduinoComparer &mapping
+      , int arduinoChannel
+      , int deviceChannel
+      , bool arrivalTime = false
+      , double windowSeconds = 5
+      , double updateSeconds = 0.5
+      , double warmStartSeconds = 50e-3);
+
+    /// @brief Add Arduino reports as they arrive.
+    void addArduinoReports(std::vector<DeviceThreadReport> &r);
+
+    /// @brief Add Device reports as they arrive.
+    void addDeviceReports(std::vector<DeviceThreadReport> &r);
+
+    /// @brief Update the estimate if the reports have advanced by the
+    /// update interval since the last one.  Call after adding reports.
+    /// @param [out] outLatencySeconds The new estimate, if there is one.
+    /// @return true if there is a new estimate, false if not.
+    bool update(double &outLatencySeconds);
+
+    /// @brief The most recent estimate.
+    /// @return false if there has not been one yet.
+    bool latency(double &outLatencySeconds) const;
+
+    /// @brief How many estimates have been made.
+    size_t updates() const { return m_updates; }
+
+  protected:
+    ArduinoComparer m_comparer;       //< Mapping plus the reports in the window
+    LatencySearchOptions m_search;    //< Settings for a full search
+    int m_arduinoChannel;
+    int m_deviceChannel;
+    bool m_arrivalTime;
+    DeviceThreadTime m_window;
+    DeviceThreadTime m_updateInterval;
+    double m_warmStartSeconds;
+
+    bool m_haveReports;               //< Have we seen any reports?
+    DeviceThreadTime m_latest;        //< Latest report time seen
+    DeviceThreadTime m_lastUpdate;    //< m_latest when we last updated
+    bool m_haveEstimate;
+    double m_latencySeconds;          //< Latest estimate
+    size_t m_updates;
+
+    void noteReports(const std::vector<DeviceThreadReport> &r);
+};
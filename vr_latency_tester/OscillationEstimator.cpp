@@ -78,8 +78,8 @@ bool OscillationEstimator::addReport(const DeviceThreadReport &rep)
   // the window's worth of reports.  If so, record that we do and
   // also clear entries until we don't.
   m_reports.push_back(rep);
-  while (vrpn_TimevalDurationSeconds(m_reports.back().sampleTime,
-      m_reports.front().sampleTime) > m_windowSeconds) {
+  DeviceThreadTime window = static_cast<DeviceThreadTime>(m_windowSeconds * 1e9);
+  while (m_reports.back().sampleTime - m_reports.front().sampleTime > window) {
     m_windowReached = true;
     m_reports.pop_front();
   }
@@ -126,7 +126,7 @@ double OscillationEstimator::estimatePeriod() const
   bool beyondSTD = false;
   bool crossedZero = false;
   double lastVal = m_reports.front().values[channel];
-  std::vector<struct timeval> crossings;
+  std::vector<DeviceThreadTime> crossings;
   std::list<DeviceThreadReport>::const_iterator rep;
   double mean = means[channel];
   double deviation = deviations[channel];
@@ -170,8 +170,7 @@ double OscillationEstimator::estimatePeriod() const
   // it.
   std::vector<double> durations;
   for (size_t i = 1; i < crossings.size(); i++) {
-    durations.push_back(vrpn_TimevalDurationSeconds(
-      crossings[i], crossings[i - 1]));
+    durations.push_back(DeviceThreadSeconds(crossings[i] - crossings[i - 1]));
   }
   std::sort(durations.begin(), durations.end());
   return durations[durations.size() / 2];
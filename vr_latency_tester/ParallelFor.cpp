@@ -0,0 +1,178 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "ParallelFor.h"
+#include <vrpn_Shared.h>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// State shared by the threads working on one ParallelFor() call.
+typedef struct {
+  size_t count;
+  const std::function<void(size_t)> *body;
+  std::atomic<size_t> next;       //< Next index to hand out
+  unsigned maxHelpers;            //< Most pool threads that may join in
+  unsigned helpers;               //< Pool threads working on it; under the pool mutex
+} ParallelForWork;
+
+static void DoParallelForWork(ParallelForWork &work)
+{
+  size_t i;
+  while ((i = work.next++) < work.count) {
+    (*work.body)(i);
+  }
+}
+
+/// Threads that stay around between ParallelFor() calls, so a call does
+/// not pay to start and stop threads.  Each call posts its work, works on
+/// it along with whichever pool threads are idle, and then waits for those
+/// to finish their last items.  Several calls can be in progress at once,
+/// including calls made from inside the body of another; a pool thread
+/// that is busy just leaves the new work to its caller and other threads.
+class ParallelForPool {
+  public:
+    static ParallelForPool &Instance();
+    ~ParallelForPool();
+
+    /// Do all of the work, using up to work.maxHelpers pool threads.
+    void Run(ParallelForWork &work);
+
+  protected:
+    ParallelForPool() : m_quit(false) {}
+
+    std::mutex m_mutex;               //< Protects everything below
+    std::condition_variable m_wake;   //< Signals new work or quitting
+    std::condition_variable m_done;   //< Signals a thread leaving some work
+    std::list<ParallelForWork *> m_work; //< Calls that may want help
+    std::vector<std::thread> m_threads;
+    bool m_quit;
+
+    /// Work that still has items to hand out and room for another helper,
+    /// or NULL.  Call with the mutex held.
+    ParallelForWork *FindWork();
+    void ThreadToRun();
+};
+
+ParallelForPool &ParallelForPool::Instance()
+{
+  // Made the first time it is needed; this is thread-safe.
+  static ParallelForPool pool;
+  return pool;
+}
+
+ParallelForPool::~ParallelForPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = true;
+    m_wake.notify_all();
+  }
+  for (size_t t = 0; t < m_threads.size(); t++) {
+    m_threads[t].join();
+  }
+}
+
+ParallelForWork *ParallelForPool::FindWork()
+{
+  for (std::list<ParallelForWork *>::iterator w = m_work.begin();
+      w != m_work.end(); ++w) {
+    if (((*w)->helpers < (*w)->maxHelpers) && ((*w)->next < (*w)->count)) {
+      return *w;
+    }
+  }
+  return NULL;
+}
+
+void ParallelForPool::Run(ParallelForWork &work)
+{
+  // Post the work, starting more threads if there are not enough.  If one
+  // fails to start, the rest of us still get through all of the work.
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    while (m_threads.size() < work.maxHelpers) {
+      try {
+        m_threads.push_back(std::thread(&ParallelForPool::ThreadToRun, this));
+      } catch (const std::system_error &) {
+        break;
+      }
+    }
+    m_work.push_back(&work);
+    m_wake.notify_all();
+  }
+
+  // Work along with them.  Once every item has been handed out, no other
+  // thread can join in, so we wait for the ones that did to finish their
+  // last items.  Waiting under the mutex that they leave under is what
+  // makes their results visible to us.
+  DoParallelForWork(work);
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_work.remove(&work);
+  m_done.wait(lock, [&work] { return work.helpers == 0; });
+}
+
+void ParallelForPool::ThreadToRun()
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    m_wake.wait(lock, [this] { return m_quit || (FindWork() != NULL); });
+    if (m_quit) { return; }
+    ParallelForWork *work = FindWork();
+    work->helpers++;
+    lock.unlock();
+    DoParallelForWork(*work);
+    lock.lock();
+    if (--work->helpers == 0) {
+      m_done.notify_all();
+    }
+  }
+}
+
+unsigned ParallelForDefaultThreads()
+{
+  unsigned ret = vrpn_Thread::number_of_processors();
+  if (ret == 0) { ret = 1; }
+  return ret;
+}
+
+void ParallelFor(size_t count, const std::function<void(size_t)> &body,
+  unsigned threads)
+{
+  if (threads == 0) {
+    threads = ParallelForDefaultThreads();
+  }
+  if (threads > count) {
+    threads = static_cast<unsigned>(count);
+  }
+
+  ParallelForWork work;
+  work.count = count;
+  work.body = &body;
+  work.next = 0;
+  work.maxHelpers = (threads > 1) ? threads - 1 : 0;
+  work.helpers = 0;
+
+  // With no one to help, don't bother with the pool.
+  if (work.maxHelpers == 0) {
+    DoParallelForWork(work);
+    return;
+  }
+  ParallelForPool::Instance().Run(work);
+}
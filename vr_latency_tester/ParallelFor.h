@@ -0,0 +1,38 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <functional>
+
+/// @brief Call body(i) for each i from 0 to count-1, spread across threads.
+///   Indices are handed out one at a time from a shared counter, so work
+/// items that take different amounts of time still keep every thread busy.
+/// The calling thread works along with threads from a pool that is kept
+/// between calls, and the call returns once every item has finished and
+/// its results are visible to the caller.  It may be called from several
+/// threads at once, and from inside a body.  Items may run in any order and at the same
+/// time as each other, so the body must not touch shared state without
+/// protecting it; writing to element i of a vector sized beforehand is fine.
+/// @param count [in] Number of work items.
+/// @param body [in] Function to call with each item's index.
+/// @param threads [in] Most threads to use, including the calling thread;
+///   0 means one per processor.
+void ParallelFor(size_t count, const std::function<void(size_t)> &body,
+  unsigned threads = 0);
+
+/// @brief Number of threads ParallelFor() uses by default.
+unsigned ParallelForDefaultThreads();
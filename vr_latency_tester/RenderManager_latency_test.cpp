@@ -167,7 +167,7 @@ int main(int argc, const char *argv[])
   }
   double lastArduinoValue;
   do {
-    r = arduino.GetReports();
+    arduino.WaitForReports(1, 0.1, r);
     if (r.size() > 0) {
       if (r[0].values.size() <= g_arduinoChannel) {
         std::cerr << "Report size from Arduino: " << r[0].values.size()
@@ -229,7 +229,7 @@ int main(int argc, const char *argv[])
   g_red = g_green = g_blue = 0;
   render->Render();
   vrpn_SleepMsecs(500);
-  r = arduino.GetReports();
+  arduino.GetReports(r);
   if (r.size() == 0) {
     std::cerr << "Could not read Arduino value after dark rendering" << std::endl;
     delete render;
@@ -250,7 +250,7 @@ int main(int argc, const char *argv[])
   g_red = g_green = g_blue = 1;
   render->Render();
   vrpn_SleepMsecs(500);
-  r = arduino.GetReports();
+  arduino.GetReports(r);
   if (r.size() == 0) {
     std::cerr << "Could not read Arduino value after bright rendering" << std::endl;
     delete render;
@@ -284,7 +284,7 @@ int main(int argc, const char *argv[])
     g_red = g_green = g_blue = 0;
     render->Render();
     vrpn_SleepMsecs(500);
-    r = arduino.GetReports();
+    arduino.GetReports(r);
     render->Render();
 
     // Store the time, render bright, store the after-render time,
@@ -292,13 +292,11 @@ int main(int argc, const char *argv[])
     // As above, do another render after the sleep so we're running
     // the sytem as if it were rendering every frame.
     g_red = g_green = g_blue = 1;
-    struct timeval pre_render;
-    vrpn_gettimeofday(&pre_render, NULL);
+    DeviceThreadTime pre_render = DeviceThreadNow();
     render->Render();
-    struct timeval post_render;
-    vrpn_gettimeofday(&post_render, NULL);
+    DeviceThreadTime post_render = DeviceThreadNow();
     vrpn_SleepMsecs(500);
-    r = arduino.GetReports();
+    arduino.GetReports(r);
     render->Render();
 
     // Find where we cross the threshold from dark to bright and
@@ -308,11 +306,11 @@ int main(int argc, const char *argv[])
           (r[t].values[g_arduinoChannel] >= threshold)) {
         if (g_verbosity > 1) {
           if (arrivalTime) {
-            pre_delays_ms.push_back(vrpn_TimevalDurationSeconds(r[t].arrivalTime, pre_render) * 1e3);
-            post_delays_ms.push_back(vrpn_TimevalDurationSeconds(r[t].arrivalTime, post_render) * 1e3);
+            pre_delays_ms.push_back(DeviceThreadSeconds(r[t].arrivalTime - pre_render) * 1e3);
+            post_delays_ms.push_back(DeviceThreadSeconds(r[t].arrivalTime - post_render) * 1e3);
           } else {
-            pre_delays_ms.push_back(vrpn_TimevalDurationSeconds(r[t].sampleTime, pre_render) * 1e3);
-            post_delays_ms.push_back(vrpn_TimevalDurationSeconds(r[t].sampleTime, post_render) * 1e3);
+            pre_delays_ms.push_back(DeviceThreadSeconds(r[t].sampleTime - pre_render) * 1e3);
+            post_delays_ms.push_back(DeviceThreadSeconds(r[t].sampleTime - post_render) * 1e3);
           }
           std::cout << "Latency from pre-render: "
             << pre_delays_ms[i]
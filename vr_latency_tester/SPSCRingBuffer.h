@@ -0,0 +1,140 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+
+/// Lock-free queue that passes items from exactly one producer thread
+/// to exactly one consumer thread.  All storage is allocated when the
+/// queue is constructed and the slots are reused from then on, so
+/// pushing and popping never allocate (so long as copying a T does not).
+///   The head index is written only by the producer and the tail index
+/// only by the consumer.  Each lives on its own cache line along with
+/// that thread's cached copy of the other index, so the two threads
+/// only share a cache line when one of them actually needs to see the
+/// other's progress.
+///   Calling push() from more than one thread, or pop() from more than
+/// one thread, is not safe.
+
+template <class T>
+class SPSCRingBuffer {
+  public:
+    /// @brief Construct a queue that can hold at least capacity items.
+    /// @param [in] capacity Minimum number of items; it is rounded up to
+    ///   the next power of two so that indices can be wrapped with a mask.
+    explicit SPSCRingBuffer(size_t capacity)
+      : m_head(0), m_cachedTail(0), m_tail(0), m_cachedHead(0)
+    {
+      size_t size = 2;
+      while (size < capacity) { size *= 2; }
+      m_slots.resize(size);
+      m_mask = size - 1;
+    }
+
+    /// @brief Number of items the queue can hold.
+    size_t capacity() const { return m_slots.size(); }
+
+    /// @brief Add an item to the queue.  Only call from the producer.
+    /// @return true on success, false if the queue was full.
+    bool push(const T &item)
+    {
+      size_t head = m_head.load(std::memory_order_relaxed);
+      if (head - m_cachedTail >= m_slots.size()) {
+        m_cachedTail = m_tail.load(std::memory_order_acquire);
+        if (head - m_cachedTail >= m_slots.size()) {
+          return false;
+        }
+      }
+      m_slots[head & m_mask] = item;
+      m_head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    /// @brief Look at the oldest item in the queue without removing it,
+    /// so that the consumer can copy it straight to where it is needed.
+    /// The item stays valid until consume() is called.  Only call from
+    /// the consumer.
+    /// @return The item, or NULL if the queue was empty.
+    const T *front()
+    {
+      size_t tail = m_tail.load(std::memory_order_relaxed);
+      if (tail == m_cachedHead) {
+        m_cachedHead = m_head.load(std::memory_order_acquire);
+        if (tail == m_cachedHead) {
+          return NULL;
+        }
+      }
+      return &m_slots[tail & m_mask];
+    }
+
+    /// @brief Remove the item returned by front(), letting the producer
+    /// reuse its slot.  Only call from the consumer, after front() has
+    /// returned an item.
+    void consume()
+    {
+      size_t tail = m_tail.load(std::memory_order_relaxed);
+      m_tail.store(tail + 1, std::memory_order_release);
+    }
+
+    /// @brief Remove the oldest item from the queue.  Only call from
+    /// the consumer.
+    /// @param [out] item Filled in with the item if there was one.
+    /// @return true if an item was removed, false if the queue was empty.
+    bool pop(T &item)
+    {
+      const T *oldest = front();
+      if (!oldest) {
+        return false;
+      }
+      item = *oldest;
+      consume();
+      return true;
+    }
+
+    /// @brief Number of items in the queue.  This is exact when called
+    /// from either end with the other end idle, and a snapshot otherwise.
+    size_t size() const
+    {
+      size_t tail = m_tail.load(std::memory_order_acquire);
+      size_t head = m_head.load(std::memory_order_acquire);
+      return head - tail;
+    }
+
+    /// @brief Tell whether the queue is empty, as seen by the consumer.
+    bool empty() const { return size() == 0; }
+
+  protected:
+    // Not copyable; the indices are shared between two threads.
+    SPSCRingBuffer(const SPSCRingBuffer &);
+    SPSCRingBuffer &operator = (const SPSCRingBuffer &);
+
+    static const size_t CACHE_LINE = 64;
+
+    // Read-only after construction, so these can share a line.
+    std::vector<T> m_slots;     //< Storage for the items
+    size_t m_mask;              //< Size of m_slots minus one
+
+    // Producer's cache line.
+    alignas(CACHE_LINE) std::atomic<size_t> m_head; //< Next slot to write; written by producer
+    size_t m_cachedTail;        //< Producer's last look at m_tail
+
+    // Consumer's cache line.  The class size is rounded up to a multiple
+    // of the alignment, so nothing that follows shares this line either.
+    alignas(CACHE_LINE) std::atomic<size_t> m_tail; //< Next slot to read; written by consumer
+    size_t m_cachedHead;        //< Consumer's last look at m_head
+};
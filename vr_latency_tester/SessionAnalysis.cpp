@@ -0,0 +1,214 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "SessionAnalysis.h"
+#include <ArduinoComparer.h>
+#include <stdlib.h>
+#include <limits>
+
+// Find the value of the first "name N" marker.
+static bool FindMarkerValue(const std::vector<DeviceThreadCaptureMarker> &markers,
+  const std::string &name, int &outValue)
+{
+  std::string prefix = name + " ";
+  for (size_t i = 0; i < markers.size(); i++) {
+    if (markers[i].text.compare(0, prefix.size(), prefix) == 0) {
+      outValue = atoi(markers[i].text.c_str() + prefix.size());
+      return true;
+    }
+  }
+  return false;
+}
+
+// Find the time of the first marker with the specified text.
+static bool FindMarkerTime(const std::vector<DeviceThreadCaptureMarker> &markers,
+  const std::string &text, DeviceThreadTime &outTime)
+{
+  for (size_t i = 0; i < markers.size(); i++) {
+    if (markers[i].text == text) {
+      outTime = markers[i].time;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reports that arrived in [start, end), skipping any too short to
+// have the channel, which must not be negative.
+static void ReportsArrivingBetween(const std::vector<DeviceThreadReport> &reports,
+  DeviceThreadTime start, DeviceThreadTime end, int channel,
+  std::vector<DeviceThreadReport> &outReports)
+{
+  outReports.clear();
+  for (size_t i = 0; i < reports.size(); i++) {
+    if ((reports[i].arrivalTime >= start) && (reports[i].arrivalTime < end)
+        && (reports[i].values.size() > static_cast<size_t>(channel))) {
+      outReports.push_back(reports[i]);
+    }
+  }
+}
+
+// Fail with the specified reason.
+static bool Fail(SessionAnalysis &result, const std::string &error)
+{
+  result.ok = false;
+  result.error = error;
+  return false;
+}
+
+bool AnalyzeSession(const std::string &fileName, bool arrivalTime,
+  const LatencySearchOptions &latencySearch, SessionAnalysis &result)
+{
+  result.fileName = fileName;
+  result.ok = false;
+  result.error.clear();
+  result.arduinoChannel = -1;
+  result.deviceChannel = -1;
+  result.mappingEntries = 0;
+  result.minArduinoValue = 0;
+  result.maxArduinoValue = 0;
+  result.interpolatedValues = 0;
+  result.arduinoReports = 0;
+  result.deviceReports = 0;
+  result.latencySeconds = 0;
+
+  //-----------------------------------------------------------------
+  // Find the streams, channels and phases.
+  DeviceThreadCaptureReader reader;
+  if (!reader.Open(fileName)) {
+    return Fail(result, "not a readable capture file");
+  }
+  const std::vector<DeviceThreadCaptureMarker> &markers = reader.Markers();
+  int arduinoStream = reader.FindStream("arduino");
+  if (arduinoStream < 0) {
+    return Fail(result, "no arduino stream");
+  }
+  if (!FindMarkerValue(markers, "arduinoChannel", result.arduinoChannel)) {
+    return Fail(result, "no arduinoChannel marker");
+  }
+  int deviceStream = reader.FindStream("device");
+  bool sameStream = deviceStream < 0;
+  if (sameStream) {
+    deviceStream = arduinoStream;
+    if (!FindMarkerValue(markers, "testChannel", result.deviceChannel)) {
+      return Fail(result, "no device stream or testChannel marker");
+    }
+  } else if (!FindMarkerValue(markers, "deviceChannel", result.deviceChannel)) {
+    return Fail(result, "no deviceChannel marker");
+  }
+  if ((result.arduinoChannel < 0) || (result.deviceChannel < 0)) {
+    return Fail(result, "bad channel");
+  }
+  // Captures from before the Arduino range was recorded used the default.
+  int arduinoMax = ArduinoComparer::DEFAULT_ARDUINO_MAX;
+  FindMarkerValue(markers, "arduinoMax", arduinoMax);
+  if (arduinoMax < 1) {
+    return Fail(result, "bad arduinoMax");
+  }
+  DeviceThreadTime mappingStart, measurementStart;
+  DeviceThreadTime measurementEnd = std::numeric_limits<DeviceThreadTime>::max();
+  if (!FindMarkerTime(markers, "phase mapping", mappingStart)
+      || !FindMarkerTime(markers, "phase measurement", measurementStart)) {
+    return Fail(result, "session did not reach the measurement phase");
+  }
+  // A session that was cut short has no end marker; use what there is.
+  FindMarkerTime(markers, "phase done", measurementEnd);
+
+  std::vector<DeviceThreadReport> arduinoAll, deviceAll;
+  if (!reader.ReadStream(arduinoStream, arduinoAll)) {
+    return Fail(result, "could not read arduino stream");
+  }
+  if (!sameStream && !reader.ReadStream(deviceStream, deviceAll)) {
+    return Fail(result, "could not read device stream");
+  }
+  const std::vector<DeviceThreadReport> &deviceSource = sameStream ? arduinoAll : deviceAll;
+
+  //-----------------------------------------------------------------
+  // Produce the mapping.  Start from the last values that arrived before
+  // the mapping phase and then go through the reports from both devices
+  // in arrival order, adding a mapping each time the Arduino value changes.
+  std::vector<DeviceThreadReport> arduinoReports, deviceReports;
+  ReportsArrivingBetween(arduinoAll, std::numeric_limits<DeviceThreadTime>::min(),
+    mappingStart, result.arduinoChannel, arduinoReports);
+  ReportsArrivingBetween(deviceSource, std::numeric_limits<DeviceThreadTime>::min(),
+    mappingStart, result.deviceChannel, deviceReports);
+  if (arduinoReports.empty() || deviceReports.empty()) {
+    return Fail(result, "no reports before the mapping phase");
+  }
+  double lastArduinoValue = arduinoReports.back().values[result.arduinoChannel];
+  double lastDeviceValue = deviceReports.back().values[result.deviceChannel];
+
+  ArduinoComparer aComp(arduinoMax);
+  if (!aComp.setLatencySearch(latencySearch)) {
+    return Fail(result, "bad latency search range");
+  }
+  ReportsArrivingBetween(arduinoAll, mappingStart, measurementStart,
+    result.arduinoChannel, arduinoReports);
+  if (sameStream) {
+    // The device value comes from the same report as the Arduino value.
+    for (size_t i = 0; i < arduinoReports.size(); i++) {
+      const DeviceThreadValues &v = arduinoReports[i].values;
+      if (v.size() <= static_cast<size_t>(result.deviceChannel)) { continue; }
+      lastDeviceValue = v[result.deviceChannel];
+      if (v[result.arduinoChannel] != lastArduinoValue) {
+        lastArduinoValue = v[result.arduinoChannel];
+        if (aComp.addMapping(lastArduinoValue, lastDeviceValue)) {
+          result.mappingEntries++;
+        }
+      }
+    }
+  } else {
+    ReportsArrivingBetween(deviceAll, mappingStart, measurementStart,
+      result.deviceChannel, deviceReports);
+    size_t d = 0;
+    for (size_t a = 0; a < arduinoReports.size(); a++) {
+      // Take every device report that arrived no later than this one.
+      while ((d < deviceReports.size())
+          && (deviceReports[d].arrivalTime <= arduinoReports[a].arrivalTime)) {
+        lastDeviceValue = deviceReports[d++].values[result.deviceChannel];
+      }
+      double thisArduinoValue = arduinoReports[a].values[result.arduinoChannel];
+      if (thisArduinoValue != lastArduinoValue) {
+        lastArduinoValue = thisArduinoValue;
+        if (aComp.addMapping(lastArduinoValue, lastDeviceValue)) {
+          result.mappingEntries++;
+        }
+      }
+    }
+  }
+  if (!aComp.constructMapping(result.interpolatedValues)) {
+    return Fail(result, "could not construct Arduino mapping");
+  }
+  result.minArduinoValue = aComp.minArduinoValue();
+  result.maxArduinoValue = aComp.maxArduinoValue();
+
+  //-----------------------------------------------------------------
+  // Compute the latency from the measurement phase.
+  ReportsArrivingBetween(arduinoAll, measurementStart, measurementEnd,
+    result.arduinoChannel, arduinoReports);
+  ReportsArrivingBetween(deviceSource, measurementStart, measurementEnd,
+    result.deviceChannel, deviceReports);
+  result.arduinoReports = arduinoReports.size();
+  result.deviceReports = deviceReports.size();
+  aComp.addArduinoReports(arduinoReports);
+  aComp.addDeviceReports(deviceReports);
+  if (!aComp.computeLatency(result.arduinoChannel, result.deviceChannel,
+        result.latencySeconds, arrivalTime)) {
+    return Fail(result, "could not compute latency");
+  }
+  result.ok = true;
+  return true;
+}
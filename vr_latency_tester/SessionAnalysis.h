@@ -0,0 +1,61 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <DeviceThreadCapture.h>
+#include <ArduinoComparer.h>
+#include <string>
+
+/// Results from analyzing one session recorded by the latency-test
+/// applications with -record.
+typedef struct {
+  std::string fileName;
+  bool        ok;               //< Was a latency computed?
+  std::string error;            //< Why not, if it wasn't
+  int         arduinoChannel;
+  int         deviceChannel;
+  size_t      mappingEntries;   //< Mappings added from the mapping phase
+  size_t      minArduinoValue;  //< Range of Arduino values mapped
+  size_t      maxArduinoValue;
+  size_t      interpolatedValues; //< Values within the range filled in
+  size_t      arduinoReports;   //< Reports from the measurement phase
+  size_t      deviceReports;
+  double      latencySeconds;   //< Device behind Arduino
+} SessionAnalysis;
+
+/// @brief Repeat the analysis that vrpn_device_latency_test or
+/// arduino_inputs_latency_test did on a recorded session: build the
+/// Arduino-to-device mapping from the reports that arrived during the
+/// mapping phase and compute the latency from the reports that arrived
+/// during the measurement phase.
+///   The channels and phases are found from the markers the applications
+/// record.  A capture without a "device" stream is taken to be from
+/// arduino_inputs_latency_test, whose device is a second Arduino channel.
+/// While mapping, the applications only look at the latest report from
+/// each device each time around their loop; this looks at every report
+/// in the order they arrived, so the mapping has slightly more entries.
+///   This only reads the file and returns what it found in result rather
+/// than printing it, so it can be run on many sessions at once from
+/// different threads.
+/// @param fileName [in] Capture file to analyze.
+/// @param arrivalTime [in] Use arrival time rather than report time
+///   when computing the latency.
+/// @param latencySearch [in] Where and how finely to look for the latency.
+/// @param result [out] What was found; result.error says what went wrong
+///   on failure.
+/// @return true if the latency was computed, false if not.
+bool AnalyzeSession(const std::string &fileName, bool arrivalTime,
+  const LatencySearchOptions &latencySearch, SessionAnalysis &result);
@@ -0,0 +1,201 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#include "SquaredErrorKernel.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SQUARED_ERROR_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SQUARED_ERROR_TARGET(t)
+#else
+#define SQUARED_ERROR_TARGET(t) __attribute__((target(t)))
+#endif
+#endif
+
+static const size_t LANES = 8;
+
+// Add the squared differences for elements [start, count) into the
+// partial sums and then combine them.  All versions finish with this so
+// that the tail and the final combination are done the same way.
+static double FinishSum(const float *a, const float *b, size_t start,
+  size_t count, double lanes[LANES])
+{
+  for (size_t i = start; i < count; i++) {
+    // Keep the square in a float before adding it so that the compiler
+    // cannot fuse the multiply and add, which the vector versions don't.
+    float diff = a[i] - b[i];
+    float square = diff * diff;
+    lanes[i % LANES] += square;
+  }
+  return ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5]))
+    + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7]));
+}
+
+double SumSquaredDifferencesScalar(const float *a, const float *b, size_t count)
+{
+  double lanes[LANES] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  return FinishSum(a, b, 0, count, lanes);
+}
+
+#ifdef SQUARED_ERROR_X86
+
+SQUARED_ERROR_TARGET("avx2")
+static double SumSquaredDifferencesAVX2(const float *a, const float *b, size_t count)
+{
+  __m256d sum0 = _mm256_setzero_pd();   // Lanes 0-3
+  __m256d sum1 = _mm256_setzero_pd();   // Lanes 4-7
+  size_t blocks = count / LANES;
+  for (size_t i = 0; i < blocks * LANES; i += LANES) {
+    __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 square = _mm256_mul_ps(diff, diff);
+    sum0 = _mm256_add_pd(sum0, _mm256_cvtps_pd(_mm256_castps256_ps128(square)));
+    sum1 = _mm256_add_pd(sum1, _mm256_cvtps_pd(_mm256_extractf128_ps(square, 1)));
+  }
+  double lanes[LANES];
+  _mm256_storeu_pd(lanes, sum0);
+  _mm256_storeu_pd(lanes + 4, sum1);
+  return FinishSum(a, b, blocks * LANES, count, lanes);
+}
+
+SQUARED_ERROR_TARGET("sse2")
+static double SumSquaredDifferencesSSE2(const float *a, const float *b, size_t count)
+{
+  __m128d sum[4] = { _mm_setzero_pd(), _mm_setzero_pd(),
+                     _mm_setzero_pd(), _mm_setzero_pd() };  // Lanes 0-1, 2-3, 4-5, 6-7
+  size_t blocks = count / LANES;
+  for (size_t i = 0; i < blocks * LANES; i += LANES) {
+    __m128 diffLow = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 diffHigh = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    __m128 squareLow = _mm_mul_ps(diffLow, diffLow);
+    __m128 squareHigh = _mm_mul_ps(diffHigh, diffHigh);
+    sum[0] = _mm_add_pd(sum[0], _mm_cvtps_pd(squareLow));
+    sum[1] = _mm_add_pd(sum[1], _mm_cvtps_pd(_mm_movehl_ps(squareLow, squareLow)));
+    sum[2] = _mm_add_pd(sum[2], _mm_cvtps_pd(squareHigh));
+    sum[3] = _mm_add_pd(sum[3], _mm_cvtps_pd(_mm_movehl_ps(squareHigh, squareHigh)));
+  }
+  double lanes[LANES];
+  for (size_t i = 0; i < 4; i++) {
+    _mm_storeu_pd(lanes + 2 * i, sum[i]);
+  }
+  return FinishSum(a, b, blocks * LANES, count, lanes);
+}
+
+// Which instruction sets the processor and operating system support.
+static bool HaveAVX2()
+{
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) { return false; }
+  __cpuid(info, 1);
+  bool osxsave = (info[2] & (1 << 27)) != 0;
+  bool avx = (info[2] & (1 << 28)) != 0;
+  if (!osxsave || !avx || ((_xgetbv(0) & 6) != 6)) { return false; }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+static bool HaveSSE2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+  return true;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2") != 0;
+#endif
+}
+
+#endif
+
+typedef double (*SumSquaredDifferencesFunction)(const float *, const float *, size_t);
+
+// Pick the version once; the result can't change while we're running.
+static SumSquaredDifferencesFunction ChooseVersion(const char *&outName)
+{
+#ifdef SQUARED_ERROR_X86
+  if (HaveAVX2()) {
+    outName = "avx2";
+    return SumSquaredDifferencesAVX2;
+  }
+  if (HaveSSE2()) {
+    outName = "sse2";
+    return SumSquaredDifferencesSSE2;
+  }
+#endif
+  outName = "scalar";
+  return SumSquaredDifferencesScalar;
+}
+
+static const char *g_versionName = "";
+static const SumSquaredDifferencesFunction g_version = ChooseVersion(g_versionName);
+
+double SumSquaredDifferences(const float *a, const float *b, size_t count)
+{
+  return g_version(a, b, count);
+}
+
+const char *SumSquaredDifferencesVersion()
+{
+  return g_versionName;
+}
+
+// Look up a version by name, or return NULL if this processor can't run it.
+static SumSquaredDifferencesFunction FindVersion(const std::string &version)
+{
+#ifdef SQUARED_ERROR_X86
+  if ((version == "avx2") && HaveAVX2()) {
+    return SumSquaredDifferencesAVX2;
+  }
+  if ((version == "sse2") && HaveSSE2()) {
+    return SumSquaredDifferencesSSE2;
+  }
+#endif
+  if (version == "scalar") {
+    return SumSquaredDifferencesScalar;
+  }
+  return NULL;
+}
+
+std::vector<std::string> SumSquaredDifferencesVersions()
+{
+  static const char *names[] = { "avx2", "sse2", "scalar" };
+  std::vector<std::string> ret;
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (FindVersion(names[i])) {
+      ret.push_back(names[i]);
+    }
+  }
+  return ret;
+}
+
+bool SumSquaredDifferencesUsing(const std::string &version,
+  const float *a, const float *b, size_t count, double &outSum)
+{
+  SumSquaredDifferencesFunction f = FindVersion(version);
+  if (!f) { return false; }
+  outSum = f(a, b, count);
+  return true;
+}
@@ -0,0 +1,50 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#pragma once
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/// Sum of squared differences between two arrays of floats, the inner loop
+/// of the resampled latency search in ArduinoComparer.  The AVX2 or SSE2
+/// version is picked at run time based on what the processor supports.
+///   Every version does exactly the same arithmetic in the same order: each
+/// difference and its square are computed in single precision, and the
+/// squares are added in double precision into eight partial sums, element
+/// i going into sum i % 8, which are then combined in a fixed order.  So
+/// the result is bit-for-bit the same whichever version runs.
+
+/// @brief Sum over i of (a[i] - b[i])^2, using the fastest version available.
+double SumSquaredDifferences(const float *a, const float *b, size_t count);
+
+/// @brief The portable version, for testing the others against.
+double SumSquaredDifferencesScalar(const float *a, const float *b, size_t count);
+
+/// @brief Name of the version SumSquaredDifferences() uses: "avx2", "sse2"
+/// or "scalar".
+const char *SumSquaredDifferencesVersion();
+
+/// @brief Names of every version this processor can run, fastest first.
+/// "scalar" is always last.
+std::vector<std::string> SumSquaredDifferencesVersions();
+
+/// @brief Run a particular version, so each can be checked and timed.
+/// @param version [in] One of the names from SumSquaredDifferencesVersions().
+/// @param outSum [out] The sum, if the version could be run.
+/// @return true on success, false if this processor can't run that version.
+bool SumSquaredDifferencesUsing(const std::string &version,
+  const float *a, const float *b, size_t count, double &outSum);
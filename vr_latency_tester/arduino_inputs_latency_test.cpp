@@ -19,8 +19,14 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <memory>
+#include <fstream>
+#include <DeviceThreadHub.h>
 #include <DeviceThreadVRPNAnalog.h>
+#include <DeviceThreadCapture.h>
+#include <DeviceThreadReplay.h>
 #include <ArduinoComparer.h>
+#include <OnlineLatencyEstimator.h>
 #include <vrpn_Streaming_Arduino.h>
 
 // Global state.
@@ -32,9 +38,31 @@ int g_arduinoTestChannel = 1;
 
 void Usage(std::string name)
 {
-  std::cerr << "Usage: " << name << " Arduino_serial_port Potentiometer_channel Test_channel [-count N] [-arrivalTime]" << std::endl;
+  std::cerr << "Usage: " << name << " Arduino_serial_port Potentiometer_channel Test_channel [-count N] [-arrivalTime] [-estimator search|xcorr|extrema] [-window SECONDS] [-arduinoMax N] [-live] [-bootstrap N] [-analysisThreads N] [-errorCurve FILE] [-sweeps FILE] [-velocityProfile FILE] [-latencyRange MIN MAX] [-waitPolicy spin|block|event] [-hub] [-realtime P] [-cpus LIST] [-lockMemory] [-dmaLatency] [-record FILE] [-replay FILE] [-replayMode paced|fast] [-replaySpeed X]" << std::endl;
   std::cerr << "       -count: Repeat the test N times (default 200)" << std::endl;
   std::cerr << "       -arrivalTime: Use arrival time of messages (default is reported sampling time)" << std::endl;
+  std::cerr << "       -window: Compute the latency from only the last SECONDS of the measurement, which keeps memory use flat on long runs (default all of it)" << std::endl;
+  std::cerr << "       -arduinoMax: Largest value the Arduino input reports, such as 4095 for a 12-bit converter (default "
+    << ArduinoComparer::DEFAULT_ARDUINO_MAX << ")" << std::endl;
+  std::cerr << "       -live: Print the latency over the last few seconds every half second while measuring" << std::endl;
+  std::cerr << "       -bootstrap: Also report a 95% confidence interval and standard error for the latency from N resamples of the sweeps (at least 2, usually 200 or more)" << std::endl;
+  std::cerr << "       -analysisThreads: Threads to compute the latency on, 0 for one per processor (default 0)" << std::endl;
+  std::cerr << "       -errorCurve: Write the error at each offset in the latency range, 1 millisecond apart, to FILE" << std::endl;
+  std::cerr << "       -sweeps: Write the latency of each sweep of the motion to FILE and report their spread" << std::endl;
+  std::cerr << "       -velocityProfile: Write the latency at each of several ranges of Arduino speed to FILE and report them" << std::endl;
+  std::cerr << "       -estimator: How to estimate the latency: search (default, minimize the squared error) xcorr (FFT cross-correlation, faster on long captures) or extrema (time between matching turnarounds, fastest but noisiest)" << std::endl;
+  std::cerr << "       -latencyRange: Smallest and largest latency to look for in milliseconds (default "
+    << LatencySearchOptions().minSeconds * 1e3 << " to " << LatencySearchOptions().maxSeconds * 1e3 << ")" << std::endl;
+  std::cerr << "       -waitPolicy: How the device thread waits when idle: spin (default, lowest latency), block (spin then sleep), event (spin then wait for data)" << std::endl;
+  std::cerr << "       -hub: Service the Arduino from a DeviceThreadHub thread, as vrpn_device_latency_test does for several devices" << std::endl;
+  std::cerr << "       -realtime: Run device threads with SCHED_FIFO priority P (needs privileges)" << std::endl;
+  std::cerr << "       -cpus: Run device threads only on the listed CPUs (example: 2,3 or 2-3)" << std::endl;
+  std::cerr << "       -lockMemory: Lock the program's memory into RAM (needs privileges)" << std::endl;
+  std::cerr << "       -dmaLatency: Hold /dev/cpu_dma_latency at 0 during the test (needs privileges)" << std::endl;
+  std::cerr << "       -record: Save every report from the Arduino to a capture file for later analysis" << std::endl;
+  std::cerr << "       -replay: Play back a capture made with -record instead of using the Arduino (the serial port is then ignored)" << std::endl;
+  std::cerr << "       -replayMode: paced (default) plays back at the recorded timing, fast as quickly as the program can read" << std::endl;
+  std::cerr << "       -replaySpeed: How many times faster than recorded to play back in paced mode (default 1)" << std::endl;
   std::cerr << "       Arduino_serial_port: Name of the serial device to use "
             << "to talk to the Arduino.  The Arduino must be running "
             << "the vrpn_streaming_arduino program." << std::endl;
@@ -65,11 +93,29 @@ int main(int argc, const char *argv[])
   // Constants that may some day become options.
   size_t REQUIRED_PASSES = 3;
   int TURN_AROUND_THRESHOLD = 7;
+  size_t VELOCITY_BINS = 8;
+  double LIVE_WINDOW_SECONDS = 5;
 
   // Parse the command line.
   size_t realParams = 0;
   int count = 10;
   bool arrivalTime = false;
+  LatencySearchOptions latencySearch;
+  std::string errorCurveFileName;
+  std::string sweepsFileName;
+  std::string velocityProfileFileName;
+  bool liveEstimate = false;
+  LatencyBootstrapOptions bootstrap;
+  bool computeConfidence = false;
+  double windowSeconds = 0;
+  size_t arduinoMax = ArduinoComparer::DEFAULT_ARDUINO_MAX;
+  DeviceThreadWaitPolicy waitPolicy = DEVICE_THREAD_WAIT_SPIN;
+  bool useHub = false;
+  DeviceThreadSchedulingOptions scheduling;
+  std::string recordFileName;
+  std::string replayFileName;
+  DeviceThreadReplayMode replayMode = DEVICE_THREAD_REPLAY_PACED;
+  double replaySpeed = 1;
   for (size_t i = 1; i < argc; i++) {
     if (argv[i] == std::string("-count")) {
       if (++i > argc) {
@@ -82,8 +128,145 @@ int main(int argc, const char *argv[])
           << argv[i] << std::endl;
         Usage(argv[0]);
       }
+    } else if (argv[i] == std::string("-window")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -window parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      windowSeconds = atof(argv[i]);
+    } else if (argv[i] == std::string("-arduinoMax")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -arduinoMax parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (atoi(argv[i]) < 1) {
+        std::cerr << "Error: -arduinoMax parameter must be >= 1, found "
+          << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+      arduinoMax = atoi(argv[i]);
+    } else if (argv[i] == std::string("-live")) {
+      liveEstimate = true;
+    } else if (argv[i] == std::string("-bootstrap")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -bootstrap parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (atoi(argv[i]) < 2) {
+        std::cerr << "Error: -bootstrap parameter must be >= 2, found "
+          << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+      bootstrap.resamples = atoi(argv[i]);
+      computeConfidence = true;
+    } else if (argv[i] == std::string("-analysisThreads")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -analysisThreads parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      latencySearch.threads = atoi(argv[i]);
+    } else if (argv[i] == std::string("-errorCurve")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -errorCurve parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      errorCurveFileName = argv[i];
+    } else if (argv[i] == std::string("-sweeps")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -sweeps parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      sweepsFileName = argv[i];
+    } else if (argv[i] == std::string("-velocityProfile")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -velocityProfile parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      velocityProfileFileName = argv[i];
+    } else if (argv[i] == std::string("-estimator")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -estimator parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!ArduinoComparer::latencyEstimatorFromName(argv[i], latencySearch.estimator)) {
+        std::cerr << "Error: Unrecognized -estimator: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-latencyRange")) {
+      if (i + 2 >= argc) {
+        std::cerr << "Error: -latencyRange parameter requires two values" << std::endl;
+        Usage(argv[0]);
+      }
+      latencySearch.minSeconds = atof(argv[++i]) * 1e-3;
+      latencySearch.maxSeconds = atof(argv[++i]) * 1e-3;
+      if (latencySearch.maxSeconds <= latencySearch.minSeconds) {
+        std::cerr << "Error: -latencyRange maximum must be larger than minimum" << std::endl;
+        Usage(argv[0]);
+      }
     } else if (argv[i] == std::string("-arrivalTime")) {
       arrivalTime = true;
+    } else if (argv[i] == std::string("-waitPolicy")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -waitPolicy parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!DeviceThread::WaitPolicyFromName(argv[i], waitPolicy)) {
+        std::cerr << "Error: Unrecognized -waitPolicy: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-hub")) {
+      useHub = true;
+    } else if (argv[i] == std::string("-realtime")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -realtime parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      scheduling.realtimePriority = atoi(argv[i]);
+    } else if (argv[i] == std::string("-cpus")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -cpus parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!DeviceThreadParseCpuList(argv[i], scheduling.cpus)) {
+        std::cerr << "Error: Bad -cpus list: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-record")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -record parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      recordFileName = argv[i];
+    } else if (argv[i] == std::string("-replay")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -replay parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      replayFileName = argv[i];
+    } else if (argv[i] == std::string("-replayMode")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -replayMode parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!DeviceThreadReplay::ReplayModeFromName(argv[i], replayMode)) {
+        std::cerr << "Error: Unrecognized -replayMode: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-replaySpeed")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -replaySpeed parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      replaySpeed = atof(argv[i]);
+      if (replaySpeed <= 0) {
+        std::cerr << "Error: -replaySpeed must be positive, found "
+          << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-lockMemory")) {
+      scheduling.lockMemory = true;
+    } else if (argv[i] == std::string("-dmaLatency")) {
+      scheduling.holdDmaLatency = true;
     } else if (argv[i][0] == '-') {
         Usage(argv[0]);
     } else switch (++realParams) {
@@ -104,9 +287,47 @@ int main(int argc, const char *argv[])
     Usage(argv[0]);
   }
 
+  // If asked, construct a hub to service the Arduino.  It is declared
+  // before the device so that it is destroyed after it.
+  std::unique_ptr<DeviceThreadHub> hub;
+  if (useHub) {
+    hub.reset(new DeviceThreadHub());
+    hub->SetWaitPolicy(waitPolicy);
+  }
+
   // Construct the thread to handle the ground-truth potentiometer
-  // reading from the Ardiuno, and also the test channel.
-  DeviceThreadVRPNAnalog  arduino(CreateStreamingServer);
+  // reading from the Ardiuno, and also the test channel.  When replaying,
+  // they come from the capture file instead.
+  std::unique_ptr<DeviceThread> arduino;
+  if (!replayFileName.empty()) {
+    arduino.reset(new DeviceThreadReplay(replayFileName, "arduino",
+      replayMode, replaySpeed, DeviceThreadNow(), hub.get()));
+  } else {
+    arduino.reset(new DeviceThreadVRPNAnalog(CreateStreamingServer, hub.get()));
+  }
+  arduino->SetWaitPolicy(waitPolicy);
+
+  // Keep the device thread from being preempted, if asked to, and
+  // report which settings actually took effect.
+  DeviceThreadSchedulingStatus arduinoScheduling;
+  arduino->SetSchedulingOptions(scheduling, arduinoScheduling);
+  if (g_verbosity > 0) {
+    std::cout << "Arduino thread: "
+      << DeviceThreadDescribeScheduling(scheduling, arduinoScheduling) << std::endl;
+  }
+
+  // If asked, record every report we read from the Arduino, along with
+  // the channels we're comparing and when each phase of the test starts,
+  // so the session can be analyzed again later.  When we're not
+  // recording, the recorder ignores everything it is given.
+  DeviceThreadCaptureWriter recorder;
+  if (!recordFileName.empty() && !recorder.Open(recordFileName)) {
+    return -9;
+  }
+  int arduinoStream = recorder.AddStream("arduino");
+  recorder.RecordMarker("arduinoChannel " + std::to_string(g_arduinoChannel));
+  recorder.RecordMarker("testChannel " + std::to_string(g_arduinoTestChannel));
+  recorder.RecordMarker("arduinoMax " + std::to_string(arduinoMax));
 
   //-----------------------------------------------------------------
   // Wait until we get at least one report from the device
@@ -121,7 +342,8 @@ int main(int argc, const char *argv[])
   }
   double lastArduinoValue, lastDeviceValue;
   do {
-    r = arduino.GetReports();
+    arduino->WaitForReports(1, 0.1, r);
+    recorder.Record(arduinoStream, r);
     if (r.size() > 0) {
       if (r[0].values.size() <= g_arduinoChannel) {
         std::cerr << "Report size from Arduino: " << r[0].values.size()
@@ -163,11 +385,15 @@ int main(int argc, const char *argv[])
   }
 
   // Clear out all available reports so we start fresh
-  arduino.GetReports();
+  arduino->GetReports(r);
+  recorder.Record(arduinoStream, r);
+  recorder.RecordMarker("phase mapping");
 
   // Keep shoveling values into the vectors until they have turned
   // around at least 8 times (four up, four down)
-  ArduinoComparer aComp;
+  ArduinoComparer aComp(arduinoMax);
+  aComp.setLatencySearch(latencySearch);
+  aComp.setReportRetention(windowSeconds, 0);
   size_t requiredTurns = 2 * REQUIRED_PASSES;
   int lastDirection = 1;  //< 1 for going up, -1 for going down  
   double lastExtremum = lastArduinoValue;
@@ -177,7 +403,13 @@ int main(int argc, const char *argv[])
     double thisArduinoValue = lastArduinoValue;
 
     // Find the new value for the Arduino and the Device, if any.
-    r = arduino.GetReports();
+    // We sleep until a report arrives rather than spinning.
+    arduino->WaitForReports(1, 0.1, r);
+    if (r.empty() && arduino->IsBroken()) {
+      std::cerr << "Arduino stopped reporting while mapping" << std::endl;
+      return -10;
+    }
+    recorder.Record(arduinoStream, r);
     if (r.size() > 0) {
       thisArduinoValue = r.back().values[g_arduinoChannel];
       lastDeviceValue = r.back().values[g_arduinoTestChannel];
@@ -249,15 +481,40 @@ int main(int argc, const char *argv[])
   lastDirection = 1;  //< 1 for going up, -1 for going down  
   lastExtremum = lastArduinoValue;
   numTurns = 0;
+  arduino->ResetWaitStatistics();
+  std::unique_ptr<OnlineLatencyEstimator> live;
+  if (liveEstimate) {
+    live.reset(new OnlineLatencyEstimator(aComp, g_arduinoChannel, g_arduinoTestChannel,
+      arrivalTime, LIVE_WINDOW_SECONDS));
+  }
+  recorder.RecordMarker("phase measurement");
   std::vector<DeviceThreadReport> arduinoReports, deviceReports;
   do {
     // Fill in a default value in case we get no reports.
     double thisArduinoValue = lastArduinoValue;
 
     // Find the new value for the Arduino and the Device, if any.
-    r = arduino.GetReports();
+    arduino->WaitForReports(1, 0.1, r);
+
+    // If the Arduino stops (as it does at the end of a replay), analyze
+    // what we have so far.
+    if (r.empty() && arduino->IsBroken()) {
+      std::cerr << "Arduino stopped reporting after " << numTurns
+        << " turns; computing latency from what we have" << std::endl;
+      break;
+    }
+    recorder.Record(arduinoStream, r);
     aComp.addArduinoReports(r);
     aComp.addDeviceReports(r);
+    if (live) {
+      live->addArduinoReports(r);
+      live->addDeviceReports(r);
+      double liveLatency;
+      if (live->update(liveLatency)) {
+        std::cout << "  Latency over the last " << LIVE_WINDOW_SECONDS
+          << " seconds (milliseconds): " << liveLatency * 1e3 << std::endl;
+      }
+    }
     if (r.size() > 0) {
       thisArduinoValue = r.back().values[g_arduinoChannel];
     }
@@ -290,15 +547,110 @@ int main(int argc, const char *argv[])
       lastArduinoValue = thisArduinoValue;
     }    
   } while (numTurns < requiredTurns);
+  if (g_verbosity > 1) {
+    DeviceThreadWaitStatistics s = arduino->GetWaitStatistics();
+    double blockedPercent = 0;
+    if (s.elapsedSeconds > 0) {
+      blockedPercent = 100 * s.blockedSeconds / s.elapsedSeconds;
+    }
+    std::cout << "Arduino thread: " << s.reports << " reports, "
+      << s.waits << " waits, blocked " << blockedPercent << "% of the time"
+      << std::endl;
+  }
 
-  // Compute the latency between the Arduino and the device
+  recorder.RecordMarker("phase done");
+  if (recorder.IsOpen() && !recorder.Close()) {
+    std::cerr << "Could not finish writing " << recordFileName << std::endl;
+  }
+
+  // Compute the latency between the Arduino and the device, along with
+  // its uncertainty if we've been asked to.
   double latency;
-  if (!aComp.computeLatency(g_arduinoChannel, g_arduinoTestChannel, latency, arrivalTime)) {
+  LatencyConfidence confidence;
+  bool computed;
+  if (computeConfidence) {
+    computed = aComp.computeLatencyConfidence(g_arduinoChannel, g_arduinoTestChannel,
+      bootstrap, confidence, arrivalTime);
+    latency = confidence.latencySeconds;
+  } else {
+    computed = aComp.computeLatency(g_arduinoChannel, g_arduinoTestChannel, latency, arrivalTime);
+  }
+  if (!computed) {
     std::cerr << "Could not compute latency" << std::endl;
     return -8;
   }
-  std::cout << "Error-minimizing latency, device behind Arduino (milliseconds): "
+  std::cout << ArduinoComparer::latencyEstimatorDescription(latencySearch.estimator)
+    << " latency, device behind Arduino (milliseconds): "
     << latency * 1e3 << std::endl;
+  if (computeConfidence) {
+    std::cout << "  Standard error " << confidence.standardErrorSeconds * 1e3
+      << ", " << bootstrap.confidenceLevel * 100 << "% confidence interval "
+      << confidence.lowSeconds * 1e3 << " to " << confidence.highSeconds * 1e3
+      << " (from " << confidence.resamples << " resamples of "
+      << confidence.sweeps << " sweeps)" << std::endl;
+  }
+
+  // Write the error curve if we've been asked to.
+  if (!errorCurveFileName.empty()) {
+    std::vector<double> offsets, errors;
+    size_t steps = static_cast<size_t>(
+      (latencySearch.maxSeconds - latencySearch.minSeconds) / 1e-3 + 0.5);
+    for (size_t i = 0; i <= steps; i++) {
+      offsets.push_back(latencySearch.minSeconds + i * 1e-3);
+    }
+    std::ofstream curve(errorCurveFileName.c_str());
+    if (!curve || !aComp.computeErrorCurve(g_arduinoChannel, g_arduinoTestChannel, offsets,
+          errors, arrivalTime)) {
+      std::cerr << "Could not write error curve to " << errorCurveFileName << std::endl;
+      return -11;
+    }
+    curve << "offsetMilliseconds,error" << std::endl;
+    for (size_t i = 0; i < offsets.size(); i++) {
+      curve << offsets[i] * 1e3 << "," << errors[i] << std::endl;
+    }
+  }
+
+  // Write the latency of each sweep if we've been asked to.
+  if (!sweepsFileName.empty()) {
+    std::vector<SweepLatency> sweeps;
+    SweepLatencySummary summary;
+    std::ofstream out(sweepsFileName.c_str());
+    if (!out || !aComp.computeSweepLatencies(g_arduinoChannel, g_arduinoTestChannel, sweeps,
+          TURN_AROUND_THRESHOLD, arrivalTime)) {
+      std::cerr << "Could not write sweep latencies to " << sweepsFileName << std::endl;
+      return -12;
+    }
+    out << "startSeconds,endSeconds,deviceReports,latencyMilliseconds" << std::endl;
+    for (size_t i = 0; i < sweeps.size(); i++) {
+      out << sweeps[i].startSeconds << "," << sweeps[i].endSeconds << ","
+        << sweeps[i].deviceReports << "," << sweeps[i].latencySeconds * 1e3 << std::endl;
+    }
+    ArduinoComparer::summarizeSweepLatencies(sweeps, summary);
+    std::cout << "Latency over " << summary.sweeps << " sweeps (milliseconds): min "
+      << summary.minSeconds * 1e3 << ", median " << summary.medianSeconds * 1e3
+      << ", p95 " << summary.p95Seconds * 1e3 << ", max " << summary.maxSeconds * 1e3
+      << std::endl;
+  }
+
+  // Write the latency at different speeds if we've been asked to.
+  if (!velocityProfileFileName.empty()) {
+    std::vector<VelocityLatency> profile;
+    std::ofstream out(velocityProfileFileName.c_str());
+    if (!out || !aComp.computeVelocityProfile(g_arduinoChannel, g_arduinoTestChannel,
+          VELOCITY_BINS, profile, 20e-3, arrivalTime)) {
+      std::cerr << "Could not write velocity profile to " << velocityProfileFileName << std::endl;
+      return -13;
+    }
+    out << "minSpeed,maxSpeed,meanSpeed,deviceReports,latencyMilliseconds" << std::endl;
+    std::cout << "Latency by Arduino speed (values per second: milliseconds):" << std::endl;
+    for (size_t i = 0; i < profile.size(); i++) {
+      out << profile[i].minSpeed << "," << profile[i].maxSpeed << ","
+        << profile[i].meanSpeed << "," << profile[i].deviceReports << ","
+        << profile[i].latencySeconds * 1e3 << std::endl;
+      std::cout << "  " << profile[i].minSpeed << " to " << profile[i].maxSpeed
+        << ": " << profile[i].latencySeconds * 1e3 << std::endl;
+    }
+  }
 
   // We're done.  Shut down the threads and exit.
   return 0;
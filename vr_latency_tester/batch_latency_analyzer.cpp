@@ -0,0 +1,223 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// Re-analyzes sessions recorded with the -record option of
+// vrpn_device_latency_test and arduino_inputs_latency_test, without the
+// hardware.  Each session's mapping and latency are computed just as the
+// application computed them, with the sessions spread across all of the
+// processors, and one comma-separated summary row is written per session.
+
+#include <stdlib.h>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <SessionAnalysis.h>
+#include <ParallelFor.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+void Usage(std::string name)
+{
+  std::cerr << "Usage: " << name << " CAPTURE_FILE_OR_DIRECTORY [...] [-threads N] [-arrivalTime] [-estimator search|xcorr|extrema] [-latencyRange MIN MAX] [-output FILE]" << std::endl;
+  std::cerr << "       -threads: How many sessions to analyze at once (default one per processor, "
+    << ParallelForDefaultThreads() << " here)" << std::endl;
+  std::cerr << "       -arrivalTime: Use arrival time of messages (default is reported sampling time)" << std::endl;
+  std::cerr << "       -estimator: How to estimate the latency: search (default, minimize the squared error) xcorr (FFT cross-correlation, faster on long captures) or extrema (time between matching turnarounds, fastest but noisiest)" << std::endl;
+  std::cerr << "       -latencyRange: Smallest and largest latency to look for in milliseconds (default "
+    << LatencySearchOptions().minSeconds * 1e3 << " to " << LatencySearchOptions().maxSeconds * 1e3 << ")" << std::endl;
+  std::cerr << "       -output: Write the summary to FILE rather than to standard output" << std::endl;
+  std::cerr << "       CAPTURE_FILE_OR_DIRECTORY: A file written with -record, or a directory whose" << std::endl;
+  std::cerr << "                    capture files are all analyzed (other files are skipped)" << std::endl;
+  exit(-1);
+}
+
+// Add the capture files in a directory, sorted by name, to the list.
+// Returns false if it is not a directory.
+static bool AddCapturesInDirectory(const std::string &dirName,
+  std::vector<std::string> &files)
+{
+  std::vector<std::string> names;
+#ifdef _WIN32
+  WIN32_FIND_DATAA data;
+  HANDLE h = FindFirstFileA((dirName + "\\*").c_str(), &data);
+  if (h == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  do {
+    if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+      names.push_back(data.cFileName);
+    }
+  } while (FindNextFileA(h, &data));
+  FindClose(h);
+  const char *separator = "\\";
+#else
+  DIR *dir = opendir(dirName.c_str());
+  if (dir == NULL) {
+    return false;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    struct stat s;
+    std::string path = dirName + "/" + entry->d_name;
+    if ((stat(path.c_str(), &s) == 0) && S_ISREG(s.st_mode)) {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  const char *separator = "/";
+#endif
+  std::sort(names.begin(), names.end());
+  for (size_t i = 0; i < names.size(); i++) {
+    std::string path = dirName + separator + names[i];
+    if (DeviceThreadCaptureReader::IsCaptureFile(path)) {
+      files.push_back(path);
+    }
+  }
+  return true;
+}
+
+int main(int argc, const char *argv[])
+{
+  // Parse the command line.
+  unsigned threads = 0;
+  bool arrivalTime = false;
+  LatencySearchOptions latencySearch;
+  std::string outputFileName;
+  std::vector<std::string> inputs;
+  for (size_t i = 1; i < argc; i++) {
+    if (argv[i] == std::string("-threads")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -threads parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      threads = atoi(argv[i]);
+      if (threads < 1) {
+        std::cerr << "Error: -threads parameter must be >= 1, found "
+          << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-estimator")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -estimator parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!ArduinoComparer::latencyEstimatorFromName(argv[i], latencySearch.estimator)) {
+        std::cerr << "Error: Unrecognized -estimator: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-latencyRange")) {
+      if (i + 2 >= argc) {
+        std::cerr << "Error: -latencyRange parameter requires two values" << std::endl;
+        Usage(argv[0]);
+      }
+      latencySearch.minSeconds = atof(argv[++i]) * 1e-3;
+      latencySearch.maxSeconds = atof(argv[++i]) * 1e-3;
+      if (latencySearch.maxSeconds <= latencySearch.minSeconds) {
+        std::cerr << "Error: -latencyRange maximum must be larger than minimum" << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-arrivalTime")) {
+      arrivalTime = true;
+    } else if (argv[i] == std::string("-output")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -output parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      outputFileName = argv[i];
+    } else if (argv[i][0] == '-') {
+      Usage(argv[0]);
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+  if (inputs.empty()) {
+    Usage(argv[0]);
+  }
+
+  // Find the sessions to analyze.  Files named on the command line are
+  // always analyzed, so that a bad one shows up in the summary.
+  std::vector<std::string> files;
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (!AddCapturesInDirectory(inputs[i], files)) {
+      files.push_back(inputs[i]);
+    }
+  }
+  if (files.empty()) {
+    std::cerr << "No capture files found" << std::endl;
+    return -2;
+  }
+
+  std::ofstream outputFile;
+  if (!outputFileName.empty()) {
+    outputFile.open(outputFileName.c_str());
+    if (!outputFile) {
+      std::cerr << "Could not create " << outputFileName << std::endl;
+      return -3;
+    }
+  }
+  std::ostream &out = outputFileName.empty() ? std::cout : outputFile;
+
+  // Analyze all of the sessions.  Each one is independent and its result
+  // goes into its own entry, so the summary comes out in the same order
+  // no matter how many threads are used.
+  if (threads == 0) {
+    threads = ParallelForDefaultThreads();
+  }
+  std::cerr << "Analyzing " << files.size() << " sessions using "
+    << std::min<size_t>(threads, files.size()) << " threads" << std::endl;
+  // Each session is analyzed on a single thread unless there are fewer
+  // sessions than threads.
+  if (files.size() >= threads) {
+    latencySearch.threads = 1;
+  }
+  std::vector<SessionAnalysis> results(files.size());
+  DeviceThreadTime start = DeviceThreadNow();
+  ParallelFor(files.size(), [&](size_t i) {
+    AnalyzeSession(files[i], arrivalTime, latencySearch, results[i]);
+  }, threads);
+  double elapsed = DeviceThreadSeconds(DeviceThreadNow() - start);
+
+  // Write the summary.
+  out << "file,ok,arduinoChannel,deviceChannel,mappingEntries,minArduinoValue,"
+    "maxArduinoValue,interpolatedValues,arduinoReports,deviceReports,"
+    "latencyMilliseconds,error" << std::endl;
+  size_t failed = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    const SessionAnalysis &r = results[i];
+    out << r.fileName << "," << (r.ok ? 1 : 0)
+      << "," << r.arduinoChannel << "," << r.deviceChannel
+      << "," << r.mappingEntries
+      << "," << r.minArduinoValue << "," << r.maxArduinoValue
+      << "," << r.interpolatedValues
+      << "," << r.arduinoReports << "," << r.deviceReports << ",";
+    if (r.ok) {
+      out << r.latencySeconds * 1e3;
+    } else {
+      failed++;
+    }
+    out << "," << r.error << std::endl;
+  }
+  std::cerr << "Analyzed " << results.size() << " sessions (" << failed
+    << " failed) in " << elapsed << " seconds" << std::endl;
+
+  return failed == 0 ? 0 : 1;
+}
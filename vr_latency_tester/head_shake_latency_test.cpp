@@ -19,7 +19,10 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <memory>
 #include <DeviceThreadVRPNTracker.h>
+#include <DeviceThreadCapture.h>
+#include <DeviceThreadReplay.h>
 #include <OscillationEstimator.h>
 
 // Global state.
@@ -28,9 +31,13 @@ unsigned g_verbosity = 2;       //< Larger numbers are more verbose
 
 void Usage(std::string name)
 {
-  std::cerr << "Usage: " << name << " [-verbosity N] TrackerName Sensor" << std::endl;
+  std::cerr << "Usage: " << name << " [-verbosity N] [-record FILE] [-replay FILE] [-replayMode paced|fast] [-replaySpeed X] TrackerName Sensor" << std::endl;
   std::cerr << "       -verbosity: How much info to print (default "
     << g_verbosity << ")" << std::endl;
+  std::cerr << "       -record: Save every report from the tracker to a capture file for later analysis" << std::endl;
+  std::cerr << "       -replay: Play back a capture made with -record instead of using the tracker (TrackerName is then ignored)" << std::endl;
+  std::cerr << "       -replayMode: paced (default) plays back at the recorded timing, fast as quickly as the program can read" << std::endl;
+  std::cerr << "       -replaySpeed: How many times faster than recorded to play back in paced mode (default 1)" << std::endl;
   std::cerr << "       TrackerName: The Name of the tracker to use (e.g., com_osvr_Multiserver/OSVRHackerDevKit0@localhost)" << std::endl;
   std::cerr << "       Sensor: The sensor to read from (e.g., 0)" << std::endl;
   exit(-1);
@@ -42,6 +49,10 @@ int main(int argc, const char *argv[])
   size_t realParams = 0;
   std::string trackerName;
   int trackerSensor;
+  std::string recordFileName;
+  std::string replayFileName;
+  DeviceThreadReplayMode replayMode = DEVICE_THREAD_REPLAY_PACED;
+  double replaySpeed = 1;
   for (size_t i = 1; i < argc; i++) {
     if (argv[i] == std::string("-verbosity")) {
       if (++i > argc) {
@@ -49,6 +60,38 @@ int main(int argc, const char *argv[])
         Usage(argv[0]);
       }
       g_verbosity = atoi(argv[i]);
+    } else if (argv[i] == std::string("-record")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -record parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      recordFileName = argv[i];
+    } else if (argv[i] == std::string("-replay")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -replay parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      replayFileName = argv[i];
+    } else if (argv[i] == std::string("-replayMode")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -replayMode parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!DeviceThreadReplay::ReplayModeFromName(argv[i], replayMode)) {
+        std::cerr << "Error: Unrecognized -replayMode: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-replaySpeed")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -replaySpeed parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      replaySpeed = atof(argv[i]);
+      if (replaySpeed <= 0) {
+        std::cerr << "Error: -replaySpeed must be positive, found "
+          << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
     } else if (argv[i][0] == '-') {
         Usage(argv[0]);
     } else switch (++realParams) {
@@ -68,8 +111,26 @@ int main(int argc, const char *argv[])
 
   //-----------------------------------------------------------------
   // Construct the thread to handle the to-be-measured
-  // reading from the Device.
-  DeviceThreadVRPNTracker device(trackerName);
+  // reading from the Device, or from a capture file when replaying.
+  std::unique_ptr<DeviceThread> device;
+  if (!replayFileName.empty()) {
+    device.reset(new DeviceThreadReplay(replayFileName, "device",
+      replayMode, replaySpeed));
+  } else {
+    device.reset(new DeviceThreadVRPNTracker(trackerName));
+  }
+
+  // If asked, record every report we read so the session can be
+  // analyzed again later.  The file is completed when the recorder is
+  // destroyed; if we're killed first, the reader recovers what was
+  // written.  When we're not recording, the recorder ignores everything
+  // it is given.
+  DeviceThreadCaptureWriter recorder;
+  if (!recordFileName.empty() && !recorder.Open(recordFileName)) {
+    return -9;
+  }
+  int deviceStream = recorder.AddStream("device");
+  recorder.RecordMarker("device " + trackerName);
 
   //-----------------------------------------------------------------
   // Wait until we get at least one report from the device
@@ -82,7 +143,8 @@ int main(int argc, const char *argv[])
     std::cout << "Waiting for reports from tracker (you may need to move it):" << std::endl;
   }
   do {
-    r = device.GetReports();
+    device->WaitForReports(1, 0.1, r);
+    recorder.Record(deviceStream, r);
     vrpn_gettimeofday(&now, NULL);
   } while ( (r.size() == 0)
             && (vrpn_TimevalDurationSeconds(now, start) < 5) );
@@ -105,7 +167,14 @@ int main(int argc, const char *argv[])
 
   OscillationEstimator est(1.0, g_verbosity);
   while (true) {
-    r = device.GetReports();
+    device->GetReports(r);
+    recorder.Record(deviceStream, r);
+
+    // Stop when the device stops (as it does at the end of a replay).
+    if (r.empty() && device->IsBroken()) {
+      std::cout << "Tracker stopped reporting" << std::endl;
+      break;
+    }
     if (g_verbosity >= 3) {
       std::cout << "Got " << r.size() << " reports" << std::endl;
     }
@@ -0,0 +1,367 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// Measures how long it takes a report to get from the device thread to
+// the application.  The producer stamps each report with a high-resolution
+// time just before handing it off and the consumer, which polls the same
+// way the latency-test applications do, measures how long it took to see
+// it.  This is done both for DeviceThread's lock-free queue and for the
+// semaphore-protected vector it used to use, so they can be compared on
+// the machine being used for testing.
+//   With -policies, it instead measures what each DeviceThread wait policy
+// costs: a writer thread sends stamped samples down a pipe (standing in
+// for a serial port) and the device thread records how long each sample
+// sat in the pipe before it was read, along with how much of the time
+// the device thread spent blocked rather than using the CPU.
+
+#include <stdlib.h>
+#include <string>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <DeviceThread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#endif
+
+// Global state.
+
+size_t g_count = 100000;        //< How many reports to send
+double g_rate = 1000;           //< Reports per second (0 means as fast as possible)
+
+void Usage(std::string name)
+{
+  std::cerr << "Usage: " << name << " [-count N] [-rate HZ] [-capacity N] [-policies]" << std::endl;
+  std::cerr << "       -count: Number of reports to send (default "
+    << g_count << ")" << std::endl;
+  std::cerr << "       -rate: Reports per second, 0 for as fast as possible (default "
+    << g_rate << ")" << std::endl;
+  std::cerr << "       -capacity: Lock-free queue capacity (default "
+    << DeviceThread::DEFAULT_REPORT_CAPACITY << ")" << std::endl;
+  std::cerr << "       -policies: Measure the latency and CPU cost of each wait policy instead" << std::endl;
+  exit(-1);
+}
+
+// High-resolution time in nanoseconds, stored in the report's first value.
+// A double holds nanosecond counts exactly for over 100 days of uptime.
+static double NowNanoseconds()
+{
+  return static_cast<double>(DeviceThreadNow());
+}
+
+// Helper that paces the producer.  Returns true when it is time for the
+// next report.
+class Pacer {
+  public:
+    Pacer() : m_sent(0), m_start(NowNanoseconds()) {}
+    bool ready() {
+      if (m_sent >= g_count) { return false; }
+      if (g_rate > 0) {
+        double due = m_start + m_sent * 1e9 / g_rate;
+        if (NowNanoseconds() < due) { return false; }
+      }
+      m_sent++;
+      return true;
+    }
+    bool done() const { return m_sent >= g_count; }
+  protected:
+    size_t m_sent;
+    double m_start;
+};
+
+//=======================================================
+// Lock-free version: a DeviceThread whose device produces stamped reports.
+
+class BenchmarkDeviceThread : public DeviceThread {
+  public:
+    BenchmarkDeviceThread(size_t capacity) : DeviceThread(capacity) {
+      StartThread();
+    }
+    ~BenchmarkDeviceThread() { StopThread(); }
+
+  protected:
+    Pacer m_pacer;
+    virtual bool ServiceDevice() {
+      if (m_pacer.ready()) {
+        DeviceThreadValues values;
+        values.push_back(NowNanoseconds());
+        AddReport(values);
+      }
+      return true;
+    }
+};
+
+//=======================================================
+// Semaphore version: what DeviceThread did before the lock-free queue.
+
+class SemaphoreHandoff {
+  public:
+    SemaphoreHandoff() {
+      vrpn_ThreadData td;
+      td.pvUD = this;
+      m_thread = new vrpn_Thread(ThreadToRun, td);
+      m_thread->go();
+    }
+    ~SemaphoreHandoff() {
+      while (m_thread->running()) {
+        vrpn_SleepMsecs(1);
+      }
+      delete m_thread;
+    }
+
+    std::vector<DeviceThreadReport> GetReports() {
+      std::vector<DeviceThreadReport> ret;
+      m_reportSemaphore.p();
+      ret = m_reports;
+      m_reports.clear();
+      m_reportSemaphore.v();
+      return ret;
+    }
+
+  protected:
+    vrpn_Thread *m_thread;
+    std::vector<DeviceThreadReport> m_reports;
+    vrpn_Semaphore m_reportSemaphore;
+
+    static void ThreadToRun(vrpn_ThreadData &threadData) {
+      SemaphoreHandoff *me = static_cast<SemaphoreHandoff *>(threadData.pvUD);
+      Pacer pacer;
+      while (!pacer.done()) {
+        if (pacer.ready()) {
+          DeviceThreadReport r;
+          r.values.push_back(NowNanoseconds());
+          r.arrivalTime = DeviceThreadNow();
+          r.sampleTime = r.arrivalTime;
+          me->m_reportSemaphore.p();
+          me->m_reports.push_back(r);
+          me->m_reportSemaphore.v();
+        }
+      }
+    }
+};
+
+//=======================================================
+// Consumer side, shared by both.
+
+template <class SOURCE>
+static std::vector<double> Consume(SOURCE &source)
+{
+  std::vector<double> latencies;
+  latencies.reserve(g_count);
+
+  // Stop when we've gotten everything or when nothing has shown up for a
+  // second (which means reports were dropped).
+  double lastSeen = NowNanoseconds();
+  while (latencies.size() < g_count) {
+    std::vector<DeviceThreadReport> r = source.GetReports();
+    double now = NowNanoseconds();
+    for (size_t i = 0; i < r.size(); i++) {
+      latencies.push_back(now - r[i].values[0]);
+    }
+    if (r.size() > 0) {
+      lastSeen = now;
+    } else if (now - lastSeen > 1e9) {
+      break;
+    }
+  }
+  return latencies;
+}
+
+static void PrintPercentiles(const std::string &name, std::vector<double> latencies);
+
+#ifndef _WIN32
+//=======================================================
+// Wait-policy measurement: a DeviceThread reading stamped samples from a
+// pipe, which it can wait on when using the event policy.
+
+class PipeDeviceThread : public DeviceThread {
+  public:
+    PipeDeviceThread(DeviceThreadWaitPolicy policy) {
+      if (pipe(m_fds) != 0) {
+        m_broken = true;
+        return;
+      }
+      fcntl(m_fds[0], F_SETFL, O_NONBLOCK);
+      SetWaitPolicy(policy);
+      StartThread();
+    }
+    ~PipeDeviceThread() {
+      if (!m_broken) {
+        StopThread();
+        close(m_fds[0]);
+        close(m_fds[1]);
+      }
+    }
+    int WriteDescriptor() const { return m_fds[1]; }
+
+  protected:
+    int m_fds[2];
+
+    // Report the time each sample was written and the time we read it.
+    virtual bool ServiceDevice() {
+      double written;
+      while (read(m_fds[0], &written, sizeof(written)) == sizeof(written)) {
+        DeviceThreadValues values;
+        values.push_back(written);
+        values.push_back(NowNanoseconds());
+        AddReport(values);
+      }
+      return true;
+    }
+
+    virtual bool WaitForDeviceEvent(const struct timeval &timeout) {
+      fd_set readSet;
+      FD_ZERO(&readSet);
+      FD_SET(m_fds[0], &readSet);
+      struct timeval t = timeout;
+      select(m_fds[0] + 1, &readSet, NULL, NULL, &t);
+      return true;
+    }
+};
+
+// Writes stamped samples into the pipe at the requested rate, sleeping in
+// between the way a serial device would leave the reader idle.
+static void PipeWriter(vrpn_ThreadData &threadData)
+{
+  int fd = *static_cast<int *>(threadData.pvUD);
+  double start = NowNanoseconds();
+  double rate = g_rate > 0 ? g_rate : 1000;
+  for (size_t i = 0; i < g_count; i++) {
+    double due = start + i * 1e9 / rate;
+    double now = NowNanoseconds();
+    if (due > now) {
+      vrpn_SleepMsecs((due - now) * 1e-6);
+    }
+    now = NowNanoseconds();
+    if (write(fd, &now, sizeof(now)) != sizeof(now)) {
+      return;
+    }
+  }
+}
+
+static void MeasureWaitPolicy(const std::string &name,
+  DeviceThreadWaitPolicy policy)
+{
+  PipeDeviceThread device(policy);
+  if (device.IsBroken()) {
+    std::cerr << "Could not open pipe" << std::endl;
+    return;
+  }
+  int fd = device.WriteDescriptor();
+  vrpn_ThreadData td;
+  td.pvUD = &fd;
+  vrpn_Thread writer(PipeWriter, td);
+  writer.go();
+
+  // Collect how long each sample waited to be read.  We don't need to
+  // see the reports right away, so we sleep between checks to leave the
+  // CPU to the threads being measured.
+  std::vector<double> delays;
+  delays.reserve(g_count);
+  bool writing = true;
+  do {
+    // Check whether the writer is done before reading, so that the last
+    // pass picks up everything it wrote.
+    writing = writer.running();
+    vrpn_SleepMsecs(writing ? 1 : 10);
+    std::vector<DeviceThreadReport> r = device.GetReports();
+    for (size_t i = 0; i < r.size(); i++) {
+      delays.push_back(r[i].values[1] - r[i].values[0]);
+    }
+  } while (writing);
+
+  DeviceThreadWaitStatistics stats = device.GetWaitStatistics();
+  PrintPercentiles(name + " wait policy, time in pipe", delays);
+  double blockedPercent = 0;
+  if (stats.elapsedSeconds > 0) {
+    blockedPercent = 100 * stats.blockedSeconds / stats.elapsedSeconds;
+  }
+  std::cout << "  waits: " << stats.waits << ", blocked "
+    << blockedPercent << "% of the time" << std::endl;
+}
+#endif
+
+static void PrintPercentiles(const std::string &name, std::vector<double> latencies)
+{
+  std::cout << name << ": " << latencies.size() << " reports received" << std::endl;
+  if (latencies.size() == 0) { return; }
+  std::sort(latencies.begin(), latencies.end());
+  const double percentiles[] = { 50, 90, 99, 99.9 };
+  for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+    size_t index = static_cast<size_t>(percentiles[i] / 100 * (latencies.size() - 1));
+    std::cout << "  p" << percentiles[i] << ": "
+      << latencies[index] * 1e-3 << " us" << std::endl;
+  }
+  std::cout << "  max: " << latencies.back() * 1e-3 << " us" << std::endl;
+}
+
+int main(int argc, const char *argv[])
+{
+  // Parse the command line.
+  size_t capacity = DeviceThread::DEFAULT_REPORT_CAPACITY;
+  bool policies = false;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i] == std::string("-count")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -count parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      g_count = atoi(argv[i]);
+    } else if (argv[i] == std::string("-rate")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -rate parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      g_rate = atof(argv[i]);
+    } else if (argv[i] == std::string("-capacity")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -capacity parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      capacity = atoi(argv[i]);
+    } else if (argv[i] == std::string("-policies")) {
+      policies = true;
+    } else {
+      Usage(argv[0]);
+    }
+  }
+
+  if (policies) {
+#ifndef _WIN32
+    MeasureWaitPolicy("Spin", DEVICE_THREAD_WAIT_SPIN);
+    MeasureWaitPolicy("Spin-then-block", DEVICE_THREAD_WAIT_SPIN_THEN_BLOCK);
+    MeasureWaitPolicy("Event-driven", DEVICE_THREAD_WAIT_EVENT);
+    return 0;
+#else
+    std::cerr << "-policies is not supported on Windows" << std::endl;
+    return -1;
+#endif
+  }
+
+  {
+    SemaphoreHandoff semaphore;
+    PrintPercentiles("Semaphore-protected vector", Consume(semaphore));
+  }
+  {
+    BenchmarkDeviceThread lockFree(capacity);
+    PrintPercentiles("Lock-free ring buffer", Consume(lockFree));
+    std::cout << "  dropped: " << lockFree.GetDroppedReportCount() << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,150 @@
+/*
+  Copyright 2015 ReliaSolve.com
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+// Checks that every version of SumSquaredDifferences() this processor can
+// run gives bit-for-bit the same result as the scalar version, and times
+// each of them.  The check covers every length up to a few vector widths,
+// so each way of splitting into blocks and a tail gets used, along with
+// longer odd lengths and arrays that don't start on a vector boundary.
+// It returns nonzero if any version differs.
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <iostream>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <SquaredErrorKernel.h>
+#include <DeviceThread.h>
+
+// Global state.
+
+size_t g_length = 100000;       //< Elements per array when timing
+size_t g_repeats = 1000;        //< Sums per version when timing
+
+void Usage(std::string name)
+{
+  std::cerr << "Usage: " << name << " [-length N] [-repeats N]" << std::endl;
+  std::cerr << "       -length: Elements per array when timing (default "
+    << g_length << ")" << std::endl;
+  std::cerr << "       -repeats: Sums to time for each version (default "
+    << g_repeats << ")" << std::endl;
+  exit(-1);
+}
+
+// Compare the bits, so that a difference in the last place counts.
+static bool SameBits(double a, double b)
+{
+  return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// Check every available version against the scalar one for one length
+// and starting offset into the arrays.  Returns the number of mismatches.
+static size_t CheckLength(const std::vector<std::string> &versions,
+  const std::vector<float> &a, const std::vector<float> &b,
+  size_t offset, size_t length)
+{
+  size_t failures = 0;
+  double expected = SumSquaredDifferencesScalar(&a[offset], &b[offset], length);
+  for (size_t v = 0; v < versions.size(); v++) {
+    double sum;
+    if (!SumSquaredDifferencesUsing(versions[v], &a[offset], &b[offset],
+        length, sum) || !SameBits(sum, expected)) {
+      std::cerr << "Mismatch: " << versions[v] << " gave " << sum
+        << " rather than " << expected << " for length " << length
+        << " at offset " << offset << std::endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int main(int argc, const char *argv[])
+{
+  // Parse the command line.
+  for (int i = 1; i < argc; i++) {
+    if (argv[i] == std::string("-length")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -length parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      g_length = atoi(argv[i]);
+    } else if (argv[i] == std::string("-repeats")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -repeats parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      g_repeats = atoi(argv[i]);
+    } else {
+      Usage(argv[0]);
+    }
+  }
+
+  std::vector<std::string> versions = SumSquaredDifferencesVersions();
+  std::cout << "SumSquaredDifferences() uses " << SumSquaredDifferencesVersion()
+    << "; available:";
+  for (size_t v = 0; v < versions.size(); v++) {
+    std::cout << " " << versions[v];
+  }
+  std::cout << std::endl;
+
+  // Fill the arrays with values like the mapping tables hold, with a
+  // fixed seed so that any mismatch can be reproduced.
+  static const size_t MAX_OFFSET = 7;
+  static const size_t SHORT_LENGTHS = 67;
+  static const size_t LONG_LENGTHS[] = { 1001, 4099, 10007 };
+  size_t size = std::max(g_length, LONG_LENGTHS[2]) + MAX_OFFSET;
+  std::mt19937 random(1);
+  std::uniform_real_distribution<float> value(-1000, 1000);
+  std::vector<float> a(size), b(size);
+  for (size_t i = 0; i < size; i++) {
+    a[i] = value(random);
+    b[i] = value(random);
+  }
+
+  // Check the versions against each other.
+  size_t failures = 0;
+  size_t checks = 0;
+  for (size_t offset = 0; offset <= MAX_OFFSET; offset++) {
+    for (size_t length = 0; length <= SHORT_LENGTHS; length++) {
+      failures += CheckLength(versions, a, b, offset, length);
+      checks++;
+    }
+    for (size_t i = 0; i < sizeof(LONG_LENGTHS) / sizeof(LONG_LENGTHS[0]); i++) {
+      failures += CheckLength(versions, a, b, offset, LONG_LENGTHS[i]);
+      checks++;
+    }
+  }
+  std::cout << "Checked " << checks << " lengths and offsets: "
+    << failures << " mismatches" << std::endl;
+
+  // Time each version.
+  for (size_t v = 0; v < versions.size(); v++) {
+    double sum = 0, total = 0;
+    DeviceThreadTime start = DeviceThreadNow();
+    for (size_t r = 0; r < g_repeats; r++) {
+      SumSquaredDifferencesUsing(versions[v], &a[0], &b[0], g_length, sum);
+      total += sum;
+    }
+    double seconds = DeviceThreadSeconds(DeviceThreadNow() - start);
+    std::cout << "  " << versions[v] << ": "
+      << seconds * 1e9 / (static_cast<double>(g_repeats) * g_length)
+      << " ns per element (checksum " << total << ")" << std::endl;
+  }
+
+  return (failures == 0) ? 0 : -1;
+}
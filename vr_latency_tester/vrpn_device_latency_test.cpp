@@ -19,9 +19,15 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <memory>
+#include <fstream>
+#include <DeviceThreadHub.h>
+#include <DeviceThreadCapture.h>
+#include <DeviceThreadReplay.h>
 #include <DeviceThreadVRPNAnalog.h>
 #include <DeviceThreadVRPNTracker.h>
 #include <ArduinoComparer.h>
+#include <OnlineLatencyEstimator.h>
 #include <vrpn_Streaming_Arduino.h>
 
 // Global state.
@@ -32,9 +38,32 @@ int g_arduinoChannel = 0;
 
 void Usage(std::string name)
 {
-  std::cerr << "Usage: " << name << " Arduino_serial_port Arduino_channel DEVICE_TYPE [Device_config_file|Device_device_name] Device_channel [-count N] [-arrivalTime] [-verbosity N]" << std::endl;
+  std::cerr << "Usage: " << name << " Arduino_serial_port Arduino_channel DEVICE_TYPE [Device_config_file|Device_device_name] Device_channel [-count N] [-arrivalTime] [-estimator search|xcorr|extrema] [-window SECONDS] [-arduinoMax N] [-live] [-bootstrap N] [-allChannels] [-analysisThreads N] [-errorCurve FILE] [-sweeps FILE] [-velocityProfile FILE] [-latencyRange MIN MAX] [-waitPolicy spin|block|event] [-hub] [-realtime P] [-cpus LIST] [-lockMemory] [-dmaLatency] [-record FILE] [-replay FILE] [-replayMode paced] [-replaySpeed X] [-verbosity N]" << std::endl;
   std::cerr << "       -count: Repeat the test N times (default 10)" << std::endl;
   std::cerr << "       -arrivalTime: Use arrival time of messages (default is reported sampling time)" << std::endl;
+  std::cerr << "       -window: Compute the latency from only the last SECONDS of the measurement, which keeps memory use flat on long runs (default all of it)" << std::endl;
+  std::cerr << "       -arduinoMax: Largest value the Arduino input reports, such as 4095 for a 12-bit converter (default "
+    << ArduinoComparer::DEFAULT_ARDUINO_MAX << ")" << std::endl;
+  std::cerr << "       -live: Print the latency over the last few seconds every half second while measuring" << std::endl;
+  std::cerr << "       -bootstrap: Also report a 95% confidence interval and standard error for the latency from N resamples of the sweeps (at least 2, usually 200 or more)" << std::endl;
+  std::cerr << "       -allChannels: Also report the latency of every device channel and which follows the Arduino most closely" << std::endl;
+  std::cerr << "       -analysisThreads: Threads to compute the latency on, 0 for one per processor (default 0)" << std::endl;
+  std::cerr << "       -errorCurve: Write the error at each offset in the latency range, 1 millisecond apart, to FILE" << std::endl;
+  std::cerr << "       -sweeps: Write the latency of each sweep of the motion to FILE and report their spread" << std::endl;
+  std::cerr << "       -velocityProfile: Write the latency at each of several ranges of Arduino speed to FILE and report them" << std::endl;
+  std::cerr << "       -estimator: How to estimate the latency: search (default, minimize the squared error) xcorr (FFT cross-correlation, faster on long captures) or extrema (time between matching turnarounds, fastest but noisiest)" << std::endl;
+  std::cerr << "       -latencyRange: Smallest and largest latency to look for in milliseconds (default "
+    << LatencySearchOptions().minSeconds * 1e3 << " to " << LatencySearchOptions().maxSeconds * 1e3 << ")" << std::endl;
+  std::cerr << "       -waitPolicy: How device threads wait when idle: spin (default, lowest latency), block (spin then sleep), event (spin then wait for data)" << std::endl;
+  std::cerr << "       -hub: Service both devices from a single thread rather than one thread each" << std::endl;
+  std::cerr << "       -realtime: Run device threads with SCHED_FIFO priority P (needs privileges)" << std::endl;
+  std::cerr << "       -cpus: Run device threads only on the listed CPUs (example: 2,3 or 2-3)" << std::endl;
+  std::cerr << "       -lockMemory: Lock the program's memory into RAM (needs privileges)" << std::endl;
+  std::cerr << "       -dmaLatency: Hold /dev/cpu_dma_latency at 0 during the test (needs privileges)" << std::endl;
+  std::cerr << "       -record: Save every report from both devices to a capture file for later analysis" << std::endl;
+  std::cerr << "       -replay: Play back a capture made with -record instead of using the devices (the serial port, device type and device name are then ignored)" << std::endl;
+  std::cerr << "       -replayMode: paced (default) plays back at the recorded timing; fast is not available because it would not keep the two devices in step" << std::endl;
+  std::cerr << "       -replaySpeed: How many times faster than recorded to play back in paced mode (default 1)" << std::endl;
   std::cerr << "       -verbosity: How much info to print (default "
     << g_verbosity << ")" << std::endl;
   std::cerr << "       Arduino_serial_port: Name of the serial device to use "
@@ -50,6 +79,22 @@ void Usage(std::string name)
   exit(-1);
 }
 
+// Helper function that prints how a device thread has been waiting, so
+// the cost of the different wait policies can be compared.
+
+static void PrintWaitStatistics(const std::string &name, const DeviceThread &t)
+{
+  DeviceThreadWaitStatistics s = t.GetWaitStatistics();
+  double blockedPercent = 0;
+  if (s.elapsedSeconds > 0) {
+    blockedPercent = 100 * s.blockedSeconds / s.elapsedSeconds;
+  }
+  std::cout << name << " thread: " << s.reports << " reports, "
+    << s.waits << " waits, blocked " << blockedPercent << "% of the time, "
+    << "sample-to-arrival delay mean " << s.meanDelaySeconds * 1e3
+    << " ms, max " << s.maxDelaySeconds * 1e3 << " ms" << std::endl;
+}
+
 // Helper function that creates a vrpn_Streaming_Arduino given a name
 // and connection to use.  It uses the global state telling which channel
 // the potentiometer is on to determine how many ports to request.
@@ -66,6 +111,8 @@ int main(int argc, const char *argv[])
   // Constants that may some day become options.
   size_t REQUIRED_PASSES = 3;
   int TURN_AROUND_THRESHOLD = 7;
+  size_t VELOCITY_BINS = 8;
+  double LIVE_WINDOW_SECONDS = 5;
 
   // Parse the command line.
   size_t realParams = 0;
@@ -74,6 +121,23 @@ int main(int argc, const char *argv[])
   int deviceChannel = 0;
   int count = 10;
   bool arrivalTime = false;
+  LatencySearchOptions latencySearch;
+  std::string errorCurveFileName;
+  std::string sweepsFileName;
+  std::string velocityProfileFileName;
+  bool liveEstimate = false;
+  LatencyBootstrapOptions bootstrap;
+  bool computeConfidence = false;
+  bool allChannels = false;
+  double windowSeconds = 0;
+  size_t arduinoMax = ArduinoComparer::DEFAULT_ARDUINO_MAX;
+  DeviceThreadWaitPolicy waitPolicy = DEVICE_THREAD_WAIT_SPIN;
+  bool useHub = false;
+  DeviceThreadSchedulingOptions scheduling;
+  std::string recordFileName;
+  std::string replayFileName;
+  DeviceThreadReplayMode replayMode = DEVICE_THREAD_REPLAY_PACED;
+  double replaySpeed = 1;
   for (size_t i = 1; i < argc; i++) {
     if (argv[i] == std::string("-count")) {
       if (++i > argc) {
@@ -92,8 +156,147 @@ int main(int argc, const char *argv[])
         Usage(argv[0]);
       }
       g_verbosity = atoi(argv[i]);
+    } else if (argv[i] == std::string("-window")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -window parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      windowSeconds = atof(argv[i]);
+    } else if (argv[i] == std::string("-arduinoMax")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -arduinoMax parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (atoi(argv[i]) < 1) {
+        std::cerr << "Error: -arduinoMax parameter must be >= 1, found "
+          << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+      arduinoMax = atoi(argv[i]);
+    } else if (argv[i] == std::string("-live")) {
+      liveEstimate = true;
+    } else if (argv[i] == std::string("-bootstrap")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -bootstrap parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (atoi(argv[i]) < 2) {
+        std::cerr << "Error: -bootstrap parameter must be >= 2, found "
+          << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+      bootstrap.resamples = atoi(argv[i]);
+      computeConfidence = true;
+    } else if (argv[i] == std::string("-allChannels")) {
+      allChannels = true;
+    } else if (argv[i] == std::string("-analysisThreads")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -analysisThreads parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      latencySearch.threads = atoi(argv[i]);
+    } else if (argv[i] == std::string("-errorCurve")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -errorCurve parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      errorCurveFileName = argv[i];
+    } else if (argv[i] == std::string("-sweeps")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -sweeps parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      sweepsFileName = argv[i];
+    } else if (argv[i] == std::string("-velocityProfile")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -velocityProfile parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      velocityProfileFileName = argv[i];
+    } else if (argv[i] == std::string("-estimator")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -estimator parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!ArduinoComparer::latencyEstimatorFromName(argv[i], latencySearch.estimator)) {
+        std::cerr << "Error: Unrecognized -estimator: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-latencyRange")) {
+      if (i + 2 >= argc) {
+        std::cerr << "Error: -latencyRange parameter requires two values" << std::endl;
+        Usage(argv[0]);
+      }
+      latencySearch.minSeconds = atof(argv[++i]) * 1e-3;
+      latencySearch.maxSeconds = atof(argv[++i]) * 1e-3;
+      if (latencySearch.maxSeconds <= latencySearch.minSeconds) {
+        std::cerr << "Error: -latencyRange maximum must be larger than minimum" << std::endl;
+        Usage(argv[0]);
+      }
     } else if (argv[i] == std::string("-arrivalTime")) {
       arrivalTime = true;
+    } else if (argv[i] == std::string("-waitPolicy")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -waitPolicy parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!DeviceThread::WaitPolicyFromName(argv[i], waitPolicy)) {
+        std::cerr << "Error: Unrecognized -waitPolicy: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-hub")) {
+      useHub = true;
+    } else if (argv[i] == std::string("-realtime")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -realtime parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      scheduling.realtimePriority = atoi(argv[i]);
+    } else if (argv[i] == std::string("-cpus")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -cpus parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!DeviceThreadParseCpuList(argv[i], scheduling.cpus)) {
+        std::cerr << "Error: Bad -cpus list: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-record")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -record parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      recordFileName = argv[i];
+    } else if (argv[i] == std::string("-replay")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -replay parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      replayFileName = argv[i];
+    } else if (argv[i] == std::string("-replayMode")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -replayMode parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      if (!DeviceThreadReplay::ReplayModeFromName(argv[i], replayMode)) {
+        std::cerr << "Error: Unrecognized -replayMode: " << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-replaySpeed")) {
+      if (++i >= argc) {
+        std::cerr << "Error: -replaySpeed parameter requires value" << std::endl;
+        Usage(argv[0]);
+      }
+      replaySpeed = atof(argv[i]);
+      if (replaySpeed <= 0) {
+        std::cerr << "Error: -replaySpeed must be positive, found "
+          << argv[i] << std::endl;
+        Usage(argv[0]);
+      }
+    } else if (argv[i] == std::string("-lockMemory")) {
+      scheduling.lockMemory = true;
+    } else if (argv[i] == std::string("-dmaLatency")) {
+      scheduling.holdDmaLatency = true;
     } else if (argv[i][0] == '-') {
         Usage(argv[0]);
     } else switch (++realParams) {
@@ -120,33 +323,92 @@ int main(int argc, const char *argv[])
     Usage(argv[0]);
   }
 
+  // Fast replay drains each stream on its own, so the Arduino and device
+  // reports would not reach us in the order they arrived, and the mapping
+  // pairs each Arduino value with the device report read alongside it.
+  if (!replayFileName.empty() && (replayMode == DEVICE_THREAD_REPLAY_FAST)) {
+    std::cerr << "Error: -replayMode fast cannot keep the two devices in step; "
+      << "use -replaySpeed to replay faster, or batch_latency_analyzer" << std::endl;
+    Usage(argv[0]);
+  }
+
+  // If asked, construct a hub to service both devices from one thread.
+  // It is declared before the devices so that it is destroyed after them.
+  std::unique_ptr<DeviceThreadHub> hub;
+  if (useHub) {
+    hub.reset(new DeviceThreadHub());
+    hub->SetWaitPolicy(waitPolicy);
+  }
+
   // Construct the thread to handle the ground-truth potentiometer
-  // reading from the Ardiuno.
-  DeviceThreadVRPNAnalog  arduino(CreateStreamingServer);
+  // reading from the Ardiuno.  When replaying, both devices come from
+  // the capture file instead, starting together so they stay in step.
+  std::unique_ptr<DeviceThread> arduino;
+  DeviceThread *device = NULL;
+  if (!replayFileName.empty()) {
+    DeviceThreadTime replayStart = DeviceThreadNow();
+    arduino.reset(new DeviceThreadReplay(replayFileName, "arduino",
+      replayMode, replaySpeed, replayStart, hub.get()));
+    device = new DeviceThreadReplay(replayFileName, "device",
+      replayMode, replaySpeed, replayStart, hub.get());
+  } else {
+    arduino.reset(new DeviceThreadVRPNAnalog(CreateStreamingServer, hub.get()));
+  }
 
   // Construct the thread to handle the to-be-measured
   // reading from the Device.  If the "config file" name
   // has an '@' sign in it, treat it as a device name and construct
   // a remote device using it as the name.
-  DeviceThread *device = NULL;
   size_t at = deviceConfigFileName.find('@');
 
-  if (deviceType == "analog") {
+  if (device) {
+    // Already constructed for replay.
+  } else if (deviceType == "analog") {
     if (at != std::string::npos) {
-      device = new DeviceThreadVRPNAnalog(deviceConfigFileName);
+      device = new DeviceThreadVRPNAnalog(deviceConfigFileName, hub.get());
     } else {
-      device = new DeviceThreadVRPNAnalog(deviceConfigFileName, "Analog0");
+      device = new DeviceThreadVRPNAnalog(deviceConfigFileName, "Analog0", hub.get());
     }
   } else if (deviceType == "tracker") {
     if (at != std::string::npos) {
-      device = new DeviceThreadVRPNTracker(deviceConfigFileName);
+      device = new DeviceThreadVRPNTracker(deviceConfigFileName, 0, hub.get());
     } else {
-      device = new DeviceThreadVRPNTracker(deviceConfigFileName, "Tracker0");
+      device = new DeviceThreadVRPNTracker(deviceConfigFileName, "Tracker0", 0, hub.get());
     }
   } else {
     std::cerr << "Unrecognized device type: " << deviceType << std::endl;
     return -2;
   }
+  arduino->SetWaitPolicy(waitPolicy);
+  device->SetWaitPolicy(waitPolicy);
+
+  // Keep the device threads from being preempted, if asked to, and
+  // report which settings actually took effect.
+  DeviceThreadSchedulingStatus arduinoScheduling, deviceScheduling;
+  arduino->SetSchedulingOptions(scheduling, arduinoScheduling);
+  device->SetSchedulingOptions(scheduling, deviceScheduling);
+  if (g_verbosity > 0) {
+    std::cout << "Arduino thread: "
+      << DeviceThreadDescribeScheduling(scheduling, arduinoScheduling) << std::endl;
+    std::cout << "Device thread: "
+      << DeviceThreadDescribeScheduling(scheduling, deviceScheduling) << std::endl;
+  }
+
+  // If asked, record every report we read from either device, along with
+  // what we're comparing and when each phase of the test starts, so the
+  // session can be analyzed again later.  When we're not recording,
+  // the recorder ignores everything it is given.
+  DeviceThreadCaptureWriter recorder;
+  if (!recordFileName.empty() && !recorder.Open(recordFileName)) {
+    delete device;
+    return -9;
+  }
+  int arduinoStream = recorder.AddStream("arduino");
+  int deviceStream = recorder.AddStream("device");
+  recorder.RecordMarker("device " + deviceConfigFileName);
+  recorder.RecordMarker("arduinoChannel " + std::to_string(g_arduinoChannel));
+  recorder.RecordMarker("deviceChannel " + std::to_string(deviceChannel));
+  recorder.RecordMarker("arduinoMax " + std::to_string(arduinoMax));
 
   //-----------------------------------------------------------------
   // Wait until we get at least one report from each device
@@ -162,7 +424,10 @@ int main(int argc, const char *argv[])
   }
   double lastArduinoValue, lastDeviceValue;
   do {
-    r = arduino.GetReports();
+    // Block briefly on each device that has not reported yet rather than
+    // spinning; each returns as soon as it has a report.
+    arduino->WaitForReports(arduinoCount == 0 ? 1 : 0, 0.05, r);
+    recorder.Record(arduinoStream, r);
     if (r.size() > 0) {
       if (r[0].values.size() <= g_arduinoChannel) {
         std::cerr << "Report size from Arduino: " << r[0].values.size()
@@ -174,7 +439,8 @@ int main(int argc, const char *argv[])
     }
     arduinoCount += r.size();
 
-    r = device->GetReports();
+    device->WaitForReports(deviceCount == 0 ? 1 : 0, 0.05, r);
+    recorder.Record(deviceStream, r);
     if (r.size() > 0) {
       if (r[0].values.size() <= deviceChannel) {
         std::cerr << "Report size from Device: " << r[0].values.size()
@@ -216,12 +482,17 @@ int main(int argc, const char *argv[])
   }
 
   // Clear out all available reports so we start fresh
-  arduino.GetReports();
-  device->GetReports();
+  arduino->GetReports(r);
+  recorder.Record(arduinoStream, r);
+  device->GetReports(r);
+  recorder.Record(deviceStream, r);
+  recorder.RecordMarker("phase mapping");
 
   // Keep shoveling values into the vectors until they have turned
   // around at least 8 times (four up, four down)
-  ArduinoComparer aComp;
+  ArduinoComparer aComp(arduinoMax);
+  aComp.setLatencySearch(latencySearch);
+  aComp.setReportRetention(windowSeconds, 0);
   size_t requiredTurns = 2 * REQUIRED_PASSES;
   int lastDirection = 1;  //< 1 for going up, -1 for going down  
   double lastExtremum = lastArduinoValue;
@@ -231,11 +502,20 @@ int main(int argc, const char *argv[])
     double thisArduinoValue = lastArduinoValue;
 
     // Find the new value for the Arduino and the Device, if any.
-    r = arduino.GetReports();
+    // We only make progress when the Arduino reports, so we sleep until
+    // it does and then read whatever the Device has sent.
+    arduino->WaitForReports(1, 0.1, r);
+    if (r.empty() && arduino->IsBroken()) {
+      std::cerr << "Arduino stopped reporting while mapping" << std::endl;
+      delete device;
+      return -10;
+    }
+    recorder.Record(arduinoStream, r);
     if (r.size() > 0) {
       thisArduinoValue = r.back().values[g_arduinoChannel];
     }
-    r = device->GetReports();
+    device->GetReports(r);
+    recorder.Record(deviceStream, r);
     if (r.size() > 0) {
       lastDeviceValue = r.back().values[deviceChannel];
     }
@@ -293,7 +573,8 @@ int main(int argc, const char *argv[])
 
   // Have them cycle the rotation the specified number of times
   // moving rapidly and keep track of all of the reports from both the
-  // Arduino and the Device.
+  // Arduino and the Device.  We measure how the device threads wait
+  // only during this phase.
   //   Keep shoveling values into the vectors until they have turned
   // around at least twice the specified number of times (up and down
   // down again for each)
@@ -307,19 +588,57 @@ int main(int argc, const char *argv[])
   lastDirection = 1;  //< 1 for going up, -1 for going down  
   lastExtremum = lastArduinoValue;
   numTurns = 0;
+  arduino->ResetWaitStatistics();
+  device->ResetWaitStatistics();
+  std::unique_ptr<OnlineLatencyEstimator> live;
+  if (liveEstimate) {
+    live.reset(new OnlineLatencyEstimator(aComp, g_arduinoChannel, deviceChannel,
+      arrivalTime, LIVE_WINDOW_SECONDS));
+  }
+  recorder.RecordMarker("phase measurement");
   std::vector<DeviceThreadReport> arduinoReports, deviceReports;
   do {
     // Fill in a default value in case we get no reports.
     double thisArduinoValue = lastArduinoValue;
 
     // Find the new value for the Arduino and the Device, if any.
-    r = arduino.GetReports();
+    arduino->WaitForReports(1, 0.1, r);
+    // If the Arduino stops (as it does at the end of a replay), analyze
+    // what we have so far.
+    if (r.empty() && arduino->IsBroken()) {
+      std::cerr << "Arduino stopped reporting after " << numTurns
+        << " turns; computing latency from what we have" << std::endl;
+      // A replayed device may still have reports recorded after the
+      // Arduino's last one; take them all, until it finishes too.  A live
+      // device never finishes, so we just take what it has queued.
+      do {
+        if (replayFileName.empty()) {
+          device->GetReports(r);
+        } else {
+          device->WaitForReports(1, 0.1, r);
+        }
+        recorder.Record(deviceStream, r);
+        aComp.addDeviceReports(r);
+      } while (!replayFileName.empty() && (!r.empty() || !device->IsBroken()));
+      break;
+    }
+    recorder.Record(arduinoStream, r);
     aComp.addArduinoReports(r);
+    if (live) { live->addArduinoReports(r); }
     if (r.size() > 0) {
       thisArduinoValue = r.back().values[g_arduinoChannel];
     }
-    r = device->GetReports();
+    device->GetReports(r);
+    recorder.Record(deviceStream, r);
     aComp.addDeviceReports(r);
+    if (live) {
+      live->addDeviceReports(r);
+      double liveLatency;
+      if (live->update(liveLatency)) {
+        std::cout << "  Latency over the last " << LIVE_WINDOW_SECONDS
+          << " seconds (milliseconds): " << liveLatency * 1e3 << std::endl;
+      }
+    }
 
     // If we have a new Arduino value, check to see if we've turned around.
     if (thisArduinoValue != lastArduinoValue) {
@@ -349,16 +668,125 @@ int main(int argc, const char *argv[])
       lastArduinoValue = thisArduinoValue;
     }    
   } while (numTurns < requiredTurns);
+  if (g_verbosity > 1) {
+    PrintWaitStatistics("Arduino", *arduino);
+    PrintWaitStatistics("Device", *device);
+  }
+
+  recorder.RecordMarker("phase done");
+  if (recorder.IsOpen() && !recorder.Close()) {
+    std::cerr << "Could not finish writing " << recordFileName << std::endl;
+  }
 
-  // Compute the latency between the Arduino and the device
+  // Compute the latency between the Arduino and the device, along with
+  // its uncertainty if we've been asked to.
   double latency;
-  if (!aComp.computeLatency(g_arduinoChannel, deviceChannel, latency, arrivalTime)) {
+  LatencyConfidence confidence;
+  bool computed;
+  if (computeConfidence) {
+    computed = aComp.computeLatencyConfidence(g_arduinoChannel, deviceChannel,
+      bootstrap, confidence, arrivalTime);
+    latency = confidence.latencySeconds;
+  } else {
+    computed = aComp.computeLatency(g_arduinoChannel, deviceChannel, latency, arrivalTime);
+  }
+  if (!computed) {
     std::cerr << "Could not compute latency" << std::endl;
     delete device;
     return -8;
   }
-  std::cout << "Error-minimizing latency, device behind Arduino (milliseconds): "
+  std::cout << ArduinoComparer::latencyEstimatorDescription(latencySearch.estimator)
+    << " latency, device behind Arduino (milliseconds): "
     << latency * 1e3 << std::endl;
+  if (computeConfidence) {
+    std::cout << "  Standard error " << confidence.standardErrorSeconds * 1e3
+      << ", " << bootstrap.confidenceLevel * 100 << "% confidence interval "
+      << confidence.lowSeconds * 1e3 << " to " << confidence.highSeconds * 1e3
+      << " (from " << confidence.resamples << " resamples of "
+      << confidence.sweeps << " sweeps)" << std::endl;
+  }
+
+  // Report each device channel if we've been asked to.
+  if (allChannels) {
+    std::vector<ChannelLatency> channels;
+    size_t best;
+    if (!aComp.computeChannelLatencies(g_arduinoChannel, channels, best, arrivalTime)) {
+      std::cerr << "Could not compute latency for each channel" << std::endl;
+    } else {
+      std::cout << "Latency for each device channel (milliseconds, correlation):" << std::endl;
+      for (size_t i = 0; i < channels.size(); i++) {
+        std::cout << "  Channel " << channels[i].channel << ": "
+          << channels[i].latencySeconds * 1e3 << " (" << channels[i].correlation
+          << ")" << std::endl;
+      }
+      std::cout << "Best-aligned channel: " << channels[best].channel << std::endl;
+    }
+  }
+
+  // Write the error curve if we've been asked to.
+  if (!errorCurveFileName.empty()) {
+    std::vector<double> offsets, errors;
+    size_t steps = static_cast<size_t>(
+      (latencySearch.maxSeconds - latencySearch.minSeconds) / 1e-3 + 0.5);
+    for (size_t i = 0; i <= steps; i++) {
+      offsets.push_back(latencySearch.minSeconds + i * 1e-3);
+    }
+    std::ofstream curve(errorCurveFileName.c_str());
+    if (!curve || !aComp.computeErrorCurve(g_arduinoChannel, deviceChannel, offsets,
+          errors, arrivalTime)) {
+      std::cerr << "Could not write error curve to " << errorCurveFileName << std::endl;
+      delete device;
+      return -11;
+    }
+    curve << "offsetMilliseconds,error" << std::endl;
+    for (size_t i = 0; i < offsets.size(); i++) {
+      curve << offsets[i] * 1e3 << "," << errors[i] << std::endl;
+    }
+  }
+
+  // Write the latency of each sweep if we've been asked to.
+  if (!sweepsFileName.empty()) {
+    std::vector<SweepLatency> sweeps;
+    SweepLatencySummary summary;
+    std::ofstream out(sweepsFileName.c_str());
+    if (!out || !aComp.computeSweepLatencies(g_arduinoChannel, deviceChannel, sweeps,
+          TURN_AROUND_THRESHOLD, arrivalTime)) {
+      std::cerr << "Could not write sweep latencies to " << sweepsFileName << std::endl;
+      delete device;
+      return -12;
+    }
+    out << "startSeconds,endSeconds,deviceReports,latencyMilliseconds" << std::endl;
+    for (size_t i = 0; i < sweeps.size(); i++) {
+      out << sweeps[i].startSeconds << "," << sweeps[i].endSeconds << ","
+        << sweeps[i].deviceReports << "," << sweeps[i].latencySeconds * 1e3 << std::endl;
+    }
+    ArduinoComparer::summarizeSweepLatencies(sweeps, summary);
+    std::cout << "Latency over " << summary.sweeps << " sweeps (milliseconds): min "
+      << summary.minSeconds * 1e3 << ", median " << summary.medianSeconds * 1e3
+      << ", p95 " << summary.p95Seconds * 1e3 << ", max " << summary.maxSeconds * 1e3
+      << std::endl;
+  }
+
+  // Write the latency at different speeds if we've been asked to.
+  if (!velocityProfileFileName.empty()) {
+    std::vector<VelocityLatency> profile;
+    std::ofstream out(velocityProfileFileName.c_str());
+    if (!out || !aComp.computeVelocityProfile(g_arduinoChannel, deviceChannel,
+          VELOCITY_BINS, profile, 20e-3, arrivalTime)) {
+      std::cerr << "Could not write velocity profile to " << velocityProfileFileName << std::endl;
+      delete device;
+      return -13;
+    }
+    out << "minSpeed,maxSpeed,meanSpeed,deviceReports,latencyMilliseconds" << std::endl;
+    std::cout << "Latency by Arduino speed (values per second: milliseconds):" << std::endl;
+    for (size_t i = 0; i < profile.size(); i++) {
+      out << profile[i].minSpeed << "," << profile[i].maxSpeed << ","
+        << profile[i].meanSpeed << "," << profile[i].deviceReports << ","
+        << profile[i].latencySeconds * 1e3 << std::endl;
+      std::cout << "  " << profile[i].minSpeed << " to " << profile[i].maxSpeed
+        << ": " << profile[i].latencySeconds * 1e3 << std::endl;
+    }
+  }
 
   // We're done.  Shut down the threads and exit.
   delete device;